@@ -4,8 +4,8 @@ mkdir -p results
 
 status=$?
 
-src_file_arr=("test0_sanity.c" "test1_mult.c" "test2_recursion.c" "test3_no_symbol.c" "test4_return_value.c" "test5_not_global.c" "test6_internal_call.c" "test7_mutual_recursion.c" "test8_call_by_pointer.c" "test9_while_foo.c" "test10_cmdline_args.c")
-target_func=("foo" "foo" "rec_foo" "DNE" "foo" "noneOfYourBusiness" "foo" "mut_rec_foo" "foo" "foo" "foo")
+src_file_arr=("test0_sanity.c" "test1_mult.c" "test2_recursion.c" "test3_no_symbol.c" "test4_return_value.c" "test5_not_global.c" "test6_internal_call.c" "test7_mutual_recursion.c" "test8_call_by_pointer.c" "test9_while_foo.c" "test10_cmdline_args.c" "test11_multi_funcs.c" "test0_sanity.c" "test13_ifunc.c")
+target_func=("foo" "foo" "rec_foo" "DNE" "foo" "noneOfYourBusiness" "foo" "mut_rec_foo" "foo" "foo" "foo" "foo,bar,DNE,rec_foo" "foo,foo" "ifunc_foo")
 
 echo "Static tests:"
 for i in ${!src_file_arr[@]}; do
@@ -36,4 +36,64 @@ for i in ${!src_file_arr[@]}; do
   fi
 done
 
-rm out
+echo "--------------------------------------"
+
+echo "Thread tests:"
+gcc -std=c99 -O2 -shared -fPIC -o libprfagent.so ../prf_agent.c -ldl
+gcc -no-pie -std=c99 -w -o out_static ./test_src_files/test12_threads.c ./test_src_files/library.c -Wl,-zlazy -pthread
+gcc -no-pie -std=c99 -w -o out_dynamic ./test_src_files/test12_threads.c /usr/lib/libtest_atam_hw3.so -Wl,-zlazy -pthread
+thread_backend=("ptrace" "hwbp" "trampoline" "ptrace" "hwbp" "preload")
+thread_link=("static" "static" "static" "dynamic" "dynamic" "dynamic")
+for i in ${!thread_backend[@]}; do
+  ./prf --backend=${thread_backend[$i]} --summary call_f_ptr out_${thread_link[$i]} > ./results/res_threads_$i
+  if diff -q ./results/res_threads_$i ./expected/exp_threads_$i > /dev/null;
+  then 
+    echo "Test $i passed" 
+  else 
+    echo "Test $i failed" 
+  fi
+done
+
+echo "--------------------------------------"
+
+echo "Trace tests:"
+gcc -std=c99 -O2 -pthread -o prf-report ../prf_report.c
+gcc -no-pie -std=c99 -w -o out_static ./test_src_files/test11_multi_funcs.c ./test_src_files/library.c -Wl,-zlazy
+gcc -no-pie -std=c99 -w -o out_dynamic ./test_src_files/test11_multi_funcs.c /usr/lib/libtest_atam_hw3.so -Wl,-zlazy
+trace_link=("static" "dynamic")
+for i in ${!trace_link[@]}; do
+  ./prf --trace=./results/trace_$i foo,bar,rec_foo out_${trace_link[$i]} > ./results/res_trace_$i
+  ./prf-report ./results/trace_$i | grep -v latency >> ./results/res_trace_$i
+  if diff -q ./results/res_trace_$i ./expected/exp_trace_$i > /dev/null;
+  then 
+    echo "Test $i passed" 
+  else 
+    echo "Test $i failed" 
+  fi
+done
+
+echo "--------------------------------------"
+
+echo "Malformed ELF tests:"
+gcc -no-pie -std=c99 -w -o out_static ./test_src_files/test0_sanity.c ./test_src_files/library.c -Wl,-zlazy
+gcc -no-pie -std=c99 -w -o out_dynamic ./test_src_files/test0_sanity.c /usr/lib/libtest_atam_hw3.so -Wl,-zlazy
+echo "int main() { return 0; }" > bad_0
+head -c 1000 out_static > bad_1
+cp out_static bad_2
+printf '\xff\xff\xff\x7f' | dd of=bad_2 bs=1 seek=40 conv=notrunc 2> /dev/null
+cp out_dynamic bad_3
+gnu_hash=$(readelf -SW bad_3 | sed -n 's/.* \.gnu\.hash *GNU_HASH *[0-9a-f]* \([0-9a-f]*\) .*/\1/p')
+printf '\0\0\0\0' | dd of=bad_3 bs=1 seek=$((16#$gnu_hash)) conv=notrunc 2> /dev/null
+chmod +x bad_0 bad_1 bad_2 bad_3
+# not an ELF file, cut off before the section headers, e_shoff past the end, a .gnu.hash with no buckets
+for i in 0 1 2 3; do
+  ./prf foo bad_$i > ./results/res_malformed_$i
+  if diff -q ./results/res_malformed_$i ./expected/exp_malformed_$i > /dev/null;
+  then 
+    echo "Test $i passed" 
+  else 
+    echo "Test $i failed" 
+  fi
+done
+
+rm out out_static out_dynamic bad_0 bad_1 bad_2 bad_3
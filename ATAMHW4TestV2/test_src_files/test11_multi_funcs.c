@@ -0,0 +1,9 @@
+int main()
+{
+  foo();
+  bar(3);
+  rec_foo(1, 1);
+  foo();
+  mut_rec_foo();
+  return 0;
+}
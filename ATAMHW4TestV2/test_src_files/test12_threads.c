@@ -0,0 +1,30 @@
+#include <pthread.h>
+
+int twice(int n)
+{
+  return 2 * n;
+}
+
+void* worker(void* arg)
+{
+  for(int i = 0; i < 50; i++)
+  {
+    call_f_ptr(twice, i);
+  }
+  return arg;
+}
+
+int main()
+{
+  pthread_t threads[4];
+  call_f_ptr(twice, 1);
+  for(int i = 0; i < 4; i++)
+  {
+    pthread_create(&threads[i], NULL, worker, NULL);
+  }
+  for(int i = 0; i < 4; i++)
+  {
+    pthread_join(threads[i], NULL);
+  }
+  return 0;
+}
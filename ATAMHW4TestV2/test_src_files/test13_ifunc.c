@@ -0,0 +1,27 @@
+int use_slow = 0;
+
+int ifunc_slow(int n)
+{
+  return n + 1;
+}
+
+int ifunc_fast(int n)
+{
+  return n + 2;
+}
+
+void* resolve_ifunc_foo()
+{
+  return use_slow ? (void*)ifunc_slow : (void*)ifunc_fast;
+}
+
+int ifunc_foo(int n) __attribute__((ifunc("resolve_ifunc_foo")));
+
+int main()
+{
+  for(int i = 0; i < 3; i++)
+  {
+    ifunc_foo(i);
+  }
+  return 0;
+}
@@ -0,0 +1,44 @@
+#!/bin/bash
+# What reading a big executable costs prf: a target with SYMS functions and DEBUG_MB of (fake) debug info,
+# run under --elf=map and --elf=pread. Prints what prf read, its peak RSS and page faults (--syscall-stats).
+#   ./elf_bench.sh [SYMS] [DEBUG_MB]
+
+SYMS=${1:-200000}
+DEBUG_MB=${2:-2048}
+mkdir -p build
+gcc -std=c99 -O2 -o build/prf ../debug.c || exit 1
+
+# main calls f0 a few times; f1..fN are only there to make .symtab / .strtab big
+if [ ! -f build/big_$SYMS.o ]; then
+  {
+    echo '    .text'
+    echo '    .globl main'
+    echo 'main:'
+    echo '    call f0'
+    echo '    call f0'
+    echo '    xorl %eax, %eax'
+    echo '    ret'
+    awk -v n=$SYMS 'BEGIN { for(i = 0; i < n; i++) printf "    .globl f%d\n    .type f%d, @function\nf%d:\n    movl $%d, %%eax\n    ret\n", i, i, i, i }'
+  } > build/big_$SYMS.s
+  gcc -c -o build/big_$SYMS.o build/big_$SYMS.s || exit 1
+fi
+if [ ! -f build/big_${SYMS}_$DEBUG_MB ]; then
+  gcc -no-pie -o build/big_$SYMS build/big_$SYMS.o || exit 1
+  truncate -s ${DEBUG_MB}M build/debug_blob
+  objcopy --add-section .debug_fake=build/debug_blob build/big_$SYMS build/big_${SYMS}_$DEBUG_MB || exit 1
+  rm -f build/debug_blob
+fi
+target=build/big_${SYMS}_$DEBUG_MB
+
+# cold page cache when we may drop it, so major faults show what really came off the disk
+drop_caches() { sync; echo 3 > /proc/sys/vm/drop_caches 2>/dev/null; }
+
+echo "$SYMS symbols, $(( $(stat -c %s $target) >> 20 )) MB"
+for mode in map pread; do
+  drop_caches
+  start=$(date +%s%N)
+  build/prf --summary --syscall-stats --elf=$mode f0 $target > build/out_elf_$mode 2>&1
+  elapsed=$(( $(date +%s%N) - start ))
+  awk -v mode=$mode -v t=$elapsed 'BEGIN { printf "%-6s %10.1f ms  ", mode, t / 1e6 }'
+  grep -h "PRF:: ELF" build/out_elf_$mode | sed 's/^PRF:: ELF [^:]*: //'
+done
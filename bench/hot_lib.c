@@ -0,0 +1,7 @@
+// hot() for the dynamic build of hot_loop.c
+int hot(int x)
+{
+    static volatile int acc;
+    acc += x;
+    return acc & 0xff;
+}
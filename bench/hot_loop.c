@@ -0,0 +1,24 @@
+// Benchmark target: calls hot() argv[1] times (default 200000). Built static (hot in the executable) and dynamic
+// (hot in libhot.so, -DHOT_LIB) by run_bench.sh.
+#include <stdlib.h>
+
+#ifdef HOT_LIB
+int hot(int x);
+#else
+int __attribute__((noinline)) hot(int x)
+{
+    static volatile int acc;
+    acc += x;
+    return acc & 0xff;
+}
+#endif
+
+int main(int argc, char* argv[])
+{
+    int calls = argc > 1 ? atoi(argv[1]) : 200000;
+    volatile int sink = 0;
+    for(int i = 0; i < calls; i++) {
+        sink += hot(i);
+    }
+    return 0;
+}
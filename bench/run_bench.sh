@@ -0,0 +1,38 @@
+#!/bin/bash
+# Per-call overhead of prf's backends: time a loop of CALLS calls to hot() untraced and under every backend
+# (--summary, so printing isn't what we measure).
+#   ./run_bench.sh [CALLS]
+
+CALLS=${1:-200000}
+mkdir -p build
+gcc -std=c99 -O2 -o build/prf ../debug.c || exit 1
+gcc -std=c99 -O2 -shared -fPIC ../prf_agent.c -o build/libprfagent.so -ldl || exit 1
+gcc -no-pie -O1 -o build/hot_static hot_loop.c
+gcc -O1 -shared -fPIC -o build/libhot.so hot_lib.c
+gcc -no-pie -O1 -DHOT_LIB -o build/hot_dynamic hot_loop.c -Lbuild -lhot -Wl,-rpath,"$PWD/build"
+
+now_ns() { date +%s%N; }
+
+# run NAME TARGET PRF_ARGS... - prints the per-call overhead over the untraced run of TARGET
+run() {
+  local name=$1 target=$2; shift 2
+  local start=$(now_ns)
+  "$@" build/$target $CALLS > build/out_${name}_$target 2>&1
+  local elapsed=$(( $(now_ns) - start ))
+  awk -v name=$name -v target=$target -v t=$elapsed -v base=${base_ns[$target]} -v calls=$CALLS \
+      'BEGIN { printf "%-12s %-12s %10.1f ms %10.1f ns/call\n", name, target, t / 1e6, (t - base) / calls }'
+  grep -h "tracer syscalls\|dropped" build/out_${name}_$target | sed 's/^/             /'
+}
+
+declare -A base_ns
+for target in hot_static hot_dynamic; do
+  start=$(now_ns); build/$target $CALLS; base_ns[$target]=$(( $(now_ns) - start ))
+done
+
+echo "$CALLS calls"
+run ptrace     hot_static  build/prf --summary --syscall-stats hot
+run hwbp       hot_static  build/prf --summary --syscall-stats --backend=hwbp hot
+run trampoline hot_static  build/prf --summary --backend=trampoline hot
+run ptrace     hot_dynamic build/prf --summary --syscall-stats hot
+run hwbp       hot_dynamic build/prf --summary --syscall-stats --backend=hwbp hot
+run preload    hot_dynamic build/prf --summary --backend=preload --agent=build/libprfagent.so hot
@@ -0,0 +1,172 @@
+// Name lookups in a symbol table with no hash section and no cache: a strcmp per symbol, the built index
+// (symIndexBuild + lookups), and the scan (strtabFind + the st_name pass). SYMS symbols in random string order,
+// every 4th name merged into the tail of the one before it, like ld does. Then symIndexBuild alone on 1, 2, 4 and
+// 8 threads (--index-threads), checked against the one-thread index.
+//
+// Build:   gcc -std=c99 -O2 -o build/sym_bench sym_bench.c
+//          ./build/sym_bench [SYMS] [NAMES]
+#define main prfMain
+#include "../debug.c"
+#undef main
+
+#define ROUNDS 5
+
+static Elf64_Sym* syms;
+static char* strs;
+static unsigned long strs_size;
+static const char** names;
+
+// Name: makeTable
+// "do_handler_<i>" for i % 4 == 0, and "handler_<i - 1>" pointing into it for the next one
+static void makeTable(int sym_num)
+{
+    syms = calloc(sym_num, sizeof(Elf64_Sym));
+    strs = malloc((unsigned long)sym_num * 24 + 1);
+    int* order = malloc(sym_num * sizeof(int));
+    strs[0] = '\0';
+    strs_size = 1;
+    for(int i = 1; i < sym_num; i++) {
+        order[i] = i;
+    }
+    for(int i = sym_num - 1; i > 1; i--)                                                   // symbol i gets the string of order[i]: random order
+    {
+        int j = 1 + rand() % i;
+        int t = order[i]; order[i] = order[j]; order[j] = t;
+    }
+    Elf64_Word* offset_of = malloc(sym_num * sizeof(Elf64_Word));
+    for(int s = 1; s < sym_num; s++)
+    {
+        if(s % 4 == 1 && s + 1 < sym_num)
+        {
+            offset_of[s] = strs_size;
+            offset_of[s + 1] = strs_size + 3;                                               // "handler_<s>" = tail of "do_handler_<s>"
+            strs_size += sprintf(strs + strs_size, "do_handler_%d", s) + 1;
+            s++;
+            continue;
+        }
+        offset_of[s] = strs_size;
+        strs_size += sprintf(strs + strs_size, "func_%d", s) + 1;
+    }
+    for(int i = 1; i < sym_num; i++)
+    {
+        syms[i].st_name = offset_of[order[i]];
+        syms[i].st_info = ELF64_ST_INFO(GLOBAL, 2);
+    }
+    free(order);
+    free(offset_of);
+}
+
+// Name: strcmpLookup
+// One strcmp per symbol, in table order
+static int strcmpLookup(const char* name, int sym_num, int* matches)
+{
+    int found = 0;
+    for(int i = 1; i < sym_num && found < MAX_SYM_MATCHES; i++)
+    {
+        if(strcmp(strs + syms[i].st_name, name) == 0) {
+            matches[found++] = i;
+        }
+    }
+    return found;
+}
+
+int main(int argc, char** argv)
+{
+    int sym_num = argc > 1 ? atoi(argv[1]) : 1000000;
+    int name_num = argc > 2 ? atoi(argv[2]) : 4;
+    srand(1);
+    makeTable(sym_num);
+    names = malloc(name_num * sizeof(char*));
+    for(int n = 0; n < name_num; n++)                                                       // a plain name, a tail-merged one, ... and one that isn't there
+    {
+        char* name = malloc(32);
+        int s = 1 + rand() % (sym_num - 2);
+        if(n == name_num - 1) {
+            sprintf(name, "missing_%d", s);
+        }
+        else if(n % 2 == 1) {
+            sprintf(name, "handler_%d", s - (s - 1) % 4);
+        }
+        else {
+            sprintf(name, "func_%d", s - (s - 1) % 4 + 2);
+        }
+        names[n] = name;
+    }
+
+    uint64_t best[3] = { UINT64_MAX, UINT64_MAX, UINT64_MAX };
+    int results[3][64][MAX_SYM_MATCHES], counts[3][64];
+    for(int round = 0; round < ROUNDS; round++)
+    {
+        uint64_t start = nowNs();
+        for(int n = 0; n < name_num; n++) {
+            counts[0][n % 64] = strcmpLookup(names[n], sym_num, results[0][n % 64]);
+        }
+        uint64_t t = nowNs() - start;
+        best[0] = t < best[0] ? t : best[0];
+
+        SymIndex index;
+        symIndexInit(&index, syms, strs, strs_size, sym_num, NULL, 0, NULL, 0);
+        start = nowNs();
+        symIndexBuild(&index);
+        for(int n = 0; n < name_num; n++) {
+            counts[1][n % 64] = symIndexLookup(&index, names[n], results[1][n % 64], MAX_SYM_MATCHES);
+        }
+        t = nowNs() - start;
+        best[1] = t < best[1] ? t : best[1];
+        symIndexFree(&index);
+
+        symIndexInit(&index, syms, strs, strs_size, sym_num, NULL, 0, NULL, 0);
+        start = nowNs();
+        for(int n = 0; n < name_num; n++) {
+            counts[2][n % 64] = symIndexScan(&index, names[n], results[2][n % 64], MAX_SYM_MATCHES);
+        }
+        t = nowNs() - start;
+        best[2] = t < best[2] ? t : best[2];
+    }
+
+    for(int n = 0; n < name_num && n < 64; n++)
+    {
+        for(int way = 1; way < 3; way++)
+        {
+            if(counts[way][n] != counts[0][n] || memcmp(results[way][n], results[0][n], counts[0][n] * sizeof(int)) != 0)
+            {
+                printf("%s: lookup %d disagrees with strcmp! :(\n", names[n], way);
+                return 1;
+            }
+        }
+    }
+    printf("%d symbols, %lu KB of strings, %d names (best of %d)\n", sym_num, strs_size >> 10, name_num, ROUNDS);
+    const char* ways[3] = { "strcmp loop", "build index", "scan" };
+    for(int way = 0; way < 3; way++) {
+        printf("%-12s %10.2f ms %10.2f ms/name\n", ways[way], best[way] / 1e6, best[way] / 1e6 / name_num);
+    }
+
+    SymIndex single;
+    options.index_threads = 1;
+    symIndexInit(&single, syms, strs, strs_size, sym_num, NULL, 0, NULL, 0);
+    symIndexBuild(&single);
+    for(int threads = 1; threads <= 8; threads *= 2)
+    {
+        uint64_t build_best = UINT64_MAX;
+        options.index_threads = threads;
+        for(int round = 0; round < ROUNDS; round++)
+        {
+            SymIndex index;
+            symIndexInit(&index, syms, strs, strs_size, sym_num, NULL, 0, NULL, 0);
+            uint64_t start = nowNs();
+            symIndexBuild(&index);
+            uint64_t t = nowNs() - start;
+            build_best = t < build_best ? t : build_best;
+            if(memcmp(index.buckets, single.buckets, single.bucket_num * sizeof(Elf64_Word)) != 0 ||
+               memcmp(index.chain, single.chain, sym_num * sizeof(Elf64_Word)) != 0 ||
+               memcmp(index.hashes, single.hashes, sym_num * sizeof(Elf64_Word)) != 0)
+            {
+                printf("%d threads: index differs from the one-thread index! :(\n", threads);
+                return 1;
+            }
+            symIndexFree(&index);
+        }
+        printf("build, %d thread%s %10.2f ms\n", threads, threads > 1 ? "s" : " ", build_best / 1e6);
+    }
+    return 0;
+}
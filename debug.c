@@ -1,26 +1,116 @@
+#define _GNU_SOURCE
 #include "elf64.h"
+#include "prf_ring.h"
+#include "prf_trace.h"
+#include "prf_stats.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <stddef.h>
+#include <limits.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/user.h>
 #include <sys/reg.h>
 #include <sys/types.h>
 #include <sys/ptrace.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <libgen.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <stdarg.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define GLOBAL 1
 #define SHF_ALLOC 2
 #define DT_PLTRELSZ 2
 #define ET_EXEC 2
+#define ET_DYN 3
+#define PT_LOAD 1
 #define SHT_SYMTAB 2
 #define SHT_STRTAB 3
 #define DT_PLTGOT 3
 #define SHT_RELA  4
+#define SHT_HASH 5
 #define SHT_DYNAMIC 6
+#define SHT_NOTE 7
+#define SHT_NOBITS 8
+#define SHT_DYNSYM 11
+#define SHT_GNU_HASH 0x6ffffff6
+#define SHT_GNU_VERSYM 0x6fffffff
+#define VERSYM_HIDDEN 0x8000                                                                // not the default version of the name - the loader doesn't bind to it
+#define DT_NULL 0
+#define DT_DEBUG 21
+#define STT_FUNC 2
+#define STT_GNU_IFUNC 10
+#define R_X86_64_IRELATIVE 37
+#define WEAK 2
+#define AT_ENTRY 9
+#define R_DEBUG_MAP_OFFSET 8                                                                // offsetof(struct r_debug, r_map)
+#define NT_GNU_BUILD_ID 3
+#define EI_CLASS 4
+#define ELFCLASS64 2
+
+#define FUNC_LIST_SEPARATOR ','
+#define BP_TABLE_INIT_SIZE 64                                                               // must be a power of 2
+#define NO_FUNC (-1)
+#define SHADOW_STACK_INIT_SIZE 64
+#define THREAD_LIST_INIT_SIZE 8
+#define SYM_CACHE_MAGIC "PRFSYMIX"
+#define SYM_CACHE_VERSION 1
+#define SYM_CACHE_KEY_SIZE 40                                                               // sha1 build-ids are 20 bytes, the inode key is 40
+#define SYM_CACHE_KEY_BUILD_ID 1
+#define SYM_CACHE_KEY_INODE 2
+#define REMOTE_PAGE_SIZE 4096UL
+#define REMOTE_CACHE_PAGES 8
+#define HW_BP_SLOTS 4                                                                       // DR0-DR3
+#define AGENT_LIB_NAME "libprfagent.so"
+#define AGENT_MAX_FUNCS 8                                                                   // = PRF_AGENT_MAX_FUNCS in prf_agent.c
+#define AGENT_RING_CAPACITY (1 << 16)                                                       // records, power of 2
+#define AGENT_POLL_NS 50000                                                                 // nap when the ring is empty
+#define MAX_INSN_LEN 15
+#define JMP_REL32_SIZE 5
+#define JMP_REL32_REACH 0x7FFF0000L
+#define TRAMP_MAX_FUNCS 32
+#define TRAMP_RING_CAPACITY (1 << 20)                                                       // records (32 bytes each), power of 2
+#define TRAMP_STACK_DEPTH (1 << 14)                                                         // shadow stack frames (32 bytes each)
+#define TRAMP_OFF_HEAD 0                                                                    // shared data: records written so far
+#define TRAMP_OFF_SP 8                                                                      //              shadow stack depth
+#define TRAMP_OFF_OVERFLOW 16                                                               //              calls not traced, shadow stack was full
+#define TRAMP_OFF_CALLS 64                                                                  //              outermost calls per function
+#define TRAMP_OFF_DEPTH (TRAMP_OFF_CALLS + 8 * TRAMP_MAX_FUNCS)                             //              nesting per function
+#define TRAMP_OFF_RING (TRAMP_OFF_DEPTH + 8 * TRAMP_MAX_FUNCS)                              //              PrfRecord ring
+#define TRAMP_OFF_STACK (TRAMP_OFF_RING + 32 * TRAMP_RING_CAPACITY)                         //              shadow stack - last, so an overflow faults
+#define TRAMP_DATA_SIZE (TRAMP_OFF_STACK + 32 * TRAMP_STACK_DEPTH)
+#define TRAMP_HINT_STEP (256UL << 20)                                                       // try mapping the code page 256MB, 512MB.. past the text
+#define DISPLACED_SLOT_SIZE 32                                                              // one instruction + jmp [rip] back (6 + 8)
+#define DISPLACED_AREA_SIZE (64UL << 10)                                                    // slots for 2048 breakpoint addresses
+#define DISPLACED_NONE 1UL                                                                  // Breakpoint.displaced: can't be stepped out of line
+#define LATENCY_CALIBRATE_ROUNDS 1000                                                       // stop round trips timed at startup
+#define GOVERNOR_TICK_MS 10                                                                 // --max-overhead: budget refills this often
+#define GOVERNOR_BURST_NS 100000000L                                                        // a full budget is P% of this much
+#define OUTPUT_QUEUE_CAPACITY (1 << 14)                                                     // returns on their way to the output thread, power of 2
+#define OUTPUT_BATCH_SIZE (64 << 10)                                                        // bytes of lines the output thread writes at once
+#define OUTPUT_POLL_NS 1000000                                                              // output thread's nap when the queue is empty
+#define ELF_MAX_TYPES 32                                                                    // distinct section types an ElfImage indexes
+#define ELF_MAP_MAX_SIZE (64UL << 20)                                                       // bigger files are read section by section (--elf=auto)
+#define MAX_SYM_MATCHES 16                                                                  // same name showing up more than this many times in one table - we don't care
+#define SYM_SCAN_MAX_LOOKUPS 4                                                              // names looked up by scanning a table before we index it
+#define SYM_SCAN_MAX_OFFSETS 64                                                             // strings equal to the name a scan keeps track of
+#define SYM_INDEX_THREAD_MIN (1 << 18)                                                      // smaller tables are indexed on the calling thread
+#define SYM_INDEX_MAX_THREADS 16
 
 // =====================================================================================================================================
 // ------------------------------------------------------ Declarations -----------------------------------------------------------------
@@ -33,343 +123,4667 @@ typedef enum {
     SYM_NOT_GLOBAL
 } SearchStatus;
 
-long getFuncAddr(void *elf_file, Elf64_Sym *symtab, char *strtab, char* func_name, int sym_num, bool* is_dyn);
-void* findSectionTable (void* elf_file, Elf64_Word sh_type, int* entry_num);
-SearchStatus findSymbol(Elf64_Sym *symtab, char *strtab, char* func_name, int symbol_num);
-SearchStatus checkExecutable(char* file_name);
-SearchStatus checkFunction(char* file_name, char* func_name, unsigned long* func_addr, bool* is_dyn);
+// One of these for every function name given on the command line
+typedef struct {
+    char* name;
+    SearchStatus status;
+    unsigned long address;                                                                  // entry address (PLT stub address until a dynamic func is resolved)
+    unsigned long got_offset;                                                               // GOT slot of a dynamic func, 0 otherwise
+    unsigned long ifunc_resolver;                                                           // an IFUNC of the executable: its resolver (the symbol's value)
+    bool is_dyn;
+    bool resolved;                                                                          // false until the GOT slot of a dynamic func holds the real address
+    unsigned long caller_start;                                                             // dynamic func: only calls from [start, end) count (the executable)
+    unsigned long caller_end;                                                               // until the first one returns, 0 / 0 = any call (--lib-calls)
+    int counter;                                                                            // run counter
+    int max_depth;                                                                          // most calls in flight on one thread
+    ReturnStats* ret_stats;                                                                 // --summary, allocated on the first return
+    LatencyStats* latency;                                                                  // --latency, allocated on the first return
+    long stop_budget;                                                                       // --max-overhead: ns of stops it may still cost
+    bool gated;                                                                             // --max-overhead: ran out - entry breakpoint out
+} TracedFunc;
+
+// Sections of one type, in file order: first, then ElfImage.next_of_type
+typedef struct {
+    Elf64_Word type;
+    int first;
+} ElfTypeHead;
+
+// One ELF file, opened and mapped once and checked up front (see ELF Image). Section 0 is the null section, so
+// 0 means "none" for every section index below.
+typedef struct {
+    int fd;
+    unsigned char* data;                                                                    // the whole file, NULL when streamed
+    unsigned long size;
+    bool streamed;                                                                          // pread what's asked for instead of mapping it all
+    void** loaded;                                                                          // streamed: every section read so far, NULL = not yet
+    unsigned long bytes_read;
+    Elf64_Ehdr* header;
+    Elf64_Phdr* segments;                                                                   // NULL if the program headers aren't in the file
+    int segment_num;
+    Elf64_Shdr* sections;                                                                   // NULL if the section headers aren't in the file
+    int section_num;
+    const char* names;                                                                      // .shstrtab, NULL if none
+    unsigned long names_size;
+    ElfTypeHead types[ELF_MAX_TYPES];                                                       // by type
+    int type_num;
+    int* next_of_type;                                                                      // per section: the next of its type, 0 = last
+    int* name_slots;                                                                        // by name: open addressing on gnuHash, 0 = empty
+    int name_slot_num;                                                                      // power of 2
+} ElfImage;
+
+// One entry of a note section
+typedef struct {
+    Elf64_Word type;
+    const char* name;
+    Elf64_Word name_size;
+    const unsigned char* desc;
+    Elf64_Word desc_size;
+} ElfNote;
+
+// Name -> symbol lookups over one symbol table. Uses the .hash / .gnu.hash of the table when the file has one,
+// otherwise scans the table for the first few names and builds its own chained hash index after that.
+typedef struct {
+    Elf64_Sym* syms;
+    char* strs;
+    unsigned long strs_size;                                                                // 0 = unknown (no scans then)
+    int sym_num;
+    int scans;                                                                              // lookups answered by symIndexScan so far
+    Elf64_Word* sysv_hash;                                                                  // .hash of this table, NULL if none
+    Elf64_Word* gnu_hash;                                                                   // .gnu.hash of this table, NULL if none
+    Elf64_Word hash_limit;                                                                  // symbol indices the native table hands out are below this
+    Elf64_Word* buckets;                                                                    // built index: bucket_num heads (power of 2)
+    Elf64_Word* chain;                                                                      // built index: next symbol with the same bucket, 0 ends it
+    Elf64_Word* hashes;                                                                     // built index: full hash of every symbol name
+    Elf64_Word bucket_num;
+    void* mapping;                                                                          // set when the built index lives in an mmap'd cache file
+    unsigned long mapping_size;
+} SymIndex;
+
+// One thread's share of building a SymIndex (see symIndexBuild): the symbols it hashes and hands out, then the
+// bucket range it links
+typedef struct {
+    SymIndex* index;
+    int worker_num;
+    int from;                                                                               // symbols [from, to) it hashes
+    int to;
+    int counts[SYM_INDEX_MAX_THREADS];                                                      // of those, how many every worker links - then where they go in order[]
+    Elf64_Word* order;                                                                      // all the symbols, grouped by the worker that links them
+    int link_from;                                                                          // order[link_from, link_to) are the ones it links
+    int link_to;
+    pthread_t thread;
+    bool started;
+} SymIndexWorker;
+
+// Header of a symbol index cache file. Everything before sym_num is the key - a cache entry is valid only if
+// all of it matches the binary we're looking at.
+typedef struct {
+    char magic[8];
+    Elf64_Word version;
+    Elf64_Word key_type;                                                                    // SYM_CACHE_KEY_BUILD_ID / SYM_CACHE_KEY_INODE
+    Elf64_Word key_len;
+    unsigned char key[SYM_CACHE_KEY_SIZE];                                                  // build-id, or dev, ino, size, mtime sec, mtime nsec
+    unsigned long symtab_size;
+    unsigned long strtab_size;
+    Elf64_Word sym_num;
+    Elf64_Word bucket_num;
+    unsigned long syms_offset;
+    unsigned long strs_offset;
+    unsigned long file_size;
+} SymCacheHeader;
+
+// One cached page of the child's memory
+typedef struct {
+    unsigned long address;                                                                  // page address, 0 = free
+    bool sticky;                                                                            // survives resuming the child (text we patch ourselves)
+    unsigned char data[REMOTE_PAGE_SIZE];
+} RemotePage;
+
+// Access to the child's memory (see Remote Memory)
+typedef struct {
+    pid_t pid;
+    int mem_fd;                                                                             // /proc/<pid>/mem, -1 = use PEEKTEXT/POKETEXT
+    int next_victim;
+    RemotePage pages[REMOTE_CACHE_PAGES];
+    int hw_slots;                                                                           // debug registers we may use (--backend=hwbp), 0 = int3 only
+    unsigned long hw_address[HW_BP_SLOTS];                                                  // what DR0-DR3 hold, 0 = free
+    unsigned long dr7;                                                                      // what DR7 holds
+    int hw_live;                                                                            // bit n: DR<n> is an inserted breakpoint (not parked)
+    unsigned long displaced_area;                                                           // code area for displaced instructions (see Displaced Stepping), 0 = none
+    int displaced_used;                                                                     // slots handed out
+} RemoteMem;
+
+// One read request for remoteRead
+typedef struct {
+    unsigned long address;
+    void* buf;
+    unsigned long len;
+} RemoteIov;
+
+// What decodeInsn found out about one instruction
+typedef struct {
+    int length;
+    int modrm_offset;                                                                       // -1 if no ModRM
+    int disp_offset;
+    int disp_size;                                                                          // 0, 1 or 4
+    int imm_offset;
+    int imm_size;
+    bool rip_relative;                                                                      // disp32 is relative to the next instruction
+    bool relative_branch;                                                                   // the immediate is a branch displacement
+    bool stops_flow;                                                                        // ret / jmp / int3.. - the next byte isn't necessarily code
+} InsnInfo;
+
+// Machine code we build here and then copy to remote (the address it will run at). buf = NULL only measures: len
+// is what it would take. With a buf nothing goes past capacity, and len > capacity says it didn't fit.
+typedef struct {
+    unsigned char* buf;
+    int len;
+    int capacity;
+    unsigned long remote;
+} CodeBuf;
+
+typedef enum {
+    ELF_AUTO,                                                                               // pread if it's bigger than ELF_MAP_MAX_SIZE, else map
+    ELF_MAP,
+    ELF_PREAD
+} ElfMode;
+
+typedef enum {
+    BACKEND_PTRACE,                                                                         // int3 breakpoints (the default)
+    BACKEND_PRELOAD,                                                                        // in-process agent + shared ring
+    BACKEND_TRAMPOLINE,                                                                     // injected jmp + trampolines, ptrace only at startup
+    BACKEND_HWBP                                                                            // like ptrace, but debug registers before int3s
+} Backend;
+
+// Command line options (the ones before the function name)
+typedef struct {
+    Backend backend;                                                                        // --backend=ptrace|preload|trampoline|hwbp
+    const char* agent_path;                                                                 // --agent=PATH of libprfagent.so
+    const char* cache_dir;                                                                  // --cache-dir=DIR (or $PRF_CACHE_DIR), NULL = no symbol cache
+    bool peekpoke;                                                                          // --peekpoke: no remote memory layer, word-at-a-time ptrace
+    ElfMode elf_mode;                                                                       // --elf=auto|map|pread: how the executable is read
+    long index_threads;                                                                     // --index-threads=N: threads that build a symbol index (default 0 = one per CPU)
+    bool lib_calls;                                                                         // --lib-calls: dynamic funcs - report the calls libraries make too
+    bool syscall_stats;                                                                     // --syscall-stats: print tracer syscalls per traced call at the end
+    bool nested;                                                                            // --nested: report calls inside calls (recursion) too, int3 backend
+    bool summary;                                                                           // --summary: one report per function instead of a line per return
+    long summary_every;                                                                     // --summary-every=SECONDS: and print it that often too (0 = at exit only)
+    pid_t attach_pid;                                                                       // --pid=PID: attach instead of running prog (ptrace / hwbp backends)
+    bool latency;                                                                           // --latency: time every call, quantiles per function at the end (ptrace / hwbp)
+    long sample_every;                                                                      // --sample=N: report 1 in N calls of each function (0 / 1 = all)
+    long sample_on_ms;                                                                      // --sample-duty=ON/PERIOD: entry breakpoints in for ON ms..
+    long sample_period_ms;                                                                  // ..out of every PERIOD ms (0 = always)
+    double max_overhead;                                                                    // --max-overhead=P%: stop time per run time we may cost, as a fraction (0 = any)
+    const char* trace_path;                                                                 // --trace=FILE: returns go to a binary trace (prf_trace.h), not stdout
+    int trace_args;                                                                         // --trace-args=N: and the first N integer args of each call
+} PrfOptions;
+
+// What the tracer itself costs
+typedef struct {
+    unsigned long syscalls;                                                                 // ptrace / waitpid / mem file / process_vm_readv calls
+    unsigned long traced_calls;                                                             // returns we reported
+    int threads;                                                                            // threads of the target we trace right now
+    int max_threads;                                                                        // most at once - more than 1 and returns get a [tid]
+    unsigned long stop_overhead;                                                            // --latency: ns a resume -> trap -> wakeup round trip takes
+} TracerStats;
+
+// Returns on their way from Debug's event loop to the output thread (see Output Thread). One producer, one consumer.
+typedef struct {
+    PrfTraceRecord* slots;
+    unsigned long dropped;                                                                  // pushes that found it full (producer only)
+    char pad0[PRF_RING_CACHELINE - 16];
+    unsigned long head;                                                                     // next to push - only the producer writes it
+    unsigned long tail_seen;                                                                // producer's copy of tail, so it rarely reads the real one
+    char pad1[PRF_RING_CACHELINE - 16];
+    unsigned long tail;                                                                     // next to pop - only the consumer writes it
+    char pad2[PRF_RING_CACHELINE - 8];
+} OutputQueue;
+
+typedef struct {
+    bool running;                                                                           // the thread is up - reportReturn is called on it
+    bool done;                                                                              // Debug is finished: drain and go
+    pthread_t thread;
+    OutputQueue queue;
+    TracedFunc* funcs;
+    int func_num;
+    bool eager;                                                                             // stdout is a terminal: write whenever the queue runs dry
+    char* batch;
+    int batch_len;
+} OutputThread;
+
+// What the ring drainers of the preload / trampoline backends need
+typedef struct {
+    PrfRing* ring;
+    TracedFunc* funcs;
+    int func_num;
+} PreloadState;
+
+typedef struct {
+    unsigned char* data;                                                                    // our mapping of the shared data
+    unsigned long tail;
+    unsigned long dropped;
+    TracedFunc* funcs;
+    int func_num;
+    unsigned long tsc_start;                                                                // the stubs time returns with rdtsc: TSC..
+    unsigned long ns_start;                                                                 // ..and CLOCK_MONOTONIC at the same moment, to convert
+    unsigned long last_ns;
+    unsigned char prologues[TRAMP_MAX_FUNCS][MAX_INSN_LEN * 2];                             // what the jmps went over, to put back
+    int moved_lens[TRAMP_MAX_FUNCS];
+    pid_t pid;
+    pid_t new_thread;                                                                       // held at its first stop until the clone event
+    bool untraced;                                                                          // the target got a second thread - prologues are back
+} TrampolineState;
+
+// --sample-duty / --max-overhead state (see Sampling)
+typedef struct {
+    bool running;                                                                           // the tick is on
+    bool paused;                                                                            // the off part of the duty cycle: entry breakpoints are out
+    unsigned long start;                                                                    // ns the first cycle started
+    unsigned long last_refill;                                                              // ns of the last budget refill
+    unsigned long stop_start;                                                               // ns the stop being handled was seen, 0 = none yet
+    unsigned long resumed;                                                                  // ns the target was last let go
+    int charge;                                                                             // func the stop being handled is charged to, NO_FUNC = none
+    unsigned long stopped;                                                                  // ns the target spent stopped, all in all
+    unsigned long stopped_at_refill;
+} Sampler;
+
+PrfOptions options;
+TracerStats stats;
+Sampler sampler;
+PrfTraceWriter trace;                                                                       // --trace
+bool trace_failed;                                                                          // a write to it failed - lines instead from then on
+OutputThread output;
+sigset_t loop_signals;                                                                      // only taken in loopWait (+ SIGCHLD)
+bool loop_signals_on;
+volatile sig_atomic_t detach_requested;                                                     // --pid: SIGINT / SIGTERM came
+volatile sig_atomic_t sample_tick;                                                          // --sample-duty / --max-overhead: SIGALRM came
+
+// One slot per address we ever put an int3 on. Slots are never deleted - a slot with no owners just isn't inserted.
+typedef struct {
+    unsigned long address;                                                                  // 0 = empty slot
+    unsigned char orig_byte;                                                                // the byte the int3 replaced
+    bool orig_known;                                                                        // orig_byte was read already (nobody but us writes text)
+    bool inserted;
+    int hw_slot;                                                                            // debug register it's in while inserted, -1 = int3
+    int entry_func;                                                                         // index of the func that starts here, NO_FUNC if none
+    int ret_refs;                                                                           // shadow stack frames that return here
+    unsigned long displaced;                                                                // its instruction's copy in the displaced area, 0 = not made yet
+} Breakpoint;
+
+// One call in flight
+typedef struct {
+    unsigned long rsp;                                                                      // rsp at the entry - where the return address is
+    unsigned long ret_address;
+    int func;
+    unsigned long counter;                                                                  // run # of this call
+    unsigned long start;                                                                    // --latency / --trace: ns when the call was let go
+    unsigned long args[PRF_TRACE_MAX_ARGS];                                                 // --trace-args: rdi, rsi.. at the entry
+} ShadowFrame;
+
+typedef struct {
+    ShadowFrame* frames;
+    int depth;
+    int capacity;
+} ShadowStack;
+
+// One thread of the target
+typedef struct {
+    pid_t tid;
+    ShadowStack shadow;
+    int* depth;                                                                             // calls of every func in flight on this thread
+    int pending_sig;                                                                        // came in while stepping over a breakpoint
+    bool fresh;                                                                             // hasn't had its first (SIGSTOP) stop yet
+    unsigned long stop_time;                                                                // --latency / --trace: ns when we saw its last stop
+} TracedThread;
+
+typedef struct {
+    TracedThread* threads;
+    int num;
+    int capacity;
+} ThreadList;
+
+// Open addressing (linear probing) hash table: address -> breakpoint
+typedef struct {
+    Breakpoint* slots;
+    int capacity;
+    int count;
+} BreakpointTable;
+
+long getFuncAddr(ElfImage* elf, SymIndex* dynsym_index, TracedFunc* func);
+bool elfOpen(ElfImage* elf, const char* path);
+void elfClose(ElfImage* elf);
+bool elfSectionInFile(ElfImage* elf, int section);
+int elfSectionByType(ElfImage* elf, Elf64_Word type);
+int elfNextOfType(ElfImage* elf, int section);
+int elfSectionByName(ElfImage* elf, const char* name);
+int elfSectionLink(ElfImage* elf, int section);
+int elfSectionLinkedTo(ElfImage* elf, Elf64_Word type, int target);
+void* elfSectionData(ElfImage* elf, int section, unsigned long* size);
+Elf64_Sym* elfSymbols(ElfImage* elf, int section, int* sym_num);
+Elf64_Rela* elfRelocations(ElfImage* elf, int section, int* rela_num);
+Elf64_Dyn* elfDynamic(ElfImage* elf, int* dyn_num);
+bool elfNextNote(ElfImage* elf, int section, unsigned long* offset, ElfNote* note);
+Elf64_Word gnuHash(const char* name);
+Elf64_Word nativeHashLimit(Elf64_Word* table, unsigned long size, bool gnu, int sym_num);
+void symIndexInit(SymIndex* index, Elf64_Sym* syms, char* strs, unsigned long strs_size, int sym_num,
+                  Elf64_Word* sysv_hash, unsigned long sysv_size, Elf64_Word* gnu_hash, unsigned long gnu_size);
+bool symIndexBuild(SymIndex* index);
+void* symIndexHashWorker(void* arg);
+void* symIndexSplitWorker(void* arg);
+void* symIndexLinkWorker(void* arg);
+void symIndexRun(SymIndexWorker* workers, int worker_num, void* (*work)(void*));
+int strtabFind(const char* strs, unsigned long strs_size, const char* name, Elf64_Word* offsets, int max_offsets);
+int symIndexScan(SymIndex* index, const char* name, int* matches, int max_matches);
+void symIndexFree(SymIndex* index);
+int symIndexLookup(SymIndex* index, const char* name, int* matches, int max_matches);
+void findSymbol(SymIndex* index, TracedFunc* func);
+void openDynsymIndex(ElfImage* elf, SymIndex* index);
+int readBuildId(ElfImage* elf, unsigned char* build_id, int max_len);
+bool makeCacheKey(ElfImage* elf, Elf64_Shdr* symtab_header, Elf64_Shdr* strtab_header,
+                  SymCacheHeader* key, char* path, int path_size);
+bool symCacheOpen(const char* path, SymCacheHeader* key, SymIndex* index);
+void symCacheStore(const char* path, SymCacheHeader* key, SymIndex* index, unsigned long strs_size);
+int parseOptions(int argc, char* argv[]);
+SearchStatus checkExecutable(ElfImage* elf);
+SearchStatus checkFunction(ElfImage* elf, TracedFunc* funcs, int func_num);
 pid_t runTarget(const char* name, char* argv[]);
-void Debug(pid_t child_pid, unsigned long address, bool is_dyn);
+void Debug(pid_t child_pid, TracedFunc* funcs, int func_num, unsigned long debug_slot);
+long tracePtrace(enum __ptrace_request request, pid_t pid, void* addr, void* data);
+pid_t traceWait(pid_t pid, int* wait_status);
+void remoteInit(RemoteMem* mem, pid_t pid);
+void remoteClose(RemoteMem* mem);
+bool remoteRead(RemoteMem* mem, RemoteIov* reads, int read_num, bool sticky);
+bool remoteReadWord(RemoteMem* mem, unsigned long address, unsigned long* word);
+bool remoteWrite(RemoteMem* mem, unsigned long address, const void* buf, unsigned long len);
+void remoteResume(RemoteMem* mem);
+void resumeChild(RemoteMem* mem, int sig);
+bool stepOver(RemoteMem* mem, Breakpoint* bp, int* wait_status, int* pending_sig);
+ShadowFrame* shadowPush(ShadowStack* shadow);
+bool handleHit(RemoteMem* mem, BreakpointTable* table, TracedThread* thread, TracedFunc* funcs,
+               Breakpoint* bp, struct user_regs_struct* regs, bool armed, int* wait_status);
+long remoteSyscall(RemoteMem* mem, long nr, long a1, long a2, long a3, long a4, long a5, long a6);
+int decodeInsn(const unsigned char* code, int max_len, InsnInfo* info);
+void drainUntilExit(pid_t pid, int (*drain)(void* ctx), void (*stopped)(void* ctx, pid_t tid, int wait_status), void* ctx);
+bool runTrampoline(const char* name, char** argv, TracedFunc* funcs, int func_num);
+void reportReturn(TracedFunc* funcs, int func_num, const PrfTraceRecord* rec);
+void summaryTick(TracedFunc* funcs, int func_num);
+void printSummary(TracedFunc* funcs, int func_num);
+unsigned long nowNs(void);
+unsigned long calibrateStops(void);
+void printLatency(TracedFunc* funcs, int func_num);
+void samplerStart(TracedFunc* funcs, int func_num);
+void samplerStop(void);
+void loopSignalAdd(int sig);
+pid_t loopWait(int* wait_status);
+void samplerUpdate(RemoteMem* mem, BreakpointTable* table, TracedFunc* funcs, int func_num);
+void governorCharge(RemoteMem* mem, BreakpointTable* table, TracedFunc* funcs, unsigned long stop_time);
+void finishReport(TracedFunc* funcs, int func_num);
+bool outputStart(TracedFunc* funcs, int func_num);
+void outputPush(const PrfTraceRecord* rec);
+void outputStop(void);
+void outputLine(const char* format, ...);
+void outputFlush(void);
+void* outputRun(void* arg);
+bool openTrace(const char* exe, TracedFunc* funcs, int func_num);
+bool runPreload(const char* name, char** argv, TracedFunc* funcs, int func_num);
+bool loadBias(pid_t pid, ElfImage* elf, unsigned long* bias);
+unsigned long debugSlot(ElfImage* elf);
+void loadRange(ElfImage* elf, unsigned long* start, unsigned long* end);
+bool runToEntry(RemoteMem* mem, ThreadList* threads, int func_num);
+bool remoteReadString(RemoteMem* mem, unsigned long address, char* buf, int size);
+unsigned long libFuncAddr(ElfImage* lib, const char* name);
+int resolveLibFuncs(RemoteMem* mem, TracedFunc* funcs, int func_num, unsigned long debug_slot);
+bool attachThreads(pid_t pid, ThreadList* threads, int func_num);
+bool waitStopped(TracedThread* thread, int* wait_status);
+void detachAll(RemoteMem* mem, BreakpointTable* table, ThreadList* threads);
+bool hitStaleInt3(pid_t tid);
+unsigned long remoteNearMmap(RemoteMem* mem, unsigned long near, unsigned long size, long prot, long flags, long fd);
+bool displacedInit(RemoteMem* mem, unsigned long near);
+unsigned long displacedCopy(RemoteMem* mem, Breakpoint* bp);
 
 // ======================================================================================================================================
-// ----------------------------------------------------- Helper Functions ---------------------------------------------------------------
+// -------------------------------------------------------- ELF Image -------------------------------------------------------------------
 // ======================================================================================================================================
+//
+// The executable is opened and mmap'd once (elfOpen) and every ELF pass works on that. elfOpen checks the headers
+// against the file size once, so a section that's indexed is all inside the file and nobody has to check again,
+// and indexes the sections by type, by name and by link. The views below point straight into the mapping.
+// Streamed (--elf=pread, or a file over ELF_MAP_MAX_SIZE): only the ELF header, the program / section header
+// tables and .shstrtab are read up front, and a section is pread into memory of its own the first time someone
+// asks for its data - the rest of the file (debug info, mostly) is never read or mapped. Sizes and offsets are
+// unsigned long all the way, so files past 2 / 4 GB are fine either way.
 
-
-// Name: findSectionTable
-// Recieves elf_file ptr (from mmap), sh_type- code representing the wanted section type (ex: SHT_SYMTAB), and ptr to entry num
-// Returns ptr to said table, and *entry_num= the num of entries in said table
-void* findSectionTable (void* elf_file, Elf64_Word sh_type, int* entry_num)
+// Name: elfRead
+// Streamed: pread of exactly len bytes at offset into new memory
+// Returns NULL if it can't
+static void* elfRead(ElfImage* elf, unsigned long offset, unsigned long len)
 {
-    Elf64_Ehdr* header = (Elf64_Ehdr*)elf_file;                                             // the elf header is at the beginning - we can cast it with C magic!
-    Elf64_Shdr* sec_headers_arr = (Elf64_Shdr*)(elf_file + header->e_shoff);                // now we can get the section headers by using the offset from the elf header
-    void *tab = NULL;
-    int i = 0;
-    if (sh_type == SHT_RELA)                                                                //  Case 1: get relocation table
+    unsigned char* buf = malloc(len ? len : 1);
+    for(unsigned long done = 0; buf != NULL && done < len; )
     {
-        for(i = 0; i < header->e_shnum; i++)                                           
+        ssize_t got = pread(elf->fd, buf + done, len - done, offset + done);
+        if(got <= 0)
         {
-            if (sec_headers_arr[i].sh_type == sh_type &&                                    // get the rela.plt and NOT rela.dyn
-                sec_headers_arr[i].sh_flags != SHF_ALLOC)
-            {
-                tab = (void*)(elf_file + sec_headers_arr[i].sh_offset);
-                *entry_num = sec_headers_arr[i].sh_size / sec_headers_arr[i].sh_entsize;
-                return tab;
-            }
+            free(buf);
+            return NULL;
         }
+        done += got;
     }
+    elf->bytes_read += buf != NULL ? len : 0;
+    return buf;
+}
 
-    // is there a chance that strtab appears before symtab?!!??!?
-    else if (sh_type == SHT_STRTAB)                                                        //  Case 2: get string table
+// Name: elfOpen
+// Recieves a path
+// Returns false if it can't be read or isn't a 64 bit ELF file. Headers / sections that would reach past the end
+// of the file are left out (no sections at all if the section header table itself doesn't fit).
+bool elfOpen(ElfImage* elf, const char* path)
+{
+    memset(elf, 0, sizeof(ElfImage));
+    elf->fd = open(path, O_RDONLY);
+    struct stat st;
+    if(elf->fd == -1 || fstat(elf->fd, &st) != 0 || (unsigned long)st.st_size < sizeof(Elf64_Ehdr))
     {
-        Elf64_Word strtab_section_index;
-        for(i = 0; i < header->e_shnum; i++)                                           
-        {
-            if (sec_headers_arr[i].sh_type == SHT_SYMTAB){                                // find using strtab's link property
-                strtab_section_index = sec_headers_arr[i].sh_link;                        // get the strtab associated with .symtab and NOT .shstrtab OR .dynstr !! (all of same type: STRTAB)
-            }
-            if (i == strtab_section_index) {                                              // PLZ PUT IN DIFFERENT FOR LOOP
-                tab = (void*)(elf_file + sec_headers_arr[i].sh_offset);
-                return tab;
-            }
+        if(elf->fd != -1) {
+            close(elf->fd);
         }
+        return false;
+    }
+    elf->size = st.st_size;
+    elf->streamed = options.elf_mode == ELF_PREAD || (options.elf_mode == ELF_AUTO && elf->size > ELF_MAP_MAX_SIZE);
+    if(elf->streamed) {
+        elf->header = elfRead(elf, 0, sizeof(Elf64_Ehdr));
+    }
+    else if((elf->data = mmap(NULL, elf->size, PROT_READ, MAP_PRIVATE, elf->fd, 0)) != MAP_FAILED) {
+        elf->header = (Elf64_Ehdr*)elf->data;
+    }
+    else {
+        elf->data = NULL;
+    }
+    Elf64_Ehdr* header = elf->header;
+    if(header == NULL || memcmp(header->e_ident, "\x7f" "ELF", 4) != 0 || header->e_ident[EI_CLASS] != ELFCLASS64)
+    {
+        elfClose(elf);
+        return false;
+    }
+
+    if(header->e_phnum > 0 && header->e_phentsize == sizeof(Elf64_Phdr) && header->e_phoff < elf->size &&
+       header->e_phnum <= (elf->size - header->e_phoff) / sizeof(Elf64_Phdr))
+    {
+        elf->segments = elf->streamed ? elfRead(elf, header->e_phoff, header->e_phnum * sizeof(Elf64_Phdr))
+                                      : (Elf64_Phdr*)(elf->data + header->e_phoff);
+        elf->segment_num = elf->segments != NULL ? header->e_phnum : 0;
     }
-     
-    else 
+    if(header->e_shnum == 0 || header->e_shentsize != sizeof(Elf64_Shdr) || header->e_shoff >= elf->size ||
+       header->e_shnum > (elf->size - header->e_shoff) / sizeof(Elf64_Shdr)) {
+        return true;                                                                        // no sections - nothing to find, but it's an ELF file
+    }
+    elf->sections = elf->streamed ? elfRead(elf, header->e_shoff, header->e_shnum * sizeof(Elf64_Shdr))
+                                  : (Elf64_Shdr*)(elf->data + header->e_shoff);
+    if(elf->sections == NULL) {
+        return true;
+    }
+    elf->section_num = header->e_shnum;
+    elf->loaded = elf->streamed ? calloc(elf->section_num, sizeof(void*)) : NULL;
+    elf->next_of_type = calloc(elf->section_num, sizeof(int));
+    elf->name_slot_num = 1;
+    while(elf->name_slot_num < 2 * elf->section_num) {
+        elf->name_slot_num <<= 1;
+    }
+    elf->name_slots = calloc(elf->name_slot_num, sizeof(int));
+    if(elf->next_of_type == NULL || elf->name_slots == NULL || (elf->streamed && elf->loaded == NULL))
+    {
+        elfClose(elf);
+        return false;
+    }
+    unsigned long names_size;
+    elf->names = (elf->sections[header->e_shstrndx < elf->section_num ? header->e_shstrndx : 0].sh_type == SHT_STRTAB)
+                 ? elfSectionData(elf, header->e_shstrndx, &names_size) : NULL;
+    elf->names_size = elf->names != NULL ? names_size : 0;
+
+    int last_of_type[ELF_MAX_TYPES];
+    for(int i = 1; i < elf->section_num; i++)
     {
-        for(i = 0; i < header->e_shnum; i++)                                              //  Case 3: get some other table
+        Elf64_Shdr* section = &elf->sections[i];
+        if(!elfSectionInFile(elf, i)) {
+            continue;                                                                       // no bytes in the file - never handed out
+        }
+        int t = 0;
+        while(t < elf->type_num && elf->types[t].type != section->sh_type) {
+            t++;
+        }
+        if(t == elf->type_num)
         {
-            if(sec_headers_arr[i].sh_type == sh_type)
-            {
-                tab = (void*)(elf_file + sec_headers_arr[i].sh_offset);
-                *entry_num = sec_headers_arr[i].sh_size / sec_headers_arr[i].sh_entsize;
-                return tab;
+            if(t == ELF_MAX_TYPES) {
+                continue;
             }
+            elf->types[elf->type_num++] = (ElfTypeHead){ section->sh_type, i };
         }
-    }
+        else {
+            elf->next_of_type[last_of_type[t]] = i;
+        }
+        last_of_type[t] = i;
 
-    // not supposed to arrive here
-    return tab;
+        const char* name = (elf->names != NULL && section->sh_name < elf->names_size &&
+                            memchr(elf->names + section->sh_name, '\0', elf->names_size - section->sh_name) != NULL)
+                           ? elf->names + section->sh_name : NULL;
+        if(name == NULL || *name == '\0') {
+            continue;
+        }
+        int slot = gnuHash(name) & (elf->name_slot_num - 1);
+        while(elf->name_slots[slot] != 0) {                                                // first one of a name wins
+            if(strcmp(elf->names + elf->sections[elf->name_slots[slot]].sh_name, name) == 0) {
+                break;
+            }
+            slot = (slot + 1) & (elf->name_slot_num - 1);
+        }
+        if(elf->name_slots[slot] == 0) {
+            elf->name_slots[slot] = i;
+        }
+    }
+    return true;
 }
 
-
-// Name: findSymbol
-// Recieves symbol table parameters & func_name
-// Returns whether it exists there/not/if global..
-SearchStatus findSymbol(Elf64_Sym *symtab, char *strtab, char* func_name, int symbol_num)
+void elfClose(ElfImage* elf)
 {
-    bool found_symbol = false;                                                              // this will serve as a boolean to mark if we found our function in the symtab
-
-    for(int i = 0; i < symbol_num; i++)                                                     // go over symbols to look for our function
-    { 
-        char* curr_symbol_name = strtab + symtab[i].st_name;                                // get the name of the current symbol in symtab 
-        if(strcmp(func_name, curr_symbol_name) == 0)                                        // compare to our func name (strcmp returns 0 if the strings are equal)
-        {     
-            found_symbol = true;                                                            // we found our symbol!                                 
-            if(ELF64_ST_BIND(symtab[i].st_info) != GLOBAL) {                                // check if its global
-                return SYM_NOT_GLOBAL;                                                      // Y not immediately return success???????????????????????????????????????????????????????????????????????????????
-            }
+    if(elf->streamed)
+    {
+        for(int i = 0; elf->loaded != NULL && i < elf->section_num; i++) {
+            free(elf->loaded[i]);
         }
+        free(elf->loaded);
+        free(elf->header);
+        free(elf->segments);
+        free(elf->sections);
     }
+    else if(elf->data != NULL) {
+        munmap(elf->data, elf->size);
+    }
+    close(elf->fd);
+    free(elf->next_of_type);
+    free(elf->name_slots);
+    memset(elf, 0, sizeof(ElfImage));
+}
 
-    if(!found_symbol) {                                                                     // check if we found the symbol at all
-        return SYM_NOT_FOUND;
+// Name: elfSectionByType / elfNextOfType
+// The first section of type / the one after section of the same type (0 = no more)
+int elfSectionByType(ElfImage* elf, Elf64_Word type)
+{
+    for(int t = 0; t < elf->type_num; t++)
+    {
+        if(elf->types[t].type == type) {
+            return elf->types[t].first;
+        }
     }
-    return SUCCESS;                                                                         // if we got to this point - the symbol is present and global!
+    return 0;
 }
 
-// ======================================================================================================================================
-// ----------------------------------------------------- Actual Functions ---------------------------------------------------------------
-// ======================================================================================================================================
+int elfNextOfType(ElfImage* elf, int section)
+{
+    return elf->next_of_type[section];
+}
 
-// Part 1
-// Name: checkExecutable
-// Recieves filename
-// Returns SUCCESS if the file is executable, ERROR otherwise.
-SearchStatus checkExecutable(char* file_name)
+// Name: elfSectionByName
+// Returns the (first) section called name, 0 if none
+int elfSectionByName(ElfImage* elf, const char* name)
 {
-    FILE* to_trace = fopen(file_name, "r");                                                 // try to open file to debug
-    if(to_trace == NULL) {                                                                  // file does not exist
-        //printf("[DEBUG] %s does not exist! :(\n", argv[2]);
-        return ERROR;
+    if(elf->name_slots == NULL) {
+        return 0;
+    }
+    for(int slot = gnuHash(name) & (elf->name_slot_num - 1); elf->name_slots[slot] != 0; slot = (slot + 1) & (elf->name_slot_num - 1))
+    {
+        if(strcmp(elf->names + elf->sections[elf->name_slots[slot]].sh_name, name) == 0) {
+            return elf->name_slots[slot];
+        }
     }
+    return 0;
+}
 
-    Elf64_Ehdr header;                                                                      // this will hold the elf header
+// Name: elfSectionLink / elfSectionLinkedTo
+// The section section's sh_link points at / the first section of type whose sh_link points at target (0 = none,
+// or a link to a section that isn't in the file)
+int elfSectionLink(ElfImage* elf, int section)
+{
+    Elf64_Word link = elf->sections[section].sh_link;
+    return (link < (Elf64_Word)elf->section_num && elfSectionInFile(elf, link)) ? (int)link : 0;
+}
 
-    int res = fread(&header, 1, sizeof(Elf64_Ehdr), to_trace);                              // try to read the elf header of the file to our struct
-    if(res != sizeof(Elf64_Ehdr)) {
-        fclose(to_trace);
-        return ERROR;
+int elfSectionLinkedTo(ElfImage* elf, Elf64_Word type, int target)
+{
+    for(int i = elfSectionByType(elf, type); i != 0; i = elfNextOfType(elf, i))
+    {
+        if(elf->sections[i].sh_link == (Elf64_Word)target) {
+            return i;
+        }
     }
+    return 0;
+}
 
-    if(header.e_ident[0] != 0x7f ||                                                         // check if file is of ELF type
-        header.e_ident[1] != 'E' ||
-        header.e_ident[2] != 'L' ||
-        header.e_ident[3] != 'F' ||
-        header.e_type != ET_EXEC)                                                           // check if file is an executable
-    {    
-        fclose(to_trace);
-        return ERROR;
+// Name: elfSectionInFile
+// Returns true if section has bytes and they're all inside the file (nothing is read)
+bool elfSectionInFile(ElfImage* elf, int section)
+{
+    if(section <= 0 || section >= elf->section_num) {
+        return false;
     }
-    fclose(to_trace);
-    return SUCCESS; 
+    Elf64_Shdr* header = &elf->sections[section];
+    return header->sh_type != SHT_NOBITS && header->sh_offset <= elf->size && header->sh_size <= elf->size - header->sh_offset;
 }
 
-// Part 2 + 3
-// Name: checkFunction
-// Recieves file name, function name, and ptr to function address var.
-// Returns SUCCESS if func is global AND executable  (), other errorcode otherwise (and 0x0 in func_addr).
-SearchStatus checkFunction(char* file_name, char* func_name, unsigned long* func_addr, bool* is_dyn)
+// Name: elfSectionData
+// Returns the bytes of section (and their number in *size, if size isn't NULL), NULL if it has none in the file
+// (or, streamed, they can't be read). Streamed, the first call reads them.
+void* elfSectionData(ElfImage* elf, int section, unsigned long* size)
 {
-    int to_trace = open(file_name, O_RDONLY);                                               // try to open file to debug int an fd (because mmap later)
-    if(to_trace == -1) {                                                                    // couldnt open fd - ABORT MISSION
-        return ERROR;
+    if(!elfSectionInFile(elf, section)) {
+        return NULL;
     }
+    Elf64_Shdr* header = &elf->sections[section];
+    if(elf->streamed && elf->loaded[section] == NULL && (elf->loaded[section] = elfRead(elf, header->sh_offset, header->sh_size)) == NULL) {
+        return NULL;
+    }
+    if(size != NULL) {
+        *size = header->sh_size;
+    }
+    return elf->streamed ? elf->loaded[section] : elf->data + header->sh_offset;
+}
 
-    int size = lseek(to_trace, 0, SEEK_END);
-    void *elf_file = mmap(NULL, size, PROT_READ, MAP_PRIVATE, to_trace, 0);                 // mmap the whole entire elf file - its like malloc but for really big chuncks of data                      
-   
-    if(elf_file == MAP_FAILED) {                                                            
-        close(to_trace);
-        return ERROR;
+// Name: elfSymbols / elfRelocations / elfDynamic
+// Typed views of a SYMTAB / DYNSYM, a RELA, and the DYNAMIC section. Return NULL (and 0 entries) if the section
+// isn't that kind of table.
+Elf64_Sym* elfSymbols(ElfImage* elf, int section, int* sym_num)
+{
+    unsigned long size;
+    void* data = elfSectionData(elf, section, &size);
+    *sym_num = 0;
+    if(data == NULL || (elf->sections[section].sh_type != SHT_SYMTAB && elf->sections[section].sh_type != SHT_DYNSYM)) {
+        return NULL;
     }
+    *sym_num = size / sizeof(Elf64_Sym);
+    return data;
+}
 
-    int sym_num = 0;
-    Elf64_Sym *symtab = (Elf64_Sym*)findSectionTable(elf_file, SHT_SYMTAB, &sym_num);
-    char *strtab = (char*)findSectionTable(elf_file, SHT_STRTAB, NULL);
+Elf64_Rela* elfRelocations(ElfImage* elf, int section, int* rela_num)
+{
+    unsigned long size;
+    void* data = elfSectionData(elf, section, &size);
+    *rela_num = 0;
+    if(data == NULL || elf->sections[section].sh_type != SHT_RELA) {
+        return NULL;
+    }
+    *rela_num = size / sizeof(Elf64_Rela);
+    return data;
+}
 
-    SearchStatus res = findSymbol(symtab, strtab, func_name, sym_num);
+Elf64_Dyn* elfDynamic(ElfImage* elf, int* dyn_num)
+{
+    unsigned long size;
+    void* data = elfSectionData(elf, elfSectionByType(elf, SHT_DYNAMIC), &size);
+    *dyn_num = data != NULL ? size / sizeof(Elf64_Dyn) : 0;
+    return data;
+}
 
-    if (res == SUCCESS){
-        *func_addr = getFuncAddr(elf_file, symtab, strtab, func_name, sym_num, is_dyn);             // part 4
+// Name: elfNextNote
+// Walks the notes of a NOTE section: *offset = 0 to start
+// Returns false after the last one (or at one that doesn't fit in the section)
+bool elfNextNote(ElfImage* elf, int section, unsigned long* offset, ElfNote* note)
+{
+    unsigned long size;
+    unsigned char* data = elfSectionData(elf, section, &size);
+    if(data == NULL || elf->sections[section].sh_type != SHT_NOTE || *offset > size || size - *offset < 3 * sizeof(Elf64_Word)) {
+        return false;
     }
+    Elf64_Word* fields = (Elf64_Word*)(data + *offset);                                     // namesz, descsz, type, name (4-aligned), desc (4-aligned)
+    unsigned long name_at = *offset + 3 * sizeof(Elf64_Word);
+    unsigned long desc_at = name_at + ((fields[0] + 3UL) & ~3UL);
+    unsigned long next = desc_at + ((fields[1] + 3UL) & ~3UL);
+    if(desc_at > size || fields[1] > size - desc_at) {
+        return false;
+    }
+    note->type = fields[2];
+    note->name = (const char*)(data + name_at);
+    note->name_size = fields[0];
+    note->desc = data + desc_at;
+    note->desc_size = fields[1];
+    *offset = next;
+    return true;
+}
+
+// ======================================================================================================================================
+// ------------------------------------------------------- Symbol Index -----------------------------------------------------------------
+// ======================================================================================================================================
 
-    close(to_trace); 
-    munmap(elf_file, size);                                                                 
-    return res;                                                                    
+// Name: gnuHash / sysvHash
+// The two hash functions of the ELF hash sections (dl_new_hash and the original elf_hash)
+Elf64_Word gnuHash(const char* name)
+{
+    Elf64_Word h = 5381;
+    for(; *name; name++) {
+        h = (h << 5) + h + (unsigned char)*name;
+    }
+    return h;
 }
 
-// Part 4 + 5
-long getFuncAddr(void *elf_file, Elf64_Sym *symtab, char *strtab, char* func_name, int sym_num, bool* is_dyn)
+Elf64_Word sysvHash(const char* name)
 {
-    // Try finding the function in executable file
-    int und_index_in_dynsym = 0;                                                             
-    for(int i = 0; i < sym_num; i++)                                                        // go over symbols to look for our function
+    Elf64_Word h = 0;
+    for(; *name; name++)
     {
-        char* curr_symbol_name = strtab + symtab[i].st_name;                                // get the name of the current symbol in symtab 
-        if(strcmp(func_name, curr_symbol_name) == 0){
-            if(symtab[i].st_shndx!= SHN_UNDEF) { 
-                return (long)symtab[i].st_value;
-            }
-            else {
-                break;
-            }
+        h = (h << 4) + (unsigned char)*name;
+        Elf64_Word g = h & 0xf0000000;
+        if(g) {
+            h ^= g >> 24;
         }
+        h &= ~g;
+    }
+    return h;
+}
 
-        else if (symtab[i].st_shndx == SHN_UNDEF){
-            und_index_in_dynsym++;
+
+// Name: nativeHashLimit
+// Recieves a .hash (gnu = false) or .gnu.hash and its size in bytes
+// Returns the end of the symbol indices a lookup in it may touch (at most sym_num), 0 if its counts don't fit the section
+Elf64_Word nativeHashLimit(Elf64_Word* table, unsigned long size, bool gnu, int sym_num)
+{
+    unsigned long words = size / sizeof(Elf64_Word), limit;
+    if(table == NULL || words < (gnu ? 4UL : 2UL) || table[0] == 0) {                       // no buckets = nothing to take a hash modulo
+        return 0;
+    }
+    if(!gnu)                                                                                // nbucket, nchain, bucket[nbucket], chain[nchain]
+    {
+        if(2 + (unsigned long)table[0] + table[1] > words) {
+            return 0;
         }
+        limit = table[1];
     }
-
-    // IF WE'RE HERE - SYMBOL IS UND
-    int rel_entry_num = 0;
-    Elf64_Rela *reltab = (Elf64_Rela*)findSectionTable(elf_file, SHT_RELA, &rel_entry_num);   // get.rela.plt
-    for (int i = 0 ; i < rel_entry_num ; i++)
-    {   
-        if (ELF64_R_SYM(reltab[i].r_info) == und_index_in_dynsym)                             // pretty sure that r_info in reltab entry is the index of the relevant symbol in dynsym table                       
-        {
-            *is_dyn = true;
-            return reltab[i].r_offset;              
+    else                                                                                    // nbuckets, symoffset, bloom_size, bloom_shift, bloom[] (64 bit), buckets[], chain[]
+    {
+        unsigned long head = 4 + 2 * (unsigned long)table[2] + table[0];
+        if(table[2] == 0 || table[3] >= 32 || head > words) {
+            return 0;
         }
+        limit = table[1] + (words - head);                                                  // chain[] runs to the end of the section
     }
+    return limit < (unsigned long)sym_num ? limit : (Elf64_Word)sym_num;
+}
 
-    return 0;
+// Name: symIndexInit
+// Recieves a symbol table (symtab or dynsym) + its strings, and the .hash/.gnu.hash of it if the file has them (NULL if not)
+// with their sizes. A native table whose counts don't fit its section is left out, the built index answers instead.
+// The built index is only made when there is no native one, and .gnu.hash doesn't know UND symbols - so a miss there
+// builds it too (see symIndexLookup). Until SYM_SCAN_MAX_LOOKUPS names were asked for, a scan answers instead.
+void symIndexInit(SymIndex* index, Elf64_Sym* syms, char* strs, unsigned long strs_size, int sym_num,
+                  Elf64_Word* sysv_hash, unsigned long sysv_size, Elf64_Word* gnu_hash, unsigned long gnu_size)
+{
+    memset(index, 0, sizeof(SymIndex));
+    index->syms = syms;
+    index->strs = strs;
+    index->strs_size = strs_size;
+    index->sym_num = sym_num;
+    if((index->hash_limit = nativeHashLimit(sysv_hash, sysv_size, false, sym_num)) != 0) {
+        index->sysv_hash = sysv_hash;
+    }
+    else if((index->hash_limit = nativeHashLimit(gnu_hash, gnu_size, true, sym_num)) != 0) {
+        index->gnu_hash = gnu_hash;
+    }
 }
 
-// Part6
-pid_t runTarget(const char* name, char** argv)
+// Name: symIndexBuild
+// One pass over the table: chained hash index (like .hash, but with the full hash kept next to every symbol so a
+// lookup almost never strcmps a wrong name). Symbols go in backwards so every chain comes out in ascending order.
+// Tables of SYM_INDEX_THREAD_MIN symbols and up are built by --index-threads threads (see symIndexHashWorker).
+bool symIndexBuild(SymIndex* index)
 {
-    pid_t pid = fork();
-    if(pid < 0) {
-        //perror();
-        exit(1);
+    Elf64_Word bucket_num = 1;
+    while(bucket_num < (Elf64_Word)index->sym_num) {
+        bucket_num <<= 1;
+    }
+    index->buckets = calloc(bucket_num, sizeof(Elf64_Word));
+    index->chain = calloc(index->sym_num + 1, sizeof(Elf64_Word));
+    index->hashes = malloc((index->sym_num + 1) * sizeof(Elf64_Word));
+    if(index->buckets == NULL || index->chain == NULL || index->hashes == NULL) {
+        symIndexFree(index);
+        return false;
     }
+    index->bucket_num = bucket_num;
+    index->hashes[0] = 0;
 
-    if(pid > 0) {
-        return pid;
+    long worker_num = options.index_threads > 0 ? options.index_threads : sysconf(_SC_NPROCESSORS_ONLN);
+    worker_num = worker_num < SYM_INDEX_MAX_THREADS ? worker_num : SYM_INDEX_MAX_THREADS;
+    Elf64_Word* order = (index->sym_num >= SYM_INDEX_THREAD_MIN && worker_num > 1) ? malloc(index->sym_num * sizeof(Elf64_Word)) : NULL;
+    if(order != NULL)
+    {
+        SymIndexWorker workers[SYM_INDEX_MAX_THREADS];
+        for(int w = 0; w < worker_num; w++)
+        {
+            memset(&workers[w], 0, sizeof(SymIndexWorker));
+            workers[w].index = index;
+            workers[w].worker_num = worker_num;
+            workers[w].from = 1 + (long)(index->sym_num - 1) * w / worker_num;
+            workers[w].to = 1 + (long)(index->sym_num - 1) * (w + 1) / worker_num;
+            workers[w].order = order;
+        }
+        symIndexRun(workers, worker_num, symIndexHashWorker);
+        int next = 0;                                                                       // order[]: by linking worker, then by hashing worker
+        for(int l = 0; l < worker_num; l++)
+        {
+            workers[l].link_from = next;
+            for(int w = 0; w < worker_num; w++)
+            {
+                int count = workers[w].counts[l];
+                workers[w].counts[l] = next;
+                next += count;
+            }
+            workers[l].link_to = next;
+        }
+        symIndexRun(workers, worker_num, symIndexSplitWorker);
+        symIndexRun(workers, worker_num, symIndexLinkWorker);
+        free(order);
+        return true;
     }
 
-    if(ptrace(PTRACE_TRACEME, 0, NULL, NULL) < 0) {
-        // perror();
-        exit(1);
+    for(int i = index->sym_num - 1; i > 0; i--)                                            // symbol 0 is always the null symbol - 0 ends a chain
+    {
+        Elf64_Word h = gnuHash(index->strs + index->syms[i].st_name);
+        index->hashes[i] = h;
+        index->chain[i] = index->buckets[h & (bucket_num - 1)];
+        index->buckets[h & (bucket_num - 1)] = i;
     }
-    execv(name, argv + 2);                                  // execv is better!                           
+    return true;
 }
 
-void Debug(pid_t child_pid, unsigned long address, const bool is_dyn)
+// Name: symIndexLinker
+// Which worker links bucket: worker w gets the w-th of worker_num equal slices of the buckets
+static inline int symIndexLinker(SymIndex* index, Elf64_Word hash, int worker_num)
 {
-    // Some vars
-    int wait_status;
-    struct user_regs_struct regs;
-    static int counter = 0;
-    bool first_br = true;   
-    unsigned long got_offset = 0;                                                               
+    return (unsigned long)(hash & (index->bucket_num - 1)) * worker_num / index->bucket_num;
+}
 
-    // vars for return breakpoint
-    unsigned long ret_address = 0;
-    unsigned long ret_data = 0;
+// Name: symIndexHashWorker / symIndexSplitWorker / symIndexLinkWorker
+// A big table is built in three rounds of threads, every thread on its own slice of the symbols. Hashing is the
+// expensive part (a jump into the string table for every symbol) - it also counts how many of the slice every
+// worker will link. symIndexBuild turns the counts into places in order[], and the split round writes every symbol
+// there. Then every worker links its own part of order[] - its buckets and the chain entries of their symbols, so
+// nobody shares a write. A part holds its symbols in ascending order and is walked backwards like the one-thread
+// loop: the chains come out the same, and so does a cache file made from them.
+void* symIndexHashWorker(void* arg)
+{
+    SymIndexWorker* worker = arg;
+    SymIndex* index = worker->index;
+    for(int i = worker->from; i < worker->to; i++)
+    {
+        index->hashes[i] = gnuHash(index->strs + index->syms[i].st_name);
+        worker->counts[symIndexLinker(index, index->hashes[i], worker->worker_num)]++;
+    }
+    return NULL;
+}
 
-    waitpid(child_pid, &wait_status, 0);                                                    // wait for child to start running
-    
-    if(is_dyn) {
-        got_offset = address;
-        address = ptrace(PTRACE_PEEKTEXT, child_pid, (void*)got_offset, NULL);
+void* symIndexSplitWorker(void* arg)
+{
+    SymIndexWorker* worker = arg;
+    SymIndex* index = worker->index;
+    for(int i = worker->from; i < worker->to; i++) {
+        worker->order[worker->counts[symIndexLinker(index, index->hashes[i], worker->worker_num)]++] = i;
+    }
+    return NULL;
+}
+
+void* symIndexLinkWorker(void* arg)
+{
+    SymIndexWorker* worker = arg;
+    SymIndex* index = worker->index;
+    for(int o = worker->link_to - 1; o >= worker->link_from; o--)
+    {
+        Elf64_Word i = worker->order[o];
+        Elf64_Word bucket = index->hashes[i] & (index->bucket_num - 1);
+        index->chain[i] = index->buckets[bucket];
+        index->buckets[bucket] = i;
     }
+    return NULL;
+}
 
-    // Create breakpoint at the beginning of our function
-    unsigned long data = ptrace(PTRACE_PEEKTEXT, child_pid, (void*)address, NULL);
-    unsigned long trap = ((data & 0xFFFFFFFFFFFFFF00) | 0xCC);
-    ptrace(PTRACE_POKETEXT, child_pid, (void*)address, (void*)trap);
+// Name: symIndexRun
+// One round: work on every worker, each on a thread of its own (or on ours, if there's no thread for it)
+void symIndexRun(SymIndexWorker* workers, int worker_num, void* (*work)(void*))
+{
+    for(int w = 1; w < worker_num; w++) {
+        workers[w].started = pthread_create(&workers[w].thread, NULL, work, &workers[w]) == 0;
+    }
+    work(&workers[0]);
+    for(int w = 1; w < worker_num; w++)
+    {
+        if(workers[w].started) {
+            pthread_join(workers[w].thread, NULL);
+        }
+        else {
+            work(&workers[w]);
+        }
+    }
+}
 
-    // Wait for child to get to Breakpoint
-    ptrace(PTRACE_CONT, child_pid, NULL, NULL);
-    waitpid(child_pid, &wait_status, 0);
+void symIndexFree(SymIndex* index)
+{
+    if(index->mapping != NULL)                                                              // the whole thing is one cache file mapping
+    {
+        munmap(index->mapping, index->mapping_size);
+        memset(index, 0, sizeof(SymIndex));
+        return;
+    }
+    free(index->buckets);
+    free(index->chain);
+    free(index->hashes);
+    index->buckets = index->chain = index->hashes = NULL;
+    index->bucket_num = 0;
+}
 
-    // Child reached breakpont
-    while (WIFSTOPPED(wait_status))
+// Name: strtabFind
+// Recieves a string table and a name, and room for max_offsets offsets
+// Finds every offset the string there is exactly name at: every "name\0" in the table, not just "\0name\0" - the
+// linker merges a name into the tail of a longer one ("bar" can start in the middle of "foobar"). 16 starts at a
+// time with SSE2: compares for the first character, the last one and the '\0' after it (names in one table tend
+// to share a prefix - "func_12" and "func_34" - the last character tells them apart), and a memcmp for the few
+// starts where all three hit.
+// Returns how many there are (only the first max_offsets of them are stored)
+int strtabFind(const char* strs, unsigned long strs_size, const char* name, Elf64_Word* offsets, int max_offsets)
+{
+    unsigned long len = strlen(name);
+    if(len == 0 || strs_size < len + 1) {
+        return 0;
+    }
+    unsigned long end = strs_size - len;                                                    // starts < end leave room for the '\0'
+    unsigned long pos = 0;
+    int found = 0;
+#ifdef __SSE2__
+    __m128i first = _mm_set1_epi8(name[0]);
+    __m128i last = _mm_set1_epi8(name[len - 1]);
+    __m128i zero = _mm_setzero_si128();
+    for(; pos + 16 <= end; pos += 16)
     {
-        ptrace(PTRACE_GETREGS, child_pid, 0, &regs);                                        // Get registers of child
-        if(regs.rip - 0x1 == address)                                                       // Check location of breakpoint (start of func or end of func)
+        __m128i starts = _mm_loadu_si128((const __m128i*)(strs + pos));
+        __m128i lasts = _mm_loadu_si128((const __m128i*)(strs + pos + len - 1));
+        __m128i ends = _mm_loadu_si128((const __m128i*)(strs + pos + len));
+        __m128i both = _mm_and_si128(_mm_cmpeq_epi8(starts, first), _mm_cmpeq_epi8(lasts, last));
+        unsigned int hits = _mm_movemask_epi8(_mm_and_si128(both, _mm_cmpeq_epi8(ends, zero)));
+        for(; hits != 0; hits &= hits - 1)
         {
-            // Fix RIP and Remove breakpoint opcode
-            regs.rip--;
-            ptrace(PTRACE_SETREGS, child_pid, 0, &regs);
-            ptrace(PTRACE_POKETEXT, child_pid, (void*)address, (void*)data);
-            counter++;
+            unsigned long at = pos + __builtin_ctz(hits);
+            if(memcmp(strs + at + 1, name + 1, len - 1) == 0 && found++ < max_offsets) {
+                offsets[found - 1] = at;
+            }
+        }
+    }
+#endif
+    for(; pos < end; pos++)                                                                 // the tail (or all of it without SSE2)
+    {
+        if(strs[pos] == name[0] && strs[pos + len] == '\0' && memcmp(strs + pos + 1, name + 1, len - 1) == 0 &&
+           found++ < max_offsets) {
+            offsets[found - 1] = pos;
+        }
+    }
+    return found;
+}
 
-            // Set breakpoint at the end of the func
-            ret_address = ptrace(PTRACE_PEEKTEXT, child_pid, regs.rsp, NULL);
-            ret_data = ptrace(PTRACE_PEEKTEXT, child_pid, (void*)ret_address, NULL);
-            unsigned long ret_trap = ((ret_data & 0xFFFFFFFFFFFFFF00) | 0xCC);
-            ptrace(PTRACE_POKETEXT, child_pid, (void*)ret_address, (void*)ret_trap);
+// Name: symIndexScan
+// Lookup without an index: strtabFind, then one pass over the table that only compares st_name with the offsets
+// it found - no hashing, no strcmp, no jumping around the string table. Cheaper than building the index for the
+// few names prf looks up; symIndexLookup builds it once SYM_SCAN_MAX_LOOKUPS names were scanned for.
+// Returns what symIndexLookup returns (-1 if it can't: unknown table size, or the name's everywhere)
+int symIndexScan(SymIndex* index, const char* name, int* matches, int max_matches)
+{
+    if(index->strs_size == 0) {
+        return -1;
+    }
+    Elf64_Word offsets[SYM_SCAN_MAX_OFFSETS];
+    int offset_num = strtabFind(index->strs, index->strs_size, name, offsets, SYM_SCAN_MAX_OFFSETS);
+    if(offset_num > SYM_SCAN_MAX_OFFSETS) {
+        return -1;
+    }
+    index->scans++;
 
-            // Continue until func returns
-            ptrace(PTRACE_CONT, child_pid, NULL, NULL);
-            waitpid(child_pid, &wait_status, 0);
+    int found = 0;
+    Elf64_Sym* syms = index->syms;
+    if(offset_num == 1)                                                                     // the usual case: one compare per symbol
+    {
+        Elf64_Word offset = offsets[0];
+        for(int i = 1; i < index->sym_num; i++)
+        {
+            if(syms[i].st_name == offset && (matches[found++] = i, found == max_matches)) {
+                break;
+            }
         }
-        else if(regs.rip - 0x1 == ret_address && ret_address != 0)
+        return found;
+    }
+    for(int i = 1; i < index->sym_num && found < max_matches && offset_num > 0; i++)      // ascending, like the built index
+    {
+        for(int o = 0; o < offset_num; o++)
         {
-            // Fix RIP and Remove breakpoint opcode
-            regs.rip--;
-            ptrace(PTRACE_SETREGS, child_pid, 0, &regs);
-            ptrace(PTRACE_POKETEXT, child_pid, (void*)ret_address, (void*)ret_data);
-
-            if(is_dyn && first_br)
+            if(syms[i].st_name == offsets[o])
             {
-                address = ptrace(PTRACE_PEEKTEXT, child_pid, (void*)got_offset, NULL);
-                data = ptrace(PTRACE_PEEKTEXT, child_pid, (void*)address, NULL);
-                trap = ((data & 0xFFFFFFFFFFFFFF00) | 0xCC);
-                first_br = false;
+                matches[found++] = i;
+                break;
             }
-
-            // Set breakpoint at the beginnig of func
-            ptrace(PTRACE_POKETEXT, child_pid, (void*)address, (void*)trap);
-
-            // Print ret val (in RAX)
-            int res = regs.rax;
-            printf("PRF:: run #%d returned with %d\n", counter, res);
-            ptrace(PTRACE_CONT, child_pid, NULL, NULL);
-            waitpid(child_pid, &wait_status, 0);
         }
     }
-    
-    if(WIFEXITED(wait_status)) {
-        return;
+    return found;
+}
+
+// Name: symNameIs
+// Whether symbol i is called name - a st_name past the end of the strings is nobody's name
+static inline bool symNameIs(SymIndex* index, int i, const char* name)
+{
+    Elf64_Word offset = index->syms[i].st_name;
+    if(index->strs_size == 0) {
+        return strcmp(index->strs + offset, name) == 0;
     }
+    size_t len = strlen(name);
+    return offset < index->strs_size && len < index->strs_size - offset && memcmp(index->strs + offset, name, len + 1) == 0;
 }
 
-// This is MAIN
-int main(int argc, char *argv[])
+// Name: symIndexLookup
+// Recieves the index, a name, and room for max_matches symbol indices
+// Returns how many symbols are called name (a name can show up a few times - locals from different files, UND + def..),
+// with matches[] sorted ascending, so matches[0] is the first occurrence in the table.
+int symIndexLookup(SymIndex* index, const char* name, int* matches, int max_matches)
 {
-    char* file_name = argv[2];                                                              // save name of executable file
-    char* func_name = argv[1];                                                              // save name of function to run
-    unsigned long func_addr = 0;
-    bool is_dyn = false;
-    
-    if (checkExecutable(file_name) != SUCCESS)                                              // part 1 - check if the file is an executable
+    int found = 0;
+
+    if(index->sysv_hash != NULL && index->buckets == NULL)                                   // .hash: nbucket, nchain, bucket[], chain[]
     {
-        printf("PRF:: %s not an executable! :(\n",  file_name);  
-        return 1;
-    }                  
-                                                                                      
-    SearchStatus res = checkFunction(file_name, func_name, &func_addr, &is_dyn);                                        
-    if (res == ERROR){
-        return 1;
+        Elf64_Word bucket_num = index->sysv_hash[0];
+        Elf64_Word* buckets = &index->sysv_hash[2];
+        Elf64_Word* chain = &buckets[bucket_num];
+        Elf64_Word steps = 0;                                                               // a looping chain ends too
+        for(Elf64_Word i = buckets[sysvHash(name) % bucket_num]; i != 0 && i < index->hash_limit && steps < index->hash_limit && found < max_matches; i = chain[i], steps++)
+        {
+            if(symNameIs(index, i, name)) {
+                matches[found++] = i;
+            }
+        }
     }
 
-    if (res == SYM_NOT_FOUND){                                                              // part 2 - check if func exists
-        printf("PRF:: %s not found!\n", func_name);
-        return 1;
-    }
-    if (res == SYM_NOT_GLOBAL){                                                             // part 3 - check if func is global
-        printf("PRF:: %s is not a global symbol! :(\n", func_name);
-        return 1;
+    else if(index->gnu_hash != NULL && index->buckets == NULL)                               // .gnu.hash: nbuckets, symoffset, bloom_size, bloom_shift, bloom[], buckets[], chain[]
+    {
+        Elf64_Word bucket_num = index->gnu_hash[0];
+        Elf64_Word sym_offset = index->gnu_hash[1];
+        Elf64_Word bloom_size = index->gnu_hash[2];
+        Elf64_Word bloom_shift = index->gnu_hash[3];
+        Elf64_Xword* bloom = (Elf64_Xword*)&index->gnu_hash[4];
+        Elf64_Word* buckets = (Elf64_Word*)&bloom[bloom_size];
+        Elf64_Word* chain = &buckets[bucket_num];
+
+        Elf64_Word h = gnuHash(name);
+        Elf64_Xword word = bloom[(h / 64) % bloom_size];
+        Elf64_Xword mask = (1UL << (h % 64)) | (1UL << ((h >> bloom_shift) % 64));
+        Elf64_Word i = buckets[h % bucket_num];
+        if((word & mask) == mask && i >= sym_offset)
+        {
+            for(; i < index->hash_limit && found < max_matches; i++)
+            {
+                Elf64_Word h2 = chain[i - sym_offset];
+                if((h | 1) == (h2 | 1) && symNameIs(index, i, name)) {
+                    matches[found++] = i;
+                }
+                if(h2 & 1) {                                                                // lowest bit marks the end of the chain
+                    break;
+                }
+            }
+        }
+        if(found == 0)                                                                      // UND symbols aren't in .gnu.hash - scan / ask the built index
+        {
+            int scanned = index->scans < SYM_SCAN_MAX_LOOKUPS ? symIndexScan(index, name, matches, max_matches) : -1;
+            if(scanned >= 0) {
+                return scanned;
+            }
+            if(symIndexBuild(index)) {
+                return symIndexLookup(index, name, matches, max_matches);
+            }
+        }
     }
 
-    pid_t child_pid = runTarget(file_name, argv);
-    Debug(child_pid, func_addr, is_dyn);
-    return 0;
-}
+    else                                                                                    // our own index
+    {
+        int scanned = (index->buckets == NULL && index->scans < SYM_SCAN_MAX_LOOKUPS) ? symIndexScan(index, name, matches, max_matches) : -1;
+        if(scanned >= 0) {
+            return scanned;
+        }
+        if(index->buckets == NULL && !symIndexBuild(index)) {
+            return 0;
+        }
+        Elf64_Word h = gnuHash(name);
+        for(Elf64_Word i = index->buckets[h & (index->bucket_num - 1)]; i != 0 && found < max_matches; i = index->chain[i])
+        {
+            if(index->hashes[i] == h && symNameIs(index, i, name)) {
+                matches[found++] = i;
+            }
+        }
+        return found;                                                                       // already ascending
+    }
 
+    for(int i = 1; i < found; i++)                                                          // native chains are in whatever order - insertion sort the few we got
+    {
+        int m = matches[i], j = i;
+        for(; j > 0 && matches[j - 1] > m; j--) {
+            matches[j] = matches[j - 1];
+        }
+        matches[j] = m;
+    }
+    return found;
+}
+
+
+// Name: findSymbol
+// Recieves the symbol index & a func
+// Sets func->status (exists there/not/if global..) and takes the address of the first occurrence (0 if it's UND).
+void findSymbol(SymIndex* index, TracedFunc* func)
+{
+    int matches[MAX_SYM_MATCHES];
+    int match_num = symIndexLookup(index, func->name, matches, MAX_SYM_MATCHES);
+    if(match_num == 0) {
+        func->status = SYM_NOT_FOUND;
+        return;
+    }
+
+    func->status = SUCCESS;
+    for(int m = 0; m < match_num; m++)
+    {
+        if(ELF64_ST_BIND(index->syms[matches[m]].st_info) != GLOBAL) {                     // a non global occurrence beats everything
+            func->status = SYM_NOT_GLOBAL;
+        }
+    }
+    Elf64_Sym* first = &index->syms[matches[0]];
+    func->address = (first->st_shndx != SHN_UNDEF) ? first->st_value : 0;
+    if(func->address != 0 && ELF64_ST_TYPE(first->st_info) == STT_GNU_IFUNC)                // the function is whatever the resolver returns
+    {
+        func->ifunc_resolver = func->address;
+        func->address = 0;
+    }
+}
+
+
+// ======================================================================================================================================
+// --------------------------------------------------- Symbol Index Cache ---------------------------------------------------------------
+// ======================================================================================================================================
+//
+// A built .symtab index, saved as one file that we can mmap and point a SymIndex straight into:
+//      SymCacheHeader | buckets[bucket_num] | chain[sym_num] | hashes[sym_num] | syms[sym_num] | strs[strs_size]
+// The file is named after the binary's build-id (or dev+inode when there is none) and its header holds the full key,
+// so a rebuilt / touched binary just doesn't match and the entry gets rebuilt over.
+
+// Name: readBuildId
+// Recieves the elf file, and room for the id
+// Returns the length of the NT_GNU_BUILD_ID note's descriptor (0 if the binary has none)
+int readBuildId(ElfImage* elf, unsigned char* build_id, int max_len)
+{
+    for(int i = elfSectionByType(elf, SHT_NOTE); i != 0; i = elfNextOfType(elf, i))
+    {
+        unsigned long offset = 0;
+        ElfNote note;
+        while(elfNextNote(elf, i, &offset, &note))
+        {
+            if(note.type == NT_GNU_BUILD_ID && note.name_size == 4 && memcmp(note.name, "GNU", 4) == 0)
+            {
+                int len = note.desc_size < (Elf64_Word)max_len ? (int)note.desc_size : max_len;
+                memcpy(build_id, note.desc, len);
+                return len;
+            }
+        }
+    }
+    return 0;
+}
+
+// Name: makeCacheKey
+// Fills the key part of a cache header for the open binary + builds the cache file path
+// Returns false if the path doesn't fit
+bool makeCacheKey(ElfImage* elf, Elf64_Shdr* symtab_header, Elf64_Shdr* strtab_header,
+                  SymCacheHeader* key, char* path, int path_size)
+{
+    memset(key, 0, sizeof(SymCacheHeader));
+    memcpy(key->magic, SYM_CACHE_MAGIC, sizeof(key->magic));
+    key->version = SYM_CACHE_VERSION;
+    key->symtab_size = symtab_header->sh_size;                                              // strip keeps the build-id but not the symtab
+    key->strtab_size = strtab_header->sh_size;
+
+    char name[2 * SYM_CACHE_KEY_SIZE + 32];
+    int id_len = readBuildId(elf, key->key, SYM_CACHE_KEY_SIZE);
+    if(id_len > 0)
+    {
+        key->key_type = SYM_CACHE_KEY_BUILD_ID;
+        key->key_len = id_len;
+        for(int i = 0; i < id_len; i++) {
+            sprintf(name + 2 * i, "%02x", key->key[i]);
+        }
+        strcpy(name + 2 * id_len, ".idx");
+    }
+    else
+    {
+        struct stat st;
+        if(fstat(elf->fd, &st) != 0) {
+            return false;
+        }
+        unsigned long fields[5] = { st.st_dev, st.st_ino, st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec };
+        key->key_type = SYM_CACHE_KEY_INODE;
+        key->key_len = sizeof(fields);
+        memcpy(key->key, fields, sizeof(fields));
+        sprintf(name, "ino-%lx-%lx.idx", fields[0], fields[1]);                             // one file per binary - a new mtime overwrites it
+    }
+    return snprintf(path, path_size, "%s/%s", options.cache_dir, name) < path_size;
+}
+
+// Name: symCacheValid
+// The cache file is only a file: every size and offset in the header has to fit in it, every bucket / chain entry
+// has to be a symbol (and a chain has to go up, so it ends), every name has to be in the strings.
+static bool symCacheValid(const SymCacheHeader* header, const unsigned char* cache, unsigned long file_size)
+{
+    unsigned long words_end = sizeof(SymCacheHeader) + (header->bucket_num + 2UL * header->sym_num) * sizeof(Elf64_Word);
+    if(header->bucket_num == 0 || (header->bucket_num & (header->bucket_num - 1)) != 0 || header->sym_num == 0 ||
+       header->syms_offset % 8 != 0 || header->syms_offset < words_end || header->strs_offset > file_size ||
+       header->strs_offset < header->syms_offset ||
+       (header->strs_offset - header->syms_offset) / sizeof(Elf64_Sym) < header->sym_num ||
+       header->strtab_size == 0 || header->strtab_size > file_size - header->strs_offset ||
+       cache[header->strs_offset + header->strtab_size - 1] != '\0')
+    {
+        return false;
+    }
+    const Elf64_Word* buckets = (const Elf64_Word*)(cache + sizeof(SymCacheHeader));
+    const Elf64_Word* chain = buckets + header->bucket_num;
+    const Elf64_Sym* syms = (const Elf64_Sym*)(cache + header->syms_offset);
+    for(Elf64_Word b = 0; b < header->bucket_num; b++)
+    {
+        if(buckets[b] >= header->sym_num) {
+            return false;
+        }
+    }
+    for(Elf64_Word i = 0; i < header->sym_num; i++)
+    {
+        if((chain[i] != 0 && (chain[i] <= i || chain[i] >= header->sym_num)) || syms[i].st_name >= header->strtab_size) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Name: symCacheOpen
+// Tries to point index at a valid cache entry for this binary
+// Returns true on a hit (index is then backed by the mmap'd cache file), false if there is no entry or it's stale
+bool symCacheOpen(const char* path, SymCacheHeader* key, SymIndex* index)
+{
+    int fd = open(path, O_RDONLY);
+    if(fd == -1) {
+        return false;
+    }
+    struct stat st;
+    SymCacheHeader header;
+    if(fstat(fd, &st) != 0 || pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+       memcmp(&header, key, offsetof(SymCacheHeader, sym_num)) != 0 ||                     // magic + version + key + section sizes
+       header.file_size != (unsigned long)st.st_size)                                       // half written / truncated
+    {
+        close(fd);
+        return false;
+    }
+
+    void* cache = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(cache == MAP_FAILED) {
+        return false;
+    }
+    if(!symCacheValid(&header, cache, st.st_size))                                          // corrupt - the caller builds (and stores) a new one
+    {
+        munmap(cache, st.st_size);
+        return false;
+    }
+
+    Elf64_Word* words = (Elf64_Word*)(cache + sizeof(SymCacheHeader));
+    memset(index, 0, sizeof(SymIndex));
+    index->bucket_num = header.bucket_num;
+    index->sym_num = header.sym_num;
+    index->buckets = words;
+    index->chain = words + header.bucket_num;
+    index->hashes = index->chain + header.sym_num;
+    index->syms = (Elf64_Sym*)(cache + header.syms_offset);
+    index->strs = (char*)(cache + header.strs_offset);
+    index->strs_size = header.strtab_size;
+    index->mapping = cache;
+    index->mapping_size = st.st_size;
+    return true;
+}
+
+// Name: symCacheStore
+// Writes a built index to path (through a temp file + rename, so a reader never sees half of it)
+// Failing to store is not an error - the next run just builds it again.
+void symCacheStore(const char* path, SymCacheHeader* key, SymIndex* index, unsigned long strs_size)
+{
+    SymCacheHeader header = *key;
+    unsigned long words_size = (index->bucket_num + 2UL * index->sym_num) * sizeof(Elf64_Word);
+    header.sym_num = index->sym_num;
+    header.bucket_num = index->bucket_num;
+    header.syms_offset = (sizeof(SymCacheHeader) + words_size + 7) & ~7UL;                  // keep the Elf64_Sym array 8-aligned
+    header.strs_offset = header.syms_offset + index->sym_num * sizeof(Elf64_Sym);
+    header.file_size = header.strs_offset + strs_size;
+
+    char tmp_path[PATH_MAX];
+    if(snprintf(tmp_path, sizeof(tmp_path), "%s.tmp.%d", path, getpid()) >= (int)sizeof(tmp_path)) {
+        return;
+    }
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1) {
+        return;
+    }
+    ssize_t buckets_size = index->bucket_num * sizeof(Elf64_Word), chain_size = index->sym_num * sizeof(Elf64_Word);
+    ssize_t syms_size = index->sym_num * sizeof(Elf64_Sym);
+    bool ok = pwrite(fd, &header, sizeof(header), 0) == sizeof(header) &&
+              pwrite(fd, index->buckets, buckets_size, sizeof(header)) == buckets_size &&
+              pwrite(fd, index->chain, chain_size, sizeof(header) + buckets_size) == chain_size &&
+              pwrite(fd, index->hashes, chain_size, sizeof(header) + buckets_size + chain_size) == chain_size &&
+              pwrite(fd, index->syms, syms_size, header.syms_offset) == syms_size &&
+              pwrite(fd, index->strs, strs_size, header.strs_offset) == (ssize_t)strs_size;
+    close(fd);
+    if(!ok || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+    }
+}
+
+// ======================================================================================================================================
+// ------------------------------------------------------- Remote Memory ----------------------------------------------------------------
+// ======================================================================================================================================
+//
+// Everything we read / write in the child goes through here. Reads are batched with process_vm_readv into a few
+// cached pages, writes go byte-exact through /proc/<pid>/mem. Cached pages live until the child is resumed,
+// except text pages we put breakpoints on - only we ever change those, so they stay (writes go through the cache).
+// If /proc/<pid>/mem can't be opened (or --peekpoke) we go back to word-at-a-time PEEKTEXT/POKETEXT.
+
+// Name: tracePtrace / traceWait
+// ptrace() / waitpid() that count themselves into stats.syscalls (--syscall-stats)
+long tracePtrace(enum __ptrace_request request, pid_t pid, void* addr, void* data)
+{
+    stats.syscalls++;
+    return ptrace(request, pid, addr, data);
+}
+
+pid_t traceWait(pid_t pid, int* wait_status)
+{
+    pid_t res;
+    do
+    {
+        stats.syscalls++;
+        res = waitpid(pid, wait_status, __WALL);                                            // threads other than the first aren't "children"
+    } while(res == -1 && errno == EINTR && pid != -1);                                      // waiting for any thread is where a detach request stops us
+    return res;
+}
+
+// Name: loopSignalAdd / loopWait
+// Signals that wake up Debug's event loop - SIGALRM (the sampler's tick), SIGINT / SIGTERM (--pid: detach). They are
+// blocked from when they're added on, so they never cut our own work short, and only taken in loopWait with
+// sigwaitinfo, together with SIGCHLD. Every sleep there comes after a look for a stopped thread (WNOHANG), and a
+// signal that comes in between stays pending for the sleep - none is ever missed.
+// loopWait is traceWait(-1) that returns -1 / EINTR when one came (sample_tick / detach_requested say which).
+void loopSignalAdd(int sig)
+{
+    if(!loop_signals_on)
+    {
+        sigemptyset(&loop_signals);
+        sigaddset(&loop_signals, SIGCHLD);                                                  // (blocked, it's kept even though its default is to ignore it)
+        loop_signals_on = true;
+    }
+    sigaddset(&loop_signals, sig);
+    sigprocmask(SIG_BLOCK, &loop_signals, NULL);
+}
+
+pid_t loopWait(int* wait_status)
+{
+    if(!loop_signals_on) {
+        return traceWait(-1, wait_status);
+    }
+    for(;;)
+    {
+        stats.syscalls++;
+        pid_t tid = waitpid(-1, wait_status, __WALL | WNOHANG);
+        if(tid != 0) {
+            return tid;
+        }
+        siginfo_t info;
+        stats.syscalls++;
+        if(sigwaitinfo(&loop_signals, &info) == -1) {
+            continue;
+        }
+        if(info.si_signo == SIGALRM) {
+            sample_tick = 1;
+        }
+        else if(info.si_signo != SIGCHLD) {
+            detach_requested = 1;
+        }
+        if(sample_tick || detach_requested)
+        {
+            errno = EINTR;
+            return -1;
+        }
+    }
+}
+
+// Name: remoteInit / remoteClose
+// Must be called after the child exec'd - the mem file belongs to the address space it was opened on
+void remoteInit(RemoteMem* mem, pid_t pid)
+{
+    memset(mem, 0, sizeof(RemoteMem));
+    mem->pid = pid;
+    mem->mem_fd = -1;
+    if(!options.peekpoke)
+    {
+        char path[32];
+        sprintf(path, "/proc/%d/mem", pid);
+        mem->mem_fd = open(path, O_RDWR);
+        stats.syscalls++;
+    }
+}
+
+void remoteClose(RemoteMem* mem)
+{
+    if(mem->mem_fd != -1) {
+        close(mem->mem_fd);
+    }
+    mem->mem_fd = -1;
+}
+
+// Name: remoteFetch
+// Recieves page addresses (page aligned, not cached yet) and reads all of them in ONE process_vm_readv. If the
+// batch read fails the pages are read one by one through the mem file.
+// Returns false if a page couldn't be read, or there's no slot left for one (the rest are sticky)
+bool remoteFetch(RemoteMem* mem, unsigned long* page_addrs, int page_num, bool sticky)
+{
+    if(page_num <= 0 || page_num > REMOTE_CACHE_PAGES) {
+        return page_num == 0;
+    }
+    struct iovec local[REMOTE_CACHE_PAGES] = { { 0 } }, remote[REMOTE_CACHE_PAGES] = { { 0 } };  // (gcc can't tell the loop fills them)
+    int slots[REMOTE_CACHE_PAGES];
+    bool taken[REMOTE_CACHE_PAGES] = { false };                                             // by an earlier page of this batch
+    for(int p = 0; p < page_num; p++)
+    {
+        int slot = mem->next_victim;                                                        // round robin, but never evict a sticky page for a normal one
+        int tries = 0;
+        for(; tries < REMOTE_CACHE_PAGES && (taken[slot] || (mem->pages[slot].sticky && !sticky)); tries++) {
+            slot = (slot + 1) % REMOTE_CACHE_PAGES;
+        }
+        if(tries == REMOTE_CACHE_PAGES) {
+            return false;
+        }
+        taken[slot] = true;
+        mem->next_victim = (slot + 1) % REMOTE_CACHE_PAGES;
+        mem->pages[slot].address = 0;
+        slots[p] = slot;
+        local[p].iov_base = mem->pages[slot].data;
+        local[p].iov_len = REMOTE_PAGE_SIZE;
+        remote[p].iov_base = (void*)page_addrs[p];
+        remote[p].iov_len = REMOTE_PAGE_SIZE;
+    }
+
+    stats.syscalls++;
+    bool batched = process_vm_readv(mem->pid, local, page_num, remote, page_num, 0) == (ssize_t)(page_num * REMOTE_PAGE_SIZE);
+    for(int p = 0; p < page_num; p++)
+    {
+        if(!batched)                                                                        // e.g. execute-only text - the mem file reads it anyway
+        {
+            stats.syscalls++;
+            if(pread(mem->mem_fd, mem->pages[slots[p]].data, REMOTE_PAGE_SIZE, page_addrs[p]) != REMOTE_PAGE_SIZE) {
+                return false;
+            }
+        }
+        mem->pages[slots[p]].address = page_addrs[p];
+        mem->pages[slots[p]].sticky = sticky;
+    }
+    return true;
+}
+
+static inline RemotePage* remoteCached(RemoteMem* mem, unsigned long page_addr)
+{
+    if(page_addr == 0) {                                                                    // address 0 is an empty slot
+        return NULL;
+    }
+    for(int i = 0; i < REMOTE_CACHE_PAGES; i++)
+    {
+        if(mem->pages[i].address == page_addr) {
+            return &mem->pages[i];
+        }
+    }
+    return NULL;
+}
+
+// Name: remoteReadDirect
+// remoteRead that doesn't go through the cache: a pread of the mem file per read
+static bool remoteReadDirect(RemoteMem* mem, RemoteIov* reads, int read_num)
+{
+    for(int r = 0; r < read_num; r++)
+    {
+        stats.syscalls++;
+        if(pread(mem->mem_fd, reads[r].buf, reads[r].len, reads[r].address) != (ssize_t)reads[r].len) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Name: remoteRead
+// Recieves a list of (address, length) reads in the child and does all of them with one batched fetch of
+// the pages that aren't cached yet. sticky = these are text pages only we modify (keep them across resumes).
+// Reads that don't fit the cache (too many pages for one batch, no slot that isn't sticky) bypass it.
+// Returns false if any of them couldn't be read.
+bool remoteRead(RemoteMem* mem, RemoteIov* reads, int read_num, bool sticky)
+{
+    if(mem->mem_fd == -1)                                                                   // old school - a word at a time
+    {
+        for(int r = 0; r < read_num; r++)
+        {
+            unsigned char* out = reads[r].buf;
+            for(unsigned long done = 0; done < reads[r].len; )                              // aligned words - never one past the last page
+            {
+                unsigned long word_addr = (reads[r].address + done) & ~(sizeof(long) - 1);
+                unsigned long offset = (reads[r].address + done) - word_addr;
+                unsigned long n = sizeof(long) - offset < reads[r].len - done ? sizeof(long) - offset : reads[r].len - done;
+                errno = 0;                                                                  // -1 is also a word the text can hold
+                long word = tracePtrace(PTRACE_PEEKTEXT, mem->pid, (void*)word_addr, NULL);
+                if(errno != 0) {
+                    return false;
+                }
+                memcpy(out + done, (unsigned char*)&word + offset, n);
+                done += n;
+            }
+        }
+        return true;
+    }
+
+    unsigned long missing[REMOTE_CACHE_PAGES];
+    int missing_num = 0;
+    for(int r = 0; r < read_num; r++)
+    {
+        unsigned long first = reads[r].address & ~(REMOTE_PAGE_SIZE - 1);
+        unsigned long last = (reads[r].address + reads[r].len - 1) & ~(REMOTE_PAGE_SIZE - 1);
+        for(unsigned long page = first; page <= last; page += REMOTE_PAGE_SIZE)
+        {
+            bool listed = remoteCached(mem, page) != NULL;
+            for(int m = 0; m < missing_num && !listed; m++) {
+                listed = (missing[m] == page);
+            }
+            if(!listed && missing_num == REMOTE_CACHE_PAGES / 2) {                          // don't let one batch flush the whole cache
+                return remoteReadDirect(mem, reads, read_num);
+            }
+            if(!listed) {
+                missing[missing_num++] = page;
+            }
+        }
+    }
+    if(missing_num > 0 && !remoteFetch(mem, missing, missing_num, sticky)) {
+        return remoteReadDirect(mem, reads, read_num);
+    }
+
+    for(int r = 0; r < read_num; r++)
+    {
+        for(unsigned long done = 0; done < reads[r].len; )
+        {
+            unsigned long address = reads[r].address + done;
+            RemotePage* page = remoteCached(mem, address & ~(REMOTE_PAGE_SIZE - 1));
+            unsigned long offset = address & (REMOTE_PAGE_SIZE - 1);
+            unsigned long n = REMOTE_PAGE_SIZE - offset;
+            n = (n < reads[r].len - done) ? n : reads[r].len - done;
+            memcpy((unsigned char*)reads[r].buf + done, page->data + offset, n);
+            done += n;
+        }
+    }
+    return true;
+}
+
+// Name: remoteReadWord
+// The common case of remoteRead - one word
+// Returns false if it couldn't be read (word is 0 then)
+bool remoteReadWord(RemoteMem* mem, unsigned long address, unsigned long* word)
+{
+    *word = 0;
+    RemoteIov read = { address, word, sizeof(*word) };
+    return remoteRead(mem, &read, 1, false);
+}
+
+// Name: remoteWrite
+// Writes len bytes into the child (text included - the mem file ignores page protections for a tracer)
+// Returns false on failure.
+bool remoteWrite(RemoteMem* mem, unsigned long address, const void* buf, unsigned long len)
+{
+    if(mem->mem_fd == -1)                                                                   // peek-modify-poke every word we touch
+    {
+        for(unsigned long done = 0; done < len; )
+        {
+            unsigned long word_addr = (address + done) & ~(sizeof(long) - 1);
+            unsigned long offset = (address + done) - word_addr;
+            unsigned long n = sizeof(long) - offset < len - done ? sizeof(long) - offset : len - done;
+            errno = 0;
+            long word = tracePtrace(PTRACE_PEEKTEXT, mem->pid, (void*)word_addr, NULL);
+            if(errno != 0) {                                                                // don't poke back a word we never read
+                return false;
+            }
+            memcpy((unsigned char*)&word + offset, (const unsigned char*)buf + done, n);
+            if(tracePtrace(PTRACE_POKETEXT, mem->pid, (void*)word_addr, (void*)word) == -1) {
+                return false;
+            }
+            done += n;
+        }
+        return true;
+    }
+
+    stats.syscalls++;
+    if(pwrite(mem->mem_fd, buf, len, address) != (ssize_t)len) {
+        return false;
+    }
+    for(unsigned long done = 0; done < len; )                                               // write through the cache
+    {
+        RemotePage* page = remoteCached(mem, (address + done) & ~(REMOTE_PAGE_SIZE - 1));
+        unsigned long offset = (address + done) & (REMOTE_PAGE_SIZE - 1);
+        unsigned long n = REMOTE_PAGE_SIZE - offset < len - done ? REMOTE_PAGE_SIZE - offset : len - done;
+        if(page != NULL) {
+            memcpy(page->data + offset, (const unsigned char*)buf + done, n);
+        }
+        done += n;
+    }
+    return true;
+}
+
+// Name: remoteResume
+// The child is about to run - forget every page it could change. Call before every PTRACE_CONT.
+void remoteResume(RemoteMem* mem)
+{
+    for(int i = 0; i < REMOTE_CACHE_PAGES; i++)
+    {
+        if(!mem->pages[i].sticky) {
+            mem->pages[i].address = 0;
+        }
+    }
+}
+
+// Name: remoteSyscall
+// Makes the (stopped) child run one syscall for us: syscall; int3 goes over the bytes at rip for a moment,
+// registers are set up, and everything is put back after. Only call it at a signal stop (not a syscall stop).
+// Returns the syscall's return value (-errno on failure).
+long remoteSyscall(RemoteMem* mem, long nr, long a1, long a2, long a3, long a4, long a5, long a6)
+{
+    struct user_regs_struct saved, regs;
+    unsigned char orig[3], code[3] = { 0x0F, 0x05, 0xCC };                                 // syscall; int3
+    int wait_status;
+
+    tracePtrace(PTRACE_GETREGS, mem->pid, 0, &saved);
+    RemoteIov read = { saved.rip, orig, sizeof(orig) };
+    if(!remoteRead(mem, &read, 1, false) || !remoteWrite(mem, saved.rip, code, sizeof(code))) {
+        return -1;
+    }
+    regs = saved;
+    regs.orig_rax = -1;                                                                     // not in a syscall - the kernel mustn't "restart" it
+    regs.rax = nr;
+    regs.rdi = a1;
+    regs.rsi = a2;
+    regs.rdx = a3;
+    regs.r10 = a4;
+    regs.r8 = a5;
+    regs.r9 = a6;
+    tracePtrace(PTRACE_SETREGS, mem->pid, 0, &regs);
+    resumeChild(mem, 0);
+    traceWait(mem->pid, &wait_status);
+    tracePtrace(PTRACE_GETREGS, mem->pid, 0, &regs);
+
+    remoteWrite(mem, saved.rip, orig, sizeof(orig));
+    tracePtrace(PTRACE_SETREGS, mem->pid, 0, &saved);
+    return WIFSTOPPED(wait_status) ? (long)regs.rax : -1;
+}
+
+// Name: resumeChild
+// remoteResume + PTRACE_CONT (with sig, 0 = no signal). Ends a stop for --max-overhead.
+void resumeChild(RemoteMem* mem, int sig)
+{
+    if(sampler.running) {
+        sampler.resumed = nowNs();
+    }
+    remoteResume(mem);
+    tracePtrace(PTRACE_CONT, mem->pid, NULL, (void*)(long)sig);
+}
+
+// ======================================================================================================================================
+// -------------------------------------------------------- Breakpoints -----------------------------------------------------------------
+// ======================================================================================================================================
+
+// Name: bpTableInit / bpLookup / bpGetSlot
+// The breakpoint table. bpLookup returns NULL if we never put a breakpoint on address,
+// bpGetSlot returns the slot of address and creates an empty one if needed (NULL if out of memory).
+bool bpTableInit(BreakpointTable* table, int capacity)
+{
+    table->slots = calloc(capacity, sizeof(Breakpoint));
+    table->capacity = capacity;
+    table->count = 0;
+    return table->slots != NULL;
+}
+
+static inline unsigned long bpHash(unsigned long address, int capacity)
+{
+    return (address * 0x9E3779B97F4A7C15UL >> 17) & (capacity - 1);                         // fibonacci hashing - addresses are aligned, so mix them up
+}
+
+Breakpoint* bpLookup(BreakpointTable* table, unsigned long address)
+{
+    unsigned long slot = bpHash(address, table->capacity);
+    while(table->slots[slot].address != 0)
+    {
+        if(table->slots[slot].address == address) {
+            return &table->slots[slot];
+        }
+        slot = (slot + 1) & (table->capacity - 1);
+    }
+    return NULL;
+}
+
+Breakpoint* bpGetSlot(BreakpointTable* table, unsigned long address)
+{
+    Breakpoint* bp = bpLookup(table, address);
+    if(bp != NULL) {
+        return bp;
+    }
+
+    if(2 * (table->count + 1) > table->capacity)                                           // grow at 50% load
+    {
+        BreakpointTable bigger;
+        if(!bpTableInit(&bigger, table->capacity * 2)) {
+            return NULL;
+        }
+        for(int i = 0; i < table->capacity; i++)
+        {
+            if(table->slots[i].address == 0) {
+                continue;
+            }
+            unsigned long slot = bpHash(table->slots[i].address, bigger.capacity);
+            while(bigger.slots[slot].address != 0) {
+                slot = (slot + 1) & (bigger.capacity - 1);
+            }
+            bigger.slots[slot] = table->slots[i];
+        }
+        bigger.count = table->count;
+        free(table->slots);
+        *table = bigger;
+    }
+
+    unsigned long slot = bpHash(address, table->capacity);
+    while(table->slots[slot].address != 0) {
+        slot = (slot + 1) & (table->capacity - 1);
+    }
+    bp = &table->slots[slot];
+    bp->address = address;
+    bp->inserted = false;
+    bp->orig_known = false;
+    bp->hw_slot = -1;
+    bp->entry_func = NO_FUNC;
+    bp->ret_refs = 0;
+    bp->displaced = 0;
+    table->count++;
+    return bp;
+}
+
+
+// Name: hwInsert / hwRemove
+// Execution breakpoints in the debug registers: no text is touched. The CPU traps before the instruction runs, so
+// rip is the breakpoint address itself (not +1 like after an int3), and the kernel sets the resume flag on the way
+// back so the child gets past it without us taking it out. That makes removing one free: the register stays
+// armed ("parked") and a hit on it while it's not ours is just resumed. Inserting it again - the entry of the
+// next call, the same return site in a loop - costs nothing, and DR0-DR3 / DR7 are only written when a register
+// has to be taken over (a free one first, then a parked one).
+// With --sample=N most calls are left out, and the hits of a parked register on them would cost a stop each: there
+// a removed breakpoint is switched off in DR7 (its address stays, so inserting it again is one DR7 write).
+// Returns false (nothing changed) if every register is in use or the kernel refused it.
+bool hwInsert(RemoteMem* mem, Breakpoint* bp)
+{
+    if(bp->hw_slot >= 0 && mem->hw_address[bp->hw_slot] == bp->address)                     // still parked there
+    {
+        unsigned long dr7 = mem->dr7 | (1UL << (2 * bp->hw_slot));
+        if(dr7 != mem->dr7)                                                                 // switched off (--sample)
+        {
+            if(tracePtrace(PTRACE_POKEUSER, mem->pid, (void*)(offsetof(struct user, u_debugreg) + 7 * sizeof(long)), (void*)dr7) != 0) {
+                return false;
+            }
+            mem->dr7 = dr7;
+        }
+        mem->hw_live |= 1 << bp->hw_slot;
+        return true;
+    }
+    int slot = 0;
+    while(slot < mem->hw_slots && (mem->dr7 & (1UL << (2 * slot)))) {                       // L<n> (bit 2n) off = free
+        slot++;
+    }
+    if(slot == mem->hw_slots)
+    {
+        slot = 0;
+        while(slot < mem->hw_slots && (mem->hw_live & (1 << slot))) {
+            slot++;
+        }
+        if(slot == mem->hw_slots) {
+            return false;
+        }
+    }
+    if(tracePtrace(PTRACE_POKEUSER, mem->pid, (void*)(offsetof(struct user, u_debugreg) + slot * sizeof(long)),
+                   (void*)bp->address) != 0) {
+        return false;
+    }
+    mem->hw_address[slot] = bp->address;                                                    // the bp parked here before finds out by the address
+    unsigned long dr7 = mem->dr7 | (1UL << (2 * slot));                                     // R/W and LEN stay 00 = execute, 1 byte
+    if(dr7 != mem->dr7)
+    {
+        if(tracePtrace(PTRACE_POKEUSER, mem->pid, (void*)(offsetof(struct user, u_debugreg) + 7 * sizeof(long)), (void*)dr7) != 0) {
+            return false;
+        }
+        mem->dr7 = dr7;
+    }
+    mem->hw_live |= 1 << slot;
+    bp->hw_slot = slot;
+    return true;
+}
+
+void hwRemove(RemoteMem* mem, Breakpoint* bp)
+{
+    mem->hw_live &= ~(1 << bp->hw_slot);
+    if(options.sample_every > 1)
+    {
+        unsigned long dr7 = mem->dr7 & ~(1UL << (2 * bp->hw_slot));
+        if(tracePtrace(PTRACE_POKEUSER, mem->pid, (void*)(offsetof(struct user, u_debugreg) + 7 * sizeof(long)), (void*)dr7) == 0) {
+            mem->dr7 = dr7;
+        }
+    }
+}
+
+// Name: bpInsert / bpRemove
+// Put / take out a breakpoint: a debug register if one is free (--backend=hwbp), else an int3. Only the one byte
+// is written, so two int3s that are closer than 8 bytes don't restore each other's bytes. The original byte is
+// read once, through the (sticky) text cache.
+void bpInsert(RemoteMem* mem, Breakpoint* bp)
+{
+    if(bp->inserted) {
+        return;
+    }
+    if(mem->hw_slots > 0 && hwInsert(mem, bp))
+    {
+        bp->inserted = true;
+        return;
+    }
+    bp->hw_slot = -1;                                                                       // an int3 this time
+    if(!bp->orig_known)
+    {
+        RemoteIov read = { bp->address, &bp->orig_byte, 1 };
+        if(!remoteRead(mem, &read, 1, true)) {
+            return;
+        }
+        bp->orig_known = true;
+    }
+    unsigned char trap = 0xCC;
+    bp->inserted = remoteWrite(mem, bp->address, &trap, 1);
+}
+
+void bpRemove(RemoteMem* mem, Breakpoint* bp)
+{
+    if(!bp->inserted) {
+        return;
+    }
+    if(bp->hw_slot >= 0) {
+        hwRemove(mem, bp);                                                                  // keeps hw_slot - see hwInsert
+    }
+    else {
+        remoteWrite(mem, bp->address, &bp->orig_byte, 1);
+    }
+    bp->inserted = false;
+}
+
+// Name: openDynsymIndex
+// Sets up index over .dynsym, with the .hash / .gnu.hash that point at it (sh_link) if there are any
+void openDynsymIndex(ElfImage* elf, SymIndex* index)
+{
+    int dynsym = elfSectionByType(elf, SHT_DYNSYM);
+    int sym_num;
+    Elf64_Sym* syms = elfSymbols(elf, dynsym, &sym_num);
+    unsigned long strs_size = 0;
+    char* strs = (dynsym != 0) ? elfSectionData(elf, elfSectionLink(elf, dynsym), &strs_size) : NULL;
+    if(syms == NULL || strs == NULL) {
+        symIndexInit(index, NULL, NULL, 0, 0, NULL, 0, NULL, 0);
+        return;
+    }
+
+    Elf64_Word* hash_tabs[2] = { NULL, NULL };                                              // [0] = .hash, [1] = .gnu.hash
+    unsigned long hash_sizes[2] = { 0, 0 };
+    Elf64_Word hash_types[2] = { SHT_HASH, SHT_GNU_HASH };
+    for(int t = 0; t < 2; t++) {
+        hash_tabs[t] = elfSectionData(elf, elfSectionLinkedTo(elf, hash_types[t], dynsym), &hash_sizes[t]);
+    }
+    symIndexInit(index, syms, strs, strs_size, sym_num, hash_tabs[0], hash_sizes[0], hash_tabs[1], hash_sizes[1]);
+}
+
+// ======================================================================================================================================
+// ----------------------------------------------------- Actual Functions ---------------------------------------------------------------
+// ======================================================================================================================================
+
+// Part 1
+// Name: checkExecutable
+// Recieves the open file (elfOpen already made sure it's a 64 bit ELF file)
+// Returns SUCCESS if the file is executable, ERROR otherwise.
+SearchStatus checkExecutable(ElfImage* elf)
+{
+    if(elf->header->e_type != ET_EXEC &&                                                    // check if file is an executable
+       !(elf->header->e_type == ET_DYN && options.attach_pid != 0)) {                       // (a running PIE is fine - we know where it is)
+        return ERROR;
+    }
+    return SUCCESS; 
+}
+
+// Part 2 + 3
+// Name: checkFunction
+// Recieves the open file and the funcs to look for.
+// Sets status (SUCCESS if func is global AND executable, other errorcode otherwise) and address of every func.
+// Returns ERROR if the file itself couldn't be read, SUCCESS otherwise.
+SearchStatus checkFunction(ElfImage* elf, TracedFunc* funcs, int func_num)
+{
+    SymIndex symtab_index, dynsym_index;
+    SymIndex* index = &symtab_index;                                                        // the one names are looked up in
+    openDynsymIndex(elf, &dynsym_index);
+    int symtab = elfSectionByType(elf, SHT_SYMTAB);
+    int strtab = (symtab != 0) ? elfSectionLink(elf, symtab) : 0;
+    if(symtab != 0 && strtab != 0)
+    {
+        Elf64_Shdr* symtab_header = &elf->sections[symtab];
+        Elf64_Shdr* strtab_header = &elf->sections[strtab];
+        SymCacheHeader cache_key;
+        char cache_path[PATH_MAX];
+        bool use_cache = options.cache_dir != NULL &&
+                         makeCacheKey(elf, symtab_header, strtab_header, &cache_key, cache_path, sizeof(cache_path));
+        if(!use_cache || !symCacheOpen(cache_path, &cache_key, &symtab_index))              // a hit means we never touch .symtab / .strtab
+        {
+            int sym_num;
+            Elf64_Sym* syms = elfSymbols(elf, symtab, &sym_num);
+            symIndexInit(&symtab_index, syms, elfSectionData(elf, strtab, NULL), strtab_header->sh_size, sym_num, NULL, 0, NULL, 0);
+            if(use_cache && symIndexBuild(&symtab_index)) {
+                symCacheStore(cache_path, &cache_key, &symtab_index, strtab_header->sh_size);
+            }
+        }
+    }
+    else {
+        index = &dynsym_index;                                                              // stripped - .dynsym (and its hash section) is all we have
+    }
+
+    for(int f = 0; f < func_num; f++)
+    {
+        findSymbol(index, &funcs[f]);
+        if (funcs[f].status == SUCCESS){
+            funcs[f].address = getFuncAddr(elf, &dynsym_index, &funcs[f]);                 // part 4
+        }
+    }
+
+    if(index == &symtab_index) {
+        symIndexFree(&symtab_index);
+    }
+    symIndexFree(&dynsym_index);
+    return SUCCESS;
+}
+
+// Part 4 + 5
+// findSymbol already got us the address of the first occurrence - unless it is UND, then it's the GOT slot from .rela.plt
+long getFuncAddr(ElfImage* elf, SymIndex* dynsym_index, TracedFunc* func)
+{
+    if(func->address != 0) {                                                                // the function is in the executable file
+        return (long)func->address;
+    }
+
+    // IF WE'RE HERE - SYMBOL IS UND (or an IFUNC of the executable - its IRELATIVE slot is its GOT slot)
+    int matches[MAX_SYM_MATCHES];
+    int match_num = symIndexLookup(dynsym_index, func->name, matches, MAX_SYM_MATCHES);    // r_info of a .rela.plt entry holds the index in .dynsym
+    int plt_rela = elfSectionByName(elf, ".rela.plt");
+    for(int i = elfSectionByType(elf, SHT_RELA); plt_rela == 0 && i != 0; i = elfNextOfType(elf, i))
+    {
+        if(elf->sections[i].sh_flags != SHF_ALLOC) {                                        // no names: the rela.plt and NOT rela.dyn
+            plt_rela = i;
+        }
+    }
+    int rel_entry_num = 0;
+    Elf64_Rela *reltab = elfRelocations(elf, plt_rela, &rel_entry_num);                     // get.rela.plt
+    for (int i = 0 ; i < rel_entry_num ; i++)
+    {   
+        if(func->ifunc_resolver != 0)
+        {
+            if(ELF64_R_TYPE(reltab[i].r_info) == R_X86_64_IRELATIVE && (unsigned long)reltab[i].r_addend == func->ifunc_resolver)
+            {
+                func->is_dyn = true;
+                func->got_offset = reltab[i].r_offset;
+                return reltab[i].r_offset;
+            }
+            continue;
+        }
+        for(int m = 0; m < match_num; m++)
+        {
+            if (ELF64_R_SYM(reltab[i].r_info) == (Elf64_Xword)matches[m])
+            {
+                func->is_dyn = true;
+                func->got_offset = reltab[i].r_offset;
+                return reltab[i].r_offset;
+            }
+        }
+    }
+
+    return (long)func->ifunc_resolver;                                                      // no slot to wait for - the resolver it is
+}
+
+// Part6
+pid_t runTarget(const char* name, char** argv)
+{
+    pid_t pid = fork();
+    if(pid < 0) {
+        //perror();
+        exit(1);
+    }
+
+    if(pid > 0) {
+        return pid;
+    }
+
+    if(ptrace(PTRACE_TRACEME, 0, NULL, NULL) < 0) {
+        // perror();
+        exit(1);
+    }
+    execv(name, argv);                                      // execv is better!
+    exit(1);
+}
+
+// Name: reportReturn
+// Every backend ends up here once per traced call that returned (rec->tid = the thread it returned on, 0 = unknown)
+void reportReturn(TracedFunc* funcs, int func_num, const PrfTraceRecord* rec)
+{
+    TracedFunc* func = &funcs[rec->func_id];
+    unsigned long counter = rec->call_index;
+    pid_t tid = rec->tid;
+    int res = rec->ret;
+    stats.traced_calls++;
+    if(options.latency) {                                                                   // what the stops around the call cost isn't the call's
+        unsigned long elapsed = rec->exit_ns - rec->entry_ns;
+        if(func->latency != NULL || (func->latency = calloc(1, sizeof(LatencyStats))) != NULL) {
+            latencyAdd(func->latency, elapsed > stats.stop_overhead ? elapsed - stats.stop_overhead : 0);
+        }
+    }
+    if(options.trace_path != NULL && !trace_failed)                                         // the trace instead of the lines
+    {
+        if(!prfTraceAppend(&trace, rec)) {
+            outputLine("PRF:: can't write the trace to %s! :(\n", options.trace_path);
+            trace_failed = true;
+        }
+        if(!options.summary) {
+            return;
+        }
+    }
+    if(options.summary)
+    {
+        if(func->ret_stats == NULL && (func->ret_stats = calloc(1, sizeof(ReturnStats))) == NULL) {
+            return;
+        }
+        summaryAdd(func->ret_stats, res);
+        if(options.summary_every > 0) {
+            summaryTick(funcs, func_num);
+        }
+        return;
+    }
+    char thread_tag[24] = "";
+    if(tid != 0 && stats.max_threads > 1) {                                                 // once the target has threads, say whose return it was
+        sprintf(thread_tag, "[tid %d] ", tid);
+    }
+    const char* run = (options.sample_period_ms > 0 || options.max_overhead > 0) ? "sample" : "run";    // calls while the entry is out aren't counted
+    if(func_num == 1) {
+        outputLine("PRF:: %s%s #%lu returned with %d\n", thread_tag, run, counter, res);
+    }
+    else {
+        outputLine("PRF:: %s%s %s #%lu returned with %d\n", thread_tag, func->name, run, counter, res);
+    }
+}
+
+// Name: armEntry
+// Points func's entry breakpoint at func->address and inserts it (not in the off part of a --sample-duty cycle, or
+// while --max-overhead has func out - samplerUpdate inserts it then)
+void armEntry(RemoteMem* mem, BreakpointTable* table, TracedFunc* funcs, int func_index)
+{
+    Breakpoint* bp = bpGetSlot(table, funcs[func_index].address);
+    if(bp == NULL) {
+        return;
+    }
+    bp->entry_func = func_index;
+    if(!sampler.paused && !funcs[func_index].gated) {
+        bpInsert(mem, bp);
+    }
+}
+
+// Name: stepOver
+// rip is at bp (int3 already undone in rip): take the int3 out, run the one instruction, put it back
+// Returns false if the child is gone. A signal that came in meanwhile is kept in pending_sig for the next resume.
+bool stepOver(RemoteMem* mem, Breakpoint* bp, int* wait_status, int* pending_sig)
+{
+    bpRemove(mem, bp);
+    do
+    {
+        remoteResume(mem);
+        tracePtrace(PTRACE_SINGLESTEP, mem->pid, NULL, NULL);
+        traceWait(mem->pid, wait_status);
+        if(WIFSTOPPED(*wait_status) && WSTOPSIG(*wait_status) != SIGTRAP) {
+            *pending_sig = WSTOPSIG(*wait_status);                                          // the instruction didn't run yet - step again
+        }
+    } while(WIFSTOPPED(*wait_status) && WSTOPSIG(*wait_status) != SIGTRAP);
+    if(!WIFSTOPPED(*wait_status)) {
+        return false;
+    }
+    bpInsert(mem, bp);
+    return true;
+}
+
+// Name: resolveDynFunc
+// After the first return of a dynamic func its GOT slot holds the real address - move the entry breakpoint there
+void resolveDynFunc(RemoteMem* mem, BreakpointTable* table, TracedFunc* funcs, int func_index)
+{
+    TracedFunc* func = &funcs[func_index];
+    unsigned long address;
+    if(!remoteReadWord(mem, func->got_offset, &address)) {                                 // try again after the next return
+        return;
+    }
+    Breakpoint* old_entry = bpLookup(table, func->address);
+    if(old_entry != NULL)
+    {
+        old_entry->entry_func = NO_FUNC;
+        if(old_entry->ret_refs == 0) {
+            bpRemove(mem, old_entry);
+        }
+    }
+    func->address = address;
+    func->resolved = true;
+    armEntry(mem, table, funcs, func_index);
+}
+
+// Name: threadFind / threadAdd / threadRemove
+// The threads of the target we know of. Few enough for a linear scan.
+TracedThread* threadFind(ThreadList* threads, pid_t tid)
+{
+    for(int i = 0; i < threads->num; i++)
+    {
+        if(threads->threads[i].tid == tid) {
+            return &threads->threads[i];
+        }
+    }
+    return NULL;
+}
+
+TracedThread* threadAdd(ThreadList* threads, pid_t tid, int func_num)
+{
+    if(threads->num == threads->capacity)
+    {
+        int capacity = threads->capacity ? threads->capacity * 2 : THREAD_LIST_INIT_SIZE;
+        TracedThread* bigger = realloc(threads->threads, capacity * sizeof(TracedThread));
+        if(bigger == NULL) {
+            return NULL;
+        }
+        threads->threads = bigger;
+        threads->capacity = capacity;
+    }
+    int* depth = calloc(func_num, sizeof(int));
+    if(depth == NULL) {
+        return NULL;
+    }
+    TracedThread* thread = &threads->threads[threads->num++];
+    memset(thread, 0, sizeof(TracedThread));
+    thread->tid = tid;
+    thread->depth = depth;
+    if(++stats.threads > stats.max_threads) {
+        stats.max_threads = stats.threads;
+    }
+    return thread;
+}
+
+void threadRemove(ThreadList* threads, TracedThread* thread)
+{
+    free(thread->shadow.frames);
+    free(thread->depth);
+    *thread = threads->threads[--threads->num];
+    stats.threads--;
+}
+
+// Name: callerCounts
+// A dynamic func's entry is in its library, so calls from the library itself (and other libraries) hit it too.
+// Until the executable's first call to it returns, only the executable's calls count - what the PLT stub
+// breakpoint used to see before the first call resolved it - and every call after that, unless --lib-calls.
+static inline bool callerCounts(RemoteMem* mem, TracedFunc* func, struct user_regs_struct* regs)
+{
+    if(func->caller_end == 0) {
+        return true;
+    }
+    unsigned long ret_address;
+    if(!remoteReadWord(mem, regs->rsp, &ret_address)) {                                    // (cached - the frame reads it again)
+        return true;
+    }
+    return ret_address >= func->caller_start && ret_address < func->caller_end;
+}
+
+// Name: countCall
+// At the entry of a call of func, depth = its calls in flight on this thread: counts an outermost call (any call
+// with --nested) into counter, 0 for one inside a call.
+// Returns false if --sample=N leaves this call out.
+static bool countCall(TracedFunc* func, int depth, unsigned long* counter)
+{
+    *counter = (options.nested || depth == 0) ? ++func->counter : 0;
+    return *counter == 0 || options.sample_every <= 1 || (*counter - 1) % options.sample_every == 0;   // run #1, #N+1, #2N+1..
+}
+
+// Name: shadowPush
+// A new frame on top of the thread's shadow stack, which grows as needed
+// Returns NULL if it couldn't grow
+ShadowFrame* shadowPush(ShadowStack* shadow)
+{
+    if(shadow->depth == shadow->capacity)
+    {
+        int capacity = shadow->capacity ? shadow->capacity * 2 : SHADOW_STACK_INIT_SIZE;
+        ShadowFrame* frames = realloc(shadow->frames, capacity * sizeof(ShadowFrame));
+        if(frames == NULL) {
+            return NULL;
+        }
+        shadow->frames = frames;
+        shadow->capacity = capacity;
+    }
+    return &shadow->frames[shadow->depth++];
+}
+
+// Name: handleHit
+// bp was hit by thread and rip already points back at it.
+// Every call gets a frame on the thread's shadow stack. A return pops every frame whose return address slot is
+// below rsp now: the one returning is reported, deeper ones were skipped by a longjmp / exception and just go.
+// A call inside a call of the same function on the same thread gets run # 0 (not reported) unless --nested.
+// --sample=N: a call that isn't sampled is only counted - no frame, no return breakpoint.
+// armed = entry breakpoints stay in while their function runs: the hit one is stepped over, out of line if it can
+// be (see Displaced Stepping). Otherwise an entry breakpoint is taken out at the entry and put back when the call
+// returns - cheaper than a single-step, but only correct with one thread.
+// An int3's rip (already moved back to bp->address) is written back here.
+// Returns false if the thread is gone.
+bool handleHit(RemoteMem* mem, BreakpointTable* table, TracedThread* thread, TracedFunc* funcs,
+               Breakpoint* bp, struct user_regs_struct* regs, bool armed, int* wait_status)
+{
+    ShadowStack* shadow = &thread->shadow;
+    bool int3 = bp->hw_slot < 0;
+    unsigned long address = bp->address;                                                    // bp moves when the table grows
+    int entered = -1;                                                                       // frame this hit pushed
+    unsigned long counter;
+    ShadowFrame* frame;
+    sampler.charge = bp->entry_func;                                                        // --max-overhead: whose stop this is
+    if(bp->ret_refs > 0)                                                                    // end of func
+    {
+        while(shadow->depth > 0 && shadow->frames[shadow->depth - 1].rsp < regs->rsp)
+        {
+            ShadowFrame* top = &shadow->frames[--shadow->depth];
+            TracedFunc* func = &funcs[top->func];
+            thread->depth[top->func]--;
+            Breakpoint* ret_bp = bpLookup(table, top->ret_address);
+            if(ret_bp != NULL && --ret_bp->ret_refs == 0 && ret_bp != bp && ret_bp->entry_func == NO_FUNC) {
+                bpRemove(mem, ret_bp);
+            }
+            bool returning = top->ret_address == address && top->rsp + 8 == regs->rsp;        // else abandoned
+            if(returning)
+            {
+                sampler.charge = top->func;
+                func->caller_end = 0;                                                       // see callerCounts
+            }
+            if(returning && func->is_dyn && !func->resolved)                               // first call went through the PLT stub - now the GOT knows
+            {
+                resolveDynFunc(mem, table, funcs, top->func);
+                bp = bpLookup(table, address);                                              // the table may have grown
+            }
+            else if(!armed)                                                                 // Set breakpoint at the beginnig of func
+            {
+                armEntry(mem, table, funcs, top->func);
+                bp = bpLookup(table, address);
+            }
+            if(returning && top->counter != 0)
+            {
+                PrfTraceRecord rec = { .func_id = top->func, .tid = thread->tid, .call_index = top->counter,
+                                       .entry_ns = top->start, .exit_ns = thread->stop_time, .ret = regs->rax,
+                                       .arg_num = options.trace_args };
+                memcpy(rec.args, top->args, sizeof(rec.args));
+                outputPush(&rec);                                                           // Print ret val (in RAX), --latency.. - on the output thread
+            }
+        }
+    }
+    else if(bp->entry_func != NO_FUNC && callerCounts(mem, &funcs[bp->entry_func], regs) &&
+            countCall(&funcs[bp->entry_func], thread->depth[bp->entry_func], &counter) &&
+            (frame = shadowPush(shadow)) != NULL)                                           // start of func (no room: untracked, but keep going)
+    {
+        TracedFunc* func = &funcs[bp->entry_func];
+        entered = shadow->depth - 1;
+        frame->rsp = regs->rsp;
+        remoteReadWord(mem, regs->rsp, &frame->ret_address);                               // Set breakpoint at the end of the func
+        frame->func = bp->entry_func;
+        frame->counter = counter;
+        if(options.trace_args > 0)
+        {
+            unsigned long args[PRF_TRACE_MAX_ARGS] = { regs->rdi, regs->rsi, regs->rdx, regs->rcx, regs->r8, regs->r9 };
+            memcpy(frame->args, args, sizeof(args));
+        }
+        if(++thread->depth[bp->entry_func] > func->max_depth) {
+            func->max_depth = thread->depth[bp->entry_func];
+        }
+        Breakpoint* ret_bp = frame->ret_address != 0 ? bpGetSlot(table, frame->ret_address) : NULL;   // 0: unreadable stack
+        bp = bpLookup(table, address);                                                      // the table may have grown
+        if(ret_bp != NULL)
+        {
+            ret_bp->ret_refs++;
+            bpInsert(mem, ret_bp);
+        }
+        if(!armed) {
+            bpRemove(mem, bp);
+        }
+    }
+
+    bool alive = true;
+    if(int3)                                                                                // the resume flag gets a debug register out of the way
+    {
+        bool keep = bp->inserted && (bp->entry_func != NO_FUNC || bp->ret_refs > 0);
+        if(bp->inserted && !keep) {
+            bpRemove(mem, bp);
+        }
+        unsigned long displaced = keep ? displacedCopy(mem, bp) : 0;
+        if(displaced != 0) {
+            regs->rip = displaced;                                                          // on from the copy, the int3 stays in
+        }
+        tracePtrace(PTRACE_SETREGS, thread->tid, 0, regs);
+        if(keep && displaced == 0) {
+            alive = stepOver(mem, bp, wait_status, &thread->pending_sig);
+        }
+    }
+    if(entered >= 0 && (options.latency || options.trace_path != NULL)) {                   // the clock starts after our own work at the entry
+        shadow->frames[entered].start = nowNs();
+    }
+    return alive;
+}
+
+// Name: hitStaleInt3
+// With threads, one can hit an int3 that another thread's event takes out before we get to the first one's stop.
+// Returns true if tid's SIGTRAP really came from an int3 (and not from a single-step / a debug register..).
+bool hitStaleInt3(pid_t tid)
+{
+    siginfo_t info;
+    return tracePtrace(PTRACE_GETSIGINFO, tid, 0, &info) == 0 && info.si_code == SI_KERNEL;
+}
+
+// Name: armAll
+// The target just got its second thread: from now on entry breakpoints stay in (see handleHit). Debug registers
+// aren't inherited by new threads, so the ones in use move to int3s.
+void armAll(RemoteMem* mem, BreakpointTable* table, TracedFunc* funcs, int func_num)
+{
+    if(mem->hw_slots > 0)
+    {
+        for(int i = 0; i < table->capacity; i++)
+        {
+            Breakpoint* bp = &table->slots[i];
+            if(bp->address != 0 && bp->inserted && bp->hw_slot >= 0)
+            {
+                bpRemove(mem, bp);
+                mem->hw_slots = 0;
+                bpInsert(mem, bp);
+                mem->hw_slots = HW_BP_SLOTS;
+            }
+        }
+        mem->hw_slots = 0;
+        mem->dr7 = 0;
+        tracePtrace(PTRACE_POKEUSER, mem->pid, (void*)(offsetof(struct user, u_debugreg) + 7 * sizeof(long)), 0);
+    }
+    for(int f = 0; f < func_num; f++)
+    {
+        if(funcs[f].status == SUCCESS) {
+            armEntry(mem, table, funcs, f);
+        }
+    }
+}
+
+void Debug(pid_t child_pid, TracedFunc* funcs, int func_num, unsigned long debug_slot)
+{
+    // Some vars
+    int wait_status;
+    struct user_regs_struct regs;
+    BreakpointTable table;
+    RemoteMem mem;
+    ThreadList threads = { NULL, 0, 0 };
+
+    if(!bpTableInit(&table, BP_TABLE_INIT_SIZE)) {
+        return;
+    }
+
+    if(options.attach_pid == 0)
+    {
+        traceWait(child_pid, &wait_status);                                                 // wait for child to start running
+        tracePtrace(PTRACE_SETOPTIONS, child_pid, 0, (void*)PTRACE_O_TRACECLONE);           // new threads are traced too (and stop first)
+        if(threadAdd(&threads, child_pid, func_num) == NULL) {
+            return;
+        }
+    }
+    else if(!attachThreads(child_pid, &threads, func_num))
+    {
+        printf("PRF:: can't attach to %d! :(\n", child_pid);
+        free(table.slots);
+        return;
+    }
+    remoteInit(&mem, child_pid);
+    bool any_dyn = false;
+    for(int f = 0; f < func_num; f++) {
+        any_dyn = any_dyn || (funcs[f].status == SUCCESS && funcs[f].is_dyn);
+    }
+    bool libs_loaded = any_dyn && debug_slot != 0 && (options.attach_pid != 0 || runToEntry(&mem, &threads, func_num));
+    if(libs_loaded) {                                                                       // the loader is done - the libraries are all there
+        resolveLibFuncs(&mem, funcs, func_num, debug_slot);
+    }
+    bool sampling = options.sample_period_ms > 0 || options.max_overhead > 0;
+    if(options.backend == BACKEND_HWBP && threads.num == 1 && !sampling) {                  // per thread - see armAll, Sampling
+        mem.hw_slots = HW_BP_SLOTS;
+    }
+    unsigned long near = 0;
+    for(int f = 0; f < func_num; f++)
+    {
+        if(funcs[f].status == SUCCESS && (near == 0 || funcs[f].address < near)) {
+            near = funcs[f].address;
+        }
+    }
+    displacedInit(&mem, near);
+    bool armed = options.nested || threads.num > 1 || mem.displaced_area != 0;             // entries can stay in for free
+    if(options.latency || options.max_overhead > 0 || options.trace_path != NULL) {
+        stats.stop_overhead = calibrateStops();
+    }
+    if(!outputStart(funcs, func_num)) {
+        printf("PRF:: no output thread - returns are printed as they come\n");
+    }
+    if(sampling) {
+        samplerStart(funcs, func_num);
+    }
+    
+    // Create breakpoints at the beginning of our functions
+    for(int f = 0; f < func_num; f++)
+    {
+        if(funcs[f].status != SUCCESS) {
+            continue;
+        }
+        if(funcs[f].is_dyn && !funcs[f].resolved &&                                         // not in a library we know: the GOT (PLT stub before the first call)
+           !remoteReadWord(&mem, funcs[f].got_offset, &funcs[f].address))
+        {
+            printf("PRF:: can't read the GOT slot of %s! :(\n", funcs[f].name);
+            continue;
+        }
+        armEntry(&mem, &table, funcs, f);
+    }
+
+    // Wait for a thread to get to Breakpoint - whichever thread stops next
+    for(int i = 0; i < threads.num; i++)
+    {
+        mem.pid = threads.threads[i].tid;
+        resumeChild(&mem, threads.threads[i].pending_sig);
+        threads.threads[i].pending_sig = 0;
+    }
+    pid_t tid;
+    while((tid = loopWait(&wait_status)) > 0 || (tid == -1 && errno == EINTR))
+    {
+        unsigned long stop_time = (options.latency || options.max_overhead > 0 || options.trace_path != NULL) ? nowNs() : 0;
+        if(tid > 0 && options.max_overhead > 0) {
+            governorCharge(&mem, &table, funcs, stop_time);
+        }
+        if(detach_requested)
+        {
+            if(tid > 0) {                                                                   // this stop is handled after the detach..
+                tracePtrace(PTRACE_CONT, tid, 0, 0);                                        // ..by letting the thread go on to its interrupt
+            }
+            detachAll(&mem, &table, &threads);
+            break;
+        }
+        if(sample_tick)
+        {
+            sample_tick = 0;
+            samplerUpdate(&mem, &table, funcs, func_num);
+        }
+        if(tid == -1) {
+            continue;
+        }
+        TracedThread* thread = threadFind(&threads, tid);
+        if(!WIFSTOPPED(wait_status))                                                        // a thread (or the whole target) is gone
+        {
+            if(thread != NULL) {
+                threadRemove(&threads, thread);
+            }
+            continue;
+        }
+        if(thread == NULL)                                                                  // a new thread can stop before its parent's clone event
+        {
+            thread = threadAdd(&threads, tid, func_num);
+            if(thread == NULL) {
+                break;
+            }
+            thread->fresh = true;
+        }
+        mem.pid = tid;                                                                      // ptrace requests go to the stopped thread
+
+        if(wait_status >> 16 == PTRACE_EVENT_CLONE)
+        {
+            unsigned long new_tid;
+            tracePtrace(PTRACE_GETEVENTMSG, tid, 0, &new_tid);
+            if(threadFind(&threads, new_tid) == NULL && (thread = threadAdd(&threads, new_tid, func_num)) != NULL) {
+                thread->fresh = true;
+            }
+            if(!armed || mem.hw_slots > 0)
+            {
+                armAll(&mem, &table, funcs, func_num);
+                armed = true;
+            }
+            resumeChild(&mem, 0);
+            continue;
+        }
+        if(wait_status >> 16 == PTRACE_EVENT_STOP ||                                        // a seized thread's stops (new thread, group-stop)
+           (WSTOPSIG(wait_status) == SIGSTOP && thread->fresh))                             // the stop every new traced thread starts with
+        {
+            thread->fresh = false;
+            resumeChild(&mem, 0);
+            continue;
+        }
+        thread->fresh = false;
+        if(WSTOPSIG(wait_status) != SIGTRAP) {                                              // not ours - hand the signal back to the child
+            resumeChild(&mem, WSTOPSIG(wait_status));
+            continue;
+        }
+
+        tracePtrace(PTRACE_GETREGS, tid, 0, &regs);                                         // Get registers of child
+        Breakpoint* bp = bpLookup(&table, regs.rip);                                        // a debug register traps before the instruction..
+        if(bp == NULL || !bp->inserted || bp->hw_slot < 0) {
+            bp = bpLookup(&table, regs.rip - 0x1);                                          // ..an int3 after itself. Check location of breakpoint (start of func or end of func)
+        }
+        if(bp != NULL && !bp->inserted && bp->hw_slot < 0 && hitStaleInt3(tid))                // taken out after this thread hit it
+        {
+            regs.rip--;                                                                     // run the real instruction after all
+            tracePtrace(PTRACE_SETREGS, tid, 0, &regs);
+            resumeChild(&mem, 0);
+            continue;
+        }
+        if(bp == NULL || !bp->inserted)
+        {
+            resumeChild(&mem, 0);
+            continue;
+        }
+
+        thread->stop_time = stop_time;
+
+        // Fix RIP (handleHit writes it back)
+        if(bp->hw_slot < 0) {
+            regs.rip--;
+        }
+        if(!handleHit(&mem, &table, thread, funcs, bp, &regs, armed, &wait_status))
+        {
+            threadRemove(&threads, thread);
+            continue;
+        }
+
+        // Continue until next breakpoint
+        resumeChild(&mem, thread->pending_sig);
+        thread->pending_sig = 0;
+    }
+    
+    if(sampling) {
+        samplerStop();
+    }
+    outputStop();
+    while(threads.num > 0) {
+        threadRemove(&threads, &threads.threads[0]);
+    }
+    free(threads.threads);
+    remoteClose(&mem);
+    free(table.slots);
+
+    if(options.max_overhead > 0)
+    {
+        unsigned long elapsed = nowNs() - sampler.start;
+        fprintf(stderr, "PRF:: the target spent %.1f%% of its run time stopped (budget %.1f%%)\n",
+                elapsed > sampler.stopped ? 100.0 * sampler.stopped / (elapsed - sampler.stopped) : 100.0, 100 * options.max_overhead);
+    }
+    if(options.syscall_stats)
+    {
+        fprintf(stderr, "PRF:: %lu tracer syscalls, %lu traced calls (%.2f per call)\n", stats.syscalls, stats.traced_calls,
+                stats.traced_calls ? (double)stats.syscalls / stats.traced_calls : 0.0);
+    }
+}
+
+// ======================================================================================================================================
+// -------------------------------------------------------- Attach ----------------------------------------------------------------------
+// ======================================================================================================================================
+//
+// --pid=PID: trace a process that is already running. Every thread is PTRACE_SEIZE'd (no SIGSTOP sent, the target
+// doesn't see it) and stopped with PTRACE_INTERRUPT only while the breakpoints go in. On SIGINT / SIGTERM, or
+// when the target exits, every thread is stopped again, every breakpoint taken out and the threads let go.
+
+// Name: loadBias
+// Where the executable of pid is mapped relative to its link time addresses: 0 for ET_EXEC, for a PIE the start of
+// its first mapping (found by inode in /proc/<pid>/maps) minus the first PT_LOAD's page.
+// Returns false if the mapping isn't there.
+bool loadBias(pid_t pid, ElfImage* elf, unsigned long* bias)
+{
+    *bias = 0;
+    struct stat exe_stat;
+    if(fstat(elf->fd, &exe_stat) != 0) {
+        return false;
+    }
+    unsigned long first_vaddr = ULONG_MAX;
+    for(int i = 0; i < elf->segment_num; i++)
+    {
+        if(elf->segments[i].p_type == PT_LOAD && elf->segments[i].p_vaddr < first_vaddr) {
+            first_vaddr = elf->segments[i].p_vaddr & ~(REMOTE_PAGE_SIZE - 1);
+        }
+    }
+    if(elf->header->e_type == ET_EXEC) {
+        return true;
+    }
+
+    char path[32], line[PATH_MAX + 128];
+    sprintf(path, "/proc/%d/maps", pid);
+    FILE* maps = fopen(path, "r");
+    if(maps == NULL) {
+        return false;
+    }
+    bool found = false;
+    while(!found && fgets(line, sizeof(line), maps) != NULL)
+    {
+        unsigned long start, end, offset, inode;
+        unsigned int dev_major, dev_minor;
+        if(sscanf(line, "%lx-%lx %*s %lx %x:%x %lu", &start, &end, &offset, &dev_major, &dev_minor, &inode) == 6 &&
+           inode == exe_stat.st_ino && offset == 0)
+        {
+            *bias = start - first_vaddr;
+            found = true;
+        }
+    }
+    fclose(maps);
+    return found;
+}
+
+// Name: attachThreads
+// Seizes every thread of pid (/proc/<pid>/task - again until no new one shows up, threads can be made meanwhile)
+// and waits until they are all stopped
+// Returns false if pid can't be traced.
+bool attachThreads(pid_t pid, ThreadList* threads, int func_num)
+{
+    char path[32];
+    sprintf(path, "/proc/%d/task", pid);
+    bool added = true;
+    while(added)
+    {
+        added = false;
+        DIR* tasks = opendir(path);
+        if(tasks == NULL) {
+            return false;
+        }
+        struct dirent* task;
+        while((task = readdir(tasks)) != NULL)
+        {
+            pid_t tid = atoi(task->d_name);
+            if(tid <= 0 || threadFind(threads, tid) != NULL) {
+                continue;
+            }
+            if(tracePtrace(PTRACE_SEIZE, tid, 0, (void*)PTRACE_O_TRACECLONE) != 0) {
+                continue;                                                                   // gone already
+            }
+            tracePtrace(PTRACE_INTERRUPT, tid, 0, 0);
+            if(threadAdd(threads, tid, func_num) == NULL) {
+                closedir(tasks);
+                return false;
+            }
+            added = true;
+        }
+        closedir(tasks);
+    }
+    for(int i = 0; i < threads->num; i++)
+    {
+        int wait_status;
+        if(!waitStopped(&threads->threads[i], &wait_status)) {
+            threadRemove(threads, &threads->threads[i--]);
+        }
+    }
+    return threads->num > 0;
+}
+
+// Name: waitStopped
+// After a PTRACE_INTERRUPT: waits for thread's interrupt stop. A signal that comes first is kept for later, an int3
+// it hit before it got the interrupt is undone (rip back on the instruction - the breakpoint may be gone by the
+// time it runs again).
+// Returns false if the thread exited.
+bool waitStopped(TracedThread* thread, int* wait_status)
+{
+    while(traceWait(thread->tid, wait_status) == thread->tid && WIFSTOPPED(*wait_status))
+    {
+        if(*wait_status >> 16 == PTRACE_EVENT_STOP) {
+            return true;
+        }
+        int sig = WSTOPSIG(*wait_status);
+        if(sig == SIGTRAP && hitStaleInt3(thread->tid))
+        {
+            struct user_regs_struct regs;
+            tracePtrace(PTRACE_GETREGS, thread->tid, 0, &regs);
+            regs.rip--;
+            tracePtrace(PTRACE_SETREGS, thread->tid, 0, &regs);
+        }
+        else if(sig != SIGTRAP) {
+            thread->pending_sig = sig;
+        }
+        tracePtrace(PTRACE_CONT, thread->tid, 0, 0);                                        // the interrupt is still pending
+    }
+    return false;
+}
+
+// Name: detachAll
+// Stops every thread, takes every breakpoint out (calls in flight just return) and lets the target go
+void detachAll(RemoteMem* mem, BreakpointTable* table, ThreadList* threads)
+{
+    for(int i = 0; i < threads->num; i++) {
+        tracePtrace(PTRACE_INTERRUPT, threads->threads[i].tid, 0, 0);
+    }
+    for(int i = 0; i < threads->num; i++)
+    {
+        int wait_status;
+        if(!waitStopped(&threads->threads[i], &wait_status)) {
+            threadRemove(threads, &threads->threads[i--]);
+        }
+    }
+    if(threads->num == 0) {
+        return;
+    }
+
+    mem->pid = threads->threads[0].tid;
+    for(int i = 0; i < table->capacity; i++)
+    {
+        if(table->slots[i].address != 0) {
+            bpRemove(mem, &table->slots[i]);
+        }
+    }
+    for(int i = 0; i < threads->num; i++)
+    {
+        if(mem->dr7 != 0) {                                                                 // parked ones too
+            tracePtrace(PTRACE_POKEUSER, threads->threads[i].tid, (void*)(offsetof(struct user, u_debugreg) + 7 * sizeof(long)), 0);
+        }
+        tracePtrace(PTRACE_DETACH, threads->threads[i].tid, 0, (void*)(long)threads->threads[i].pending_sig);
+    }
+}
+
+// ======================================================================================================================================
+// ---------------------------------------------------- Shared Libraries ----------------------------------------------------------------
+// ======================================================================================================================================
+//
+// A dynamic func (UND in the executable) used to be found through its GOT slot only: the entry breakpoint went on the
+// PLT stub and moved to the real address after the first return. That sees only the calls that go through the
+// executable's PLT, and under BIND_NOW the GOT read at the exec stop is never what gets called. Now we let a new
+// child run to AT_ENTRY (the loader has mapped and relocated everything by then - an attached process is long
+// past it), walk the loader's list of objects (_r_debug.r_map, its address is in the DT_DEBUG entry of the
+// executable's _DYNAMIC) and look the func up in every library's .dynsym / .gnu.hash, in load order - the first
+// definition is the one the loader binds to. The list is a few small structs the loader malloc'd, so all of it
+// comes in through a handful of remote memory page fetches.
+// What isn't found (IFUNCs - the symbol is the resolver, not the function - or dlopen'd later) goes the GOT way.
+// Either way the entry is in the library from the start, where the library's own calls hit it too: callerCounts
+// keeps what's reported the same as with the PLT stub, --lib-calls reports them all.
+
+// Name: loadRange
+// Where the executable's PT_LOAD segments are (link time): [start, end)
+void loadRange(ElfImage* elf, unsigned long* start, unsigned long* end)
+{
+    *start = ULONG_MAX;
+    *end = 0;
+    for(int i = 0; i < elf->segment_num; i++)
+    {
+        Elf64_Phdr* segment = &elf->segments[i];
+        if(segment->p_type == PT_LOAD && segment->p_vaddr < *start) {
+            *start = segment->p_vaddr;
+        }
+        if(segment->p_type == PT_LOAD && segment->p_vaddr + segment->p_memsz > *end) {
+            *end = segment->p_vaddr + segment->p_memsz;
+        }
+    }
+    *start = (*end != 0) ? *start : 0;
+}
+
+// Name: debugSlot
+// Returns the (link time) address of the d_ptr of the executable's DT_DEBUG entry, 0 if it has none (static)
+unsigned long debugSlot(ElfImage* elf)
+{
+    int dynamic = elfSectionByType(elf, SHT_DYNAMIC);
+    int dyn_num;
+    Elf64_Dyn* dyn = elfDynamic(elf, &dyn_num);
+    for(int i = 0; dyn != NULL && i < dyn_num && dyn[i].d_tag != DT_NULL; i++)
+    {
+        if(dyn[i].d_tag == DT_DEBUG) {
+            return elf->sections[dynamic].sh_addr + i * sizeof(Elf64_Dyn) + offsetof(Elf64_Dyn, d_un);
+        }
+    }
+    return 0;
+}
+
+// Name: runToEntry
+// Recieves a child at its exec stop. Lets it run through the dynamic loader up to AT_ENTRY (an int3 there for
+// the moment) and leaves it stopped there, as if it was the exec stop. Signals on the way are passed on.
+// Threads a constructor starts go in threads (so the breakpoints are set up for more than one) and run on meanwhile.
+// Returns false if it didn't get there.
+bool runToEntry(RemoteMem* mem, ThreadList* threads, int func_num)
+{
+    char path[32];
+    unsigned long auxv[2], entry = 0;
+    sprintf(path, "/proc/%d/auxv", mem->pid);
+    int fd = open(path, O_RDONLY);
+    while(fd != -1 && entry == 0 && read(fd, auxv, sizeof(auxv)) == sizeof(auxv) && auxv[0] != 0) {
+        entry = (auxv[0] == AT_ENTRY) ? auxv[1] : 0;
+    }
+    if(fd != -1) {
+        close(fd);
+    }
+    unsigned char orig, trap = 0xCC;
+    RemoteIov read = { entry, &orig, 1 };
+    if(entry == 0 || !remoteRead(mem, &read, 1, false) || !remoteWrite(mem, entry, &trap, 1)) {
+        return false;
+    }
+
+    int wait_status;
+    struct user_regs_struct regs;
+    bool at_entry = false;
+    pid_t pid = mem->pid, tid;
+    resumeChild(mem, 0);
+    while(!at_entry && (tid = traceWait(-1, &wait_status)) > 0)
+    {
+        TracedThread* thread = threadFind(threads, tid);
+        if(!WIFSTOPPED(wait_status))
+        {
+            if(tid == pid) {
+                break;
+            }
+            if(thread != NULL) {
+                threadRemove(threads, thread);
+            }
+            continue;
+        }
+        if(thread == NULL && (thread = threadAdd(threads, tid, func_num)) != NULL) {        // a new thread can stop before its parent's clone event
+            thread->fresh = true;
+        }
+        bool event = (wait_status >> 16) != 0;
+        if(wait_status >> 16 == PTRACE_EVENT_CLONE)                                         // a constructor's thread
+        {
+            unsigned long new_tid;
+            tracePtrace(PTRACE_GETEVENTMSG, tid, 0, &new_tid);
+            if(threadFind(threads, new_tid) == NULL && (thread = threadAdd(threads, new_tid, func_num)) != NULL) {
+                thread->fresh = true;
+            }
+            thread = NULL;
+        }
+        at_entry = tid == pid && WSTOPSIG(wait_status) == SIGTRAP && !event &&
+                   tracePtrace(PTRACE_GETREGS, pid, 0, &regs) == 0 && regs.rip == entry + 1;
+        if(!at_entry)                                                                       // not our int3 - the target's own SIGTRAP is passed on too
+        {
+            bool first = thread != NULL && thread->fresh && WSTOPSIG(wait_status) == SIGSTOP;
+            if(first) {                                                                     // the stop every new traced thread starts with
+                thread->fresh = false;
+            }
+            mem->pid = tid;
+            resumeChild(mem, (event || first) ? 0 : WSTOPSIG(wait_status));
+            mem->pid = pid;
+        }
+    }
+    if(!at_entry) {                                                                         // the loader gave up (a library is missing..)
+        return false;
+    }
+    remoteWrite(mem, entry, &orig, 1);
+    regs.rip = entry;                                                                       // back over the int3
+    tracePtrace(PTRACE_SETREGS, mem->pid, 0, &regs);
+    return true;
+}
+
+// Name: remoteReadString
+// A '\0' terminated string of the child, a page at a time (never reads past a page it doesn't need)
+// Returns false if it can't be read (or doesn't fit in size)
+bool remoteReadString(RemoteMem* mem, unsigned long address, char* buf, int size)
+{
+    for(int done = 0; done < size; )
+    {
+        int n = REMOTE_PAGE_SIZE - ((address + done) & (REMOTE_PAGE_SIZE - 1));
+        n = n < size - done ? n : size - done;
+        RemoteIov read = { address + done, buf + done, n };
+        if(!remoteRead(mem, &read, 1, false)) {
+            return false;
+        }
+        if(memchr(buf + done, '\0', n) != NULL) {
+            return true;
+        }
+        done += n;
+    }
+    return false;
+}
+
+// Name: libFuncAddr
+// Returns the (link time) address of the function name defines in lib, 0 if it doesn't (or it's an IFUNC)
+unsigned long libFuncAddr(ElfImage* lib, const char* name)
+{
+    SymIndex index;
+    openDynsymIndex(lib, &index);
+    unsigned long versym_size = 0;
+    Elf64_Half* versym = elfSectionData(lib, elfSectionByType(lib, SHT_GNU_VERSYM), &versym_size);
+    int matches[MAX_SYM_MATCHES];
+    int match_num = symIndexLookup(&index, name, matches, MAX_SYM_MATCHES);
+    unsigned long address = 0;
+    for(int m = 0; m < match_num && address == 0; m++)
+    {
+        Elf64_Sym* sym = &index.syms[matches[m]];
+        int bind = ELF64_ST_BIND(sym->st_info);
+        bool hidden = versym != NULL && (unsigned long)matches[m] < versym_size / sizeof(Elf64_Half) &&
+                      (versym[matches[m]] & VERSYM_HIDDEN);
+        if(sym->st_shndx != SHN_UNDEF && ELF64_ST_TYPE(sym->st_info) == STT_FUNC && (bind == GLOBAL || bind == WEAK) && !hidden) {
+            address = sym->st_value;
+        }
+    }
+    symIndexFree(&index);
+    return address;
+}
+
+// Name: resolveLibFuncs
+// Recieves the stopped child (after the loader) and the remote address of its DT_DEBUG d_ptr
+// Sets address (+ resolved) of every dynamic func some loaded library defines.
+// Returns how many it resolved.
+int resolveLibFuncs(RemoteMem* mem, TracedFunc* funcs, int func_num, unsigned long debug_slot)
+{
+    unsigned long syscalls = stats.syscalls;
+    int left = 0, resolved = 0, lib_num = 0;
+    for(int f = 0; f < func_num; f++) {
+        left += (funcs[f].status == SUCCESS && funcs[f].is_dyn && funcs[f].ifunc_resolver == 0);
+    }
+    unsigned long r_debug, map = 0;
+    if(remoteReadWord(mem, debug_slot, &r_debug) && r_debug != 0) {
+        remoteReadWord(mem, r_debug + R_DEBUG_MAP_OFFSET, &map);
+    }
+    for(int hops = 0; map != 0 && left > 0 && hops < 4096; hops++)                          // (a bad list mustn't loop forever)
+    {
+        unsigned long link[5];                                                              // l_addr, l_name, l_ld, l_next, l_prev
+        char name[PATH_MAX];
+        RemoteIov read = { map, link, sizeof(link) };
+        if(!remoteRead(mem, &read, 1, false)) {
+            break;
+        }
+        map = link[3];
+        ElfImage lib;
+        if(link[1] == 0 || !remoteReadString(mem, link[1], name, sizeof(name)) || name[0] == '\0' ||   // "" = the executable
+           !elfOpen(&lib, name)) {                                                          // no file: the vdso
+            continue;
+        }
+        lib_num++;
+        for(int f = 0; f < func_num; f++)
+        {
+            if(funcs[f].status != SUCCESS || !funcs[f].is_dyn || funcs[f].resolved ||
+               funcs[f].ifunc_resolver != 0)                                                // the executable's own IFUNC beats a library's
+            {
+                continue;
+            }
+            unsigned long address = libFuncAddr(&lib, funcs[f].name);
+            if(address != 0)
+            {
+                funcs[f].address = link[0] + address;                                       // l_addr: where the library is loaded
+                funcs[f].resolved = true;
+                resolved++;
+                left--;
+            }
+        }
+        elfClose(&lib);
+    }
+    if(options.syscall_stats) {
+        fprintf(stderr, "PRF:: link_map: %d dynamic funcs resolved in %d libraries, %lu tracer syscalls\n",
+                resolved, lib_num, stats.syscalls - syscalls);
+    }
+    return resolved;
+}
+
+// ======================================================================================================================================
+// ------------------------------------------------------- Output Thread ----------------------------------------------------------------
+// ======================================================================================================================================
+//
+// Debug's event loop doesn't print: a return goes into an SPSC ring as a PrfTraceRecord and the thread is let go
+// right away. The output thread pops the records and does everything reportReturn does (--summary, --latency, --trace,
+// the lines), the lines into a batch that goes out in one writev. So a slow stdout (a pipe nobody reads, a terminal)
+// slows the output down, not the target.
+// When stdout is a terminal the batch is written whenever the queue runs dry, else only when it's full and at the
+// end - like stdio would, so the target's own output and ours come out in the same order as with printf.
+// If the ring is full the return is dropped (counted, and said at the end) - the target is never held up for it.
+
+// Name: outputStart
+// Starts the thread (Debug's loop is the producer from now on)
+// Returns false if it couldn't - outputPush reports right away then.
+bool outputStart(TracedFunc* funcs, int func_num)
+{
+    memset(&output, 0, sizeof(output));
+    output.funcs = funcs;
+    output.func_num = func_num;
+    output.eager = isatty(STDOUT_FILENO);
+    output.queue.slots = malloc(OUTPUT_QUEUE_CAPACITY * sizeof(PrfTraceRecord));
+    output.batch = malloc(OUTPUT_BATCH_SIZE);
+    if(output.queue.slots == NULL || output.batch == NULL)
+    {
+        free(output.queue.slots);
+        free(output.batch);
+        return false;
+    }
+    fflush(stdout);                                                                         // what's in stdio goes before our batches
+
+    sigset_t all, old;                                                                      // signals are Debug's business (SIGALRM, SIGINT..)
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    output.running = pthread_create(&output.thread, NULL, outputRun, NULL) == 0;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if(!output.running)
+    {
+        free(output.queue.slots);
+        free(output.batch);
+    }
+    return output.running;
+}
+
+// Name: outputPush
+// Producer side (Debug's event loop): hands one return to the output thread
+void outputPush(const PrfTraceRecord* rec)
+{
+    OutputQueue* queue = &output.queue;
+    if(!output.running) {
+        reportReturn(output.funcs, output.func_num, rec);
+        return;
+    }
+    if(queue->head - queue->tail_seen == OUTPUT_QUEUE_CAPACITY)
+    {
+        queue->tail_seen = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+        if(queue->head - queue->tail_seen == OUTPUT_QUEUE_CAPACITY) {
+            queue->dropped++;
+            return;
+        }
+    }
+    queue->slots[queue->head & (OUTPUT_QUEUE_CAPACITY - 1)] = *rec;
+    __atomic_store_n(&queue->head, queue->head + 1, __ATOMIC_RELEASE);
+}
+
+// Name: outputLine
+// printf for reportReturn and the reports it prints: into the batch while the output thread runs
+void outputLine(const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    if(!output.running)
+    {
+        vprintf(format, args);
+        va_end(args);
+        return;
+    }
+    char line[256];
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if(len >= (int)sizeof(line)) {
+        len = sizeof(line) - 1;
+    }
+    if(output.batch_len + len > OUTPUT_BATCH_SIZE) {
+        outputFlush();
+    }
+    memcpy(output.batch + output.batch_len, line, len);
+    output.batch_len += len;
+}
+
+// Name: outputFlush
+// Writes the batch out (output thread)
+void outputFlush(void)
+{
+    struct iovec iov = { output.batch, output.batch_len };
+    while(iov.iov_len > 0)
+    {
+        ssize_t written = writev(STDOUT_FILENO, &iov, 1);
+        if(written < 0 && errno == EINTR) {
+            continue;
+        }
+        if(written <= 0) {                                                                  // stdout is gone - nothing to do about it
+            break;
+        }
+        iov.iov_base = (char*)iov.iov_base + written;
+        iov.iov_len -= written;
+    }
+    output.batch_len = 0;
+}
+
+// Name: outputRun
+// The output thread: pops returns until Debug says it's done and the queue is empty
+void* outputRun(void* arg)
+{
+    (void)arg;
+    OutputQueue* queue = &output.queue;
+    struct timespec nap = { 0, OUTPUT_POLL_NS };
+    for(;;)
+    {
+        unsigned long head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+        if(queue->tail == head)
+        {
+            if(__atomic_load_n(&output.done, __ATOMIC_ACQUIRE))
+            {
+                if(__atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) == queue->tail) {  // no push after the last look
+                    break;
+                }
+                continue;
+            }
+            if(output.eager && output.batch_len > 0) {
+                outputFlush();
+            }
+            nanosleep(&nap, NULL);
+            continue;
+        }
+        for(; queue->tail != head; )
+        {
+            reportReturn(output.funcs, output.func_num, &queue->slots[queue->tail & (OUTPUT_QUEUE_CAPACITY - 1)]);
+            __atomic_store_n(&queue->tail, queue->tail + 1, __ATOMIC_RELEASE);
+        }
+    }
+    outputFlush();
+    return NULL;
+}
+
+// Name: outputStop
+// Debug is done: lets the thread write what's left and waits for it
+void outputStop(void)
+{
+    if(!output.running) {
+        return;
+    }
+    __atomic_store_n(&output.done, true, __ATOMIC_RELEASE);
+    pthread_join(output.thread, NULL);
+    output.running = false;
+    if(output.queue.dropped > 0) {
+        fprintf(stderr, "PRF:: %lu returns dropped - the output queue was full\n", output.queue.dropped);
+    }
+    free(output.queue.slots);
+    free(output.batch);
+}
+
+// ======================================================================================================================================
+// ---------------------------------------------------- Return Value Summary ------------------------------------------------------------
+// ======================================================================================================================================
+//
+// --summary: instead of a line per return keep a ReturnStats per function (prf_stats.h - fixed memory, the same
+// numbers prf-report prints from a trace)
+
+// Name: printSummary
+// The report of every traced function that returned at least once
+void printSummary(TracedFunc* funcs, int func_num)
+{
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    for(int f = 0; f < func_num; f++)
+    {
+        ReturnStats* ret_stats = funcs[f].ret_stats;
+        if(ret_stats == NULL || ret_stats->count == 0) {
+            continue;
+        }
+        outputLine("PRF:: %s: %lu runs, min %d, max %d, mean %.2f", funcs[f].name, ret_stats->count,
+               ret_stats->min, ret_stats->max, (double)ret_stats->sum / ret_stats->count);
+        if(options.nested) {
+            outputLine(", max depth %d", funcs[f].max_depth);
+        }
+        outputLine("\n");
+        outputLine("PRF:: %s: p50 %ld, p90 %ld, p99 %ld, p99.9 %ld\n", funcs[f].name,
+               summaryQuantile(ret_stats, quantiles[0]), summaryQuantile(ret_stats, quantiles[1]),
+               summaryQuantile(ret_stats, quantiles[2]), summaryQuantile(ret_stats, quantiles[3]));
+
+        TopKCounter top[SUMMARY_TOPK_SLOTS];
+        memcpy(top, ret_stats->top, ret_stats->top_num * sizeof(TopKCounter));
+        qsort(top, ret_stats->top_num, sizeof(TopKCounter), topKCompare);
+        outputLine("PRF:: %s: most returned:", funcs[f].name);
+        for(int i = 0; i < ret_stats->top_num && i < SUMMARY_TOPK_PRINT; i++)
+        {
+            if(top[i].error == 0) {
+                outputLine(" %d x%lu", top[i].value, top[i].count);
+            }
+            else {
+                outputLine(" %d x%lu..%lu", top[i].value, top[i].count - top[i].error, top[i].count);
+            }
+        }
+        outputLine("\n");
+    }
+    fflush(stdout);
+}
+
+// Name: summaryTick
+// --summary-every: prints the report when the period is up (checked on returns, so a quiet target prints nothing)
+void summaryTick(TracedFunc* funcs, int func_num)
+{
+    static struct timespec last;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    if(last.tv_sec == 0) {
+        last = now;
+    }
+    if(now.tv_sec - last.tv_sec >= options.summary_every)
+    {
+        printSummary(funcs, func_num);
+        if(options.latency) {
+            printLatency(funcs, func_num);
+        }
+        outputFlush();                                                                      // a periodic report doesn't wait for a full batch
+        last = now;
+    }
+}
+
+// ======================================================================================================================================
+// ------------------------------------------------------- Call Latency -----------------------------------------------------------------
+// ======================================================================================================================================
+//
+// --latency (ptrace / hwbp backends): a call's time is from the moment we let the thread go at its entry stop to the
+// moment we see its return stop. That includes one resume -> trap -> wakeup round trip of our own, which
+// calibrateStops measures once at startup and every call gets it taken off. Calls of traced functions inside the
+// call (and their stops) are still part of it. Times go into a LogHistogram per function, so quantiles are within
+// 1/HIST_SUB_BUCKETS too.
+
+// Name: nowNs
+// CLOCK_MONOTONIC goes through the vDSO - no syscall
+unsigned long nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// Name: calibrateStops
+// Times LATENCY_CALIBRATE_ROUNDS PTRACE_CONT -> int3 -> waitpid round trips on a child of our own that does nothing
+// but int3s - exactly what the stops around a traced call add to it.
+// Returns the median in ns (0 if it didn't work out)
+unsigned long calibrateStops(void)
+{
+    pid_t pid = fork();
+    if(pid < 0) {
+        return 0;
+    }
+    if(pid == 0)
+    {
+        ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+        raise(SIGSTOP);
+        for(;;) {
+            __asm__ volatile("int3");
+        }
+    }
+
+    static LogHistogram rounds;
+    memset(&rounds, 0, sizeof(rounds));
+    int wait_status;
+    waitpid(pid, &wait_status, 0);
+    for(int i = 0; i < LATENCY_CALIBRATE_ROUNDS && WIFSTOPPED(wait_status); i++)           // not traceWait - these aren't the target's syscalls
+    {
+        unsigned long start = nowNs();
+        ptrace(PTRACE_CONT, pid, NULL, NULL);
+        waitpid(pid, &wait_status, 0);
+        histAdd(&rounds, nowNs() - start);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, &wait_status, 0);
+    return histQuantile(&rounds, 0.5);
+}
+
+// Name: printLatency
+// The latency report of every traced function that was timed at least once
+void printLatency(TracedFunc* funcs, int func_num)
+{
+    for(int f = 0; f < func_num; f++)
+    {
+        LatencyStats* latency = funcs[f].latency;
+        if(latency == NULL || latency->hist.count == 0) {
+            continue;
+        }
+        outputLine("PRF:: %s: latency ns: min %lu, mean %.0f, max %lu (%lu ns stop overhead taken off each)\n", funcs[f].name,
+               latency->min, (double)latency->sum / latency->hist.count, latency->max, stats.stop_overhead);
+        outputLine("PRF:: %s: latency ns: p50 %lu, p90 %lu, p99 %lu, p99.9 %lu\n", funcs[f].name,
+               latencyQuantile(latency, 0.5), latencyQuantile(latency, 0.9),
+               latencyQuantile(latency, 0.99), latencyQuantile(latency, 0.999));
+    }
+    fflush(stdout);
+}
+
+// ======================================================================================================================================
+// --------------------------------------------------------- Sampling -------------------------------------------------------------------
+// ======================================================================================================================================
+//
+// --sample=N (see countCall): every outermost call still stops at its entry to be counted, so run #s are the real
+// call indexes, but only 1 in N gets a return breakpoint and a report.
+// --sample-duty=ON/PERIOD: entry breakpoints are in for the first ON ms of every PERIOD ms, and out (the original
+// bytes back) for the rest - no stops at all then.
+// --max-overhead=P%: every stop is timed (seen -> let go, plus the calibrated round trip - see calibrateStops) and
+// charged to the function whose breakpoint it was. Each function has a budget of stop time that the time the
+// target runs refills, P% of it split evenly - and what a cold function doesn't need goes to the hot ones. A
+// function that ran out has its entry breakpoint out until the refill covers it again, so a hot function is
+// sampled in short bursts and a cold one is traced in full.
+// Calls while an entry breakpoint is out aren't seen, so with the last two the reports count samples, not runs.
+// Entry breakpoints go back in on a SIGALRM tick while the target runs, through the mem file (debug registers can't
+// be set on a running thread, so it's int3s only). SIGALRM only comes through loopWait, so it never cuts our own
+// writes short.
+
+static long gcd(long a, long b)
+{
+    while(b != 0)
+    {
+        long t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// Name: samplerStart / samplerStop
+// The tick comes every gcd(ON, PERIOD) ms - often enough to see both ends of the cycle - and every GOVERNOR_TICK_MS
+// for the budget refills
+void samplerStart(TracedFunc* funcs, int func_num)
+{
+    loopSignalAdd(SIGALRM);                                                                 // the tick wakes up the event loop (see loopWait)
+
+    long tick_ms = options.sample_period_ms > 0 ? gcd(options.sample_on_ms, options.sample_period_ms) : GOVERNOR_TICK_MS;
+    if(options.max_overhead > 0) {
+        tick_ms = gcd(tick_ms, GOVERNOR_TICK_MS);
+    }
+    struct itimerval timer;
+    timer.it_interval.tv_sec = tick_ms / 1000;
+    timer.it_interval.tv_usec = (tick_ms % 1000) * 1000;
+    timer.it_value = timer.it_interval;
+    sampler.start = sampler.last_refill = nowNs();
+    sampler.paused = false;
+    sampler.charge = NO_FUNC;
+    for(int f = 0; f < func_num; f++) {                                                     // a full budget to start with
+        funcs[f].stop_budget = options.max_overhead * GOVERNOR_BURST_NS;
+    }
+    sampler.running = true;
+    setitimer(ITIMER_REAL, &timer, NULL);
+}
+
+void samplerStop(void)
+{
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_REAL, &timer, NULL);
+    sampler.paused = false;
+    sampler.running = false;
+}
+
+// Name: takeOutEntry
+// Takes func's entry breakpoint out unless it's a return site too. Return breakpoints of calls in flight stay, so
+// those calls are still reported.
+static void takeOutEntry(RemoteMem* mem, BreakpointTable* table, TracedFunc* func)
+{
+    Breakpoint* bp = bpLookup(table, func->address);
+    if(bp != NULL && bp->ret_refs == 0) {
+        bpRemove(mem, bp);
+    }
+}
+
+// Name: samplerUpdate
+// On the tick: moves the duty cycle on, refills the --max-overhead budgets (and lets the functions that are covered
+// again back in)
+void samplerUpdate(RemoteMem* mem, BreakpointTable* table, TracedFunc* funcs, int func_num)
+{
+    unsigned long now = nowNs();
+    if(options.sample_period_ms > 0)
+    {
+        unsigned long phase_ms = (now - sampler.start) / 1000000 % options.sample_period_ms;
+        bool paused = phase_ms >= (unsigned long)options.sample_on_ms;
+        if(paused != sampler.paused)
+        {
+            sampler.paused = paused;
+            for(int f = 0; f < func_num; f++)
+            {
+                if(funcs[f].status != SUCCESS) {
+                    continue;
+                }
+                if(paused) {
+                    takeOutEntry(mem, table, &funcs[f]);
+                }
+                else {
+                    armEntry(mem, table, funcs, f);
+                }
+            }
+        }
+    }
+    if(options.max_overhead <= 0) {
+        return;
+    }
+
+    unsigned long elapsed = now - sampler.last_refill;
+    unsigned long stopped = sampler.stopped - sampler.stopped_at_refill;
+    long refill = options.max_overhead * (elapsed > stopped ? elapsed - stopped : 0);       // P% of the time the target ran
+    long full = options.max_overhead * GOVERNOR_BURST_NS;
+    sampler.last_refill = now;
+    sampler.stopped_at_refill = sampler.stopped;
+    for(int round = 0; round < func_num && refill > 0; round++)                             // even shares, what a full one can't take goes round again
+    {
+        int hungry = 0;
+        for(int f = 0; f < func_num; f++) {
+            hungry += (funcs[f].status == SUCCESS && funcs[f].stop_budget < full);
+        }
+        if(hungry == 0 || refill / hungry == 0) {
+            break;
+        }
+        long share = refill / hungry;
+        for(int f = 0; f < func_num; f++)
+        {
+            if(funcs[f].status != SUCCESS || funcs[f].stop_budget >= full) {
+                continue;
+            }
+            long take = full - funcs[f].stop_budget < share ? full - funcs[f].stop_budget : share;
+            funcs[f].stop_budget += take;
+            refill -= take;
+        }
+    }
+    for(int f = 0; f < func_num; f++)
+    {
+        if(funcs[f].gated && funcs[f].stop_budget >= 0)
+        {
+            funcs[f].gated = false;
+            armEntry(mem, table, funcs, f);
+        }
+    }
+}
+
+// Name: governorCharge
+// A stop was just seen (at stop_time): the one before it is over, charge it to its function
+void governorCharge(RemoteMem* mem, BreakpointTable* table, TracedFunc* funcs, unsigned long stop_time)
+{
+    if(sampler.stop_start != 0 && sampler.resumed > sampler.stop_start)
+    {
+        unsigned long cost = sampler.resumed - sampler.stop_start + stats.stop_overhead;
+        sampler.stopped += cost;
+        if(sampler.charge != NO_FUNC)
+        {
+            TracedFunc* func = &funcs[sampler.charge];
+            func->stop_budget -= cost;
+            if(func->stop_budget < 0 && !func->gated)                                       // out until the refill covers it
+            {
+                func->gated = true;
+                takeOutEntry(mem, table, func);
+            }
+        }
+    }
+    sampler.stop_start = stop_time;
+    sampler.charge = NO_FUNC;
+}
+
+// ======================================================================================================================================
+// ---------------------------------------------------- Instruction Decoder -------------------------------------------------------------
+// ======================================================================================================================================
+//
+// An x86-64 instruction LENGTH decoder - just enough to copy whole instructions out of a function prologue and know
+// whether they can run somewhere else (relative branches / RIP-relative operands). No VEX/EVEX, no 3DNow!.
+
+// ModRM (M), immediate size and branch kind of every one byte opcode. Z = imm32 (imm16 with 0x66), V = imm32 / imm64 with REX.W
+#define OP_M 0x01                                                                           // has ModRM
+#define OP_I8 0x02
+#define OP_I16 0x04
+#define OP_Z 0x08
+#define OP_V 0x10
+#define OP_REL 0x20                                                                         // immediate is a relative branch target
+#define OP_BAD 0x40                                                                         // invalid in 64 bit mode / not supported
+#define OP_STOP 0x80                                                                        // control never falls through (ret, jmp, int3..)
+
+static const unsigned char one_byte_ops[256] = {
+    /* 00 */ OP_M, OP_M, OP_M, OP_M, OP_I8, OP_Z, OP_BAD, OP_BAD, OP_M, OP_M, OP_M, OP_M, OP_I8, OP_Z, OP_BAD, 0,
+    /* 10 */ OP_M, OP_M, OP_M, OP_M, OP_I8, OP_Z, OP_BAD, OP_BAD, OP_M, OP_M, OP_M, OP_M, OP_I8, OP_Z, OP_BAD, OP_BAD,
+    /* 20 */ OP_M, OP_M, OP_M, OP_M, OP_I8, OP_Z, 0, OP_BAD, OP_M, OP_M, OP_M, OP_M, OP_I8, OP_Z, 0, OP_BAD,
+    /* 30 */ OP_M, OP_M, OP_M, OP_M, OP_I8, OP_Z, 0, OP_BAD, OP_M, OP_M, OP_M, OP_M, OP_I8, OP_Z, 0, OP_BAD,
+    /* 40 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,                                  // REX - eaten as a prefix
+    /* 50 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 60 */ OP_BAD, OP_BAD, OP_BAD, OP_M, 0, 0, 0, 0, OP_Z, OP_M | OP_Z, OP_I8, OP_M | OP_I8, 0, 0, 0, 0,
+    /* 70 */ OP_I8 | OP_REL, OP_I8 | OP_REL, OP_I8 | OP_REL, OP_I8 | OP_REL, OP_I8 | OP_REL, OP_I8 | OP_REL, OP_I8 | OP_REL, OP_I8 | OP_REL,
+             OP_I8 | OP_REL, OP_I8 | OP_REL, OP_I8 | OP_REL, OP_I8 | OP_REL, OP_I8 | OP_REL, OP_I8 | OP_REL, OP_I8 | OP_REL, OP_I8 | OP_REL,
+    /* 80 */ OP_M | OP_I8, OP_M | OP_Z, OP_BAD, OP_M | OP_I8, OP_M, OP_M, OP_M, OP_M, OP_M, OP_M, OP_M, OP_M, OP_M, OP_M, OP_M, OP_M,
+    /* 90 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, OP_BAD, 0, 0, 0, 0, 0,
+    /* A0 */ OP_BAD, OP_BAD, OP_BAD, OP_BAD, 0, 0, 0, 0, OP_I8, OP_Z, 0, 0, 0, 0, 0, 0,          // A0-A3 moffs64 - never in a prologue
+    /* B0 */ OP_I8, OP_I8, OP_I8, OP_I8, OP_I8, OP_I8, OP_I8, OP_I8, OP_V, OP_V, OP_V, OP_V, OP_V, OP_V, OP_V, OP_V,
+    /* C0 */ OP_M | OP_I8, OP_M | OP_I8, OP_I16 | OP_STOP, OP_STOP, OP_BAD, OP_BAD, OP_M | OP_I8, OP_M | OP_Z,
+             OP_I16 | OP_I8, 0, OP_I16 | OP_STOP, OP_STOP, OP_STOP, OP_I8, OP_BAD, OP_STOP,
+    /* D0 */ OP_M, OP_M, OP_M, OP_M, OP_BAD, OP_BAD, OP_BAD, 0, OP_M, OP_M, OP_M, OP_M, OP_M, OP_M, OP_M, OP_M,
+    /* E0 */ OP_I8 | OP_REL, OP_I8 | OP_REL, OP_I8 | OP_REL, OP_I8 | OP_REL, OP_I8, OP_I8, OP_I8, OP_I8,
+             OP_Z | OP_REL, OP_Z | OP_REL | OP_STOP, OP_BAD, OP_I8 | OP_REL | OP_STOP, 0, 0, 0, 0,
+    /* F0 */ 0, OP_STOP, 0, 0, OP_STOP, 0, OP_M, OP_M, 0, 0, 0, 0, 0, 0, OP_M, OP_M,
+};
+
+// Name: twoByteOp
+// Same flags for 0F xx
+static unsigned char twoByteOp(unsigned char op)
+{
+    if(op >= 0x80 && op <= 0x8F) {                                                          // jcc rel32
+        return OP_Z | OP_REL;
+    }
+    switch(op)
+    {
+        case 0x05: case 0x06: case 0x07: case 0x08: case 0x09: case 0x0B: case 0x31: case 0x34: case 0x35:
+        case 0x77: case 0xA0: case 0xA1: case 0xA2: case 0xA8: case 0xA9:
+        case 0xC8: case 0xC9: case 0xCA: case 0xCB: case 0xCC: case 0xCD: case 0xCE: case 0xCF:
+            return 0;                                                                       // syscall, rdtsc, cpuid, bswap, push/pop fs/gs..
+        case 0x70: case 0x71: case 0x72: case 0x73: case 0xA4: case 0xAC: case 0xBA:
+        case 0xC2: case 0xC4: case 0xC5: case 0xC6:
+            return OP_M | OP_I8;
+        case 0x0F: case 0x38: case 0x3A:                                                    // 3DNow! / three byte maps - handled by the caller
+            return OP_BAD;
+        default:
+            return OP_M;
+    }
+}
+
+// Name: decodeInsn
+// Recieves code bytes (at least max_len of them readable) and fills info about the first instruction
+// Returns the instruction length, or -1 if we don't know the instruction
+int decodeInsn(const unsigned char* code, int max_len, InsnInfo* info)
+{
+    memset(info, 0, sizeof(InsnInfo));
+    info->modrm_offset = -1;
+    int i = 0;
+    bool opsize16 = false, rex_w = false;
+
+    for(; i < max_len && i < 14; i++)                                                       // legacy prefixes
+    {
+        unsigned char b = code[i];
+        if(b == 0x66) {
+            opsize16 = true;
+        }
+        else if(!(b == 0x67 || b == 0xF0 || b == 0xF2 || b == 0xF3 || b == 0x2E || b == 0x36 ||
+                  b == 0x3E || b == 0x26 || b == 0x64 || b == 0x65)) {
+            break;
+        }
+    }
+    if(i < max_len && (code[i] & 0xF0) == 0x40)                                             // REX
+    {
+        rex_w = (code[i] & 0x08) != 0;
+        i++;
+    }
+    if(i >= max_len) {
+        return -1;
+    }
+
+    unsigned char flags;
+    unsigned char op = code[i++];
+    if(op == 0x0F)
+    {
+        if(i >= max_len) {
+            return -1;
+        }
+        unsigned char op2 = code[i++];
+        if(op2 == 0x38) {                                                                   // 0F 38 xx /r
+            i++;
+            flags = OP_M;
+        }
+        else if(op2 == 0x3A) {                                                              // 0F 3A xx /r ib
+            i++;
+            flags = OP_M | OP_I8;
+        }
+        else {
+            flags = twoByteOp(op2);
+        }
+    }
+    else
+    {
+        flags = one_byte_ops[op];
+        if((op == 0xF6 || op == 0xF7) && i < max_len && ((code[i] >> 3) & 7) < 2) {         // test r/m, imm is the only F6/F7 with an immediate
+            flags |= (op == 0xF6) ? OP_I8 : OP_Z;
+        }
+        if(op == 0xFF && i < max_len && (((code[i] >> 3) & 7) == 4 || ((code[i] >> 3) & 7) == 5)) {
+            flags |= OP_STOP;                                                               // jmp r/m
+        }
+    }
+    if(flags & OP_BAD) {
+        return -1;
+    }
+
+    if(flags & OP_M)
+    {
+        if(i >= max_len) {
+            return -1;
+        }
+        info->modrm_offset = i;
+        unsigned char modrm = code[i++];
+        unsigned char mod = modrm >> 6, rm = modrm & 7;
+        if(mod != 3 && rm == 4)                                                             // SIB
+        {
+            if(i >= max_len) {
+                return -1;
+            }
+            unsigned char base = code[i++] & 7;
+            if(mod == 0 && base == 5) {
+                info->disp_size = 4;
+            }
+        }
+        if(mod == 0 && rm == 5)
+        {
+            info->disp_size = 4;
+            info->rip_relative = true;
+        }
+        else if(mod == 1) {
+            info->disp_size = 1;
+        }
+        else if(mod == 2) {
+            info->disp_size = 4;
+        }
+        info->disp_offset = i;
+        i += info->disp_size;
+    }
+
+    if(flags & OP_I16) {
+        info->imm_size += 2;
+    }
+    if(flags & OP_I8) {
+        info->imm_size += 1;
+    }
+    if(flags & OP_Z) {
+        info->imm_size += opsize16 ? 2 : 4;
+    }
+    if(flags & OP_V) {
+        info->imm_size += rex_w ? 8 : (opsize16 ? 2 : 4);
+    }
+    info->imm_offset = i;
+    i += info->imm_size;
+
+    info->relative_branch = (flags & OP_REL) != 0;
+    info->stops_flow = (flags & OP_STOP) != 0;
+    info->length = i;
+    return i <= max_len ? i : -1;
+}
+
+// ======================================================================================================================================
+// ------------------------------------------------------ Preload Backend ---------------------------------------------------------------
+// ======================================================================================================================================
+//
+// --backend=preload: no ptrace at all. The target runs with the agent (prf_agent.c) preloaded, the agent swaps the
+// GOT slots of our functions for its hooks and the hooks push every return into a shared ring that we drain here.
+// Only works for functions the executable imports (is_dyn).
+
+// Name: agentPath
+// --agent=PATH, or libprfagent.so next to our own executable
+void agentPath(char* path, int path_size)
+{
+    if(options.agent_path != NULL)
+    {
+        snprintf(path, path_size, "%s", options.agent_path);
+        return;
+    }
+    char self[PATH_MAX];
+    ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    self[len > 0 ? len : 0] = '\0';
+    snprintf(path, path_size, "%s/%s", len > 0 ? dirname(self) : ".", AGENT_LIB_NAME);
+}
+
+// Name: drainRing
+// Prints everything that's in the ring right now (ctx = PreloadState)
+// Returns how many records there were
+int drainRing(void* ctx)
+{
+    PreloadState* state = ctx;
+    PrfRecord rec;
+    int drained = 0;
+    while(prfRingPop(state->ring, &rec))
+    {
+        if(rec.func_id < (uint32_t)state->func_num) {
+            PrfTraceRecord trace_rec = { .func_id = rec.func_id, .call_index = rec.call_index, .entry_ns = rec.timestamp,
+                                         .exit_ns = rec.timestamp, .ret = rec.ret };       // the agent only sees the return
+            reportReturn(state->funcs, state->func_num, &trace_rec);
+        }
+        drained++;
+    }
+    return drained;
+}
+
+// Name: drainUntilExit
+// For the backends where the child runs on its own: call drain until the child exits, napping while there's nothing,
+// then one last drain. A child we still trace goes to stopped on every stop of one of its threads (NULL = untraced).
+void drainUntilExit(pid_t pid, int (*drain)(void* ctx), void (*stopped)(void* ctx, pid_t tid, int wait_status), void* ctx)
+{
+    int wait_status;
+    struct timespec nap = { 0, AGENT_POLL_NS };
+    while(true)
+    {
+        if(drain(ctx) > 0) {
+            continue;
+        }
+        pid_t tid = waitpid(stopped != NULL ? -1 : pid, &wait_status, WNOHANG | __WALL);
+        if(tid == pid && (WIFEXITED(wait_status) || WIFSIGNALED(wait_status))) {
+            break;
+        }
+        if(tid > 0 && WIFSTOPPED(wait_status) && stopped != NULL) {
+            stopped(ctx, tid, wait_status);
+            continue;
+        }
+        nanosleep(&nap, NULL);
+    }
+    drain(ctx);                                                                             // whatever made it in before the exit
+}
+
+// Name: runPreload
+// The whole preload backend: make the ring, run the target with the agent, print until it exits
+// Returns false if the backend couldn't start (then nothing ran).
+bool runPreload(const char* name, char** argv, TracedFunc* funcs, int func_num)
+{
+    char agent[PATH_MAX], fd_str[16];
+    agentPath(agent, sizeof(agent));
+    if(access(agent, R_OK) != 0) {
+        printf("PRF:: preload agent %s not found! :(\n", agent);
+        return false;
+    }
+
+    int ring_fd = memfd_create("prf-ring", 0);                                              // no CLOEXEC - the child needs it
+    unsigned long ring_size = prfRingBytes(AGENT_RING_CAPACITY);
+    if(ring_fd == -1 || ftruncate(ring_fd, ring_size) != 0) {
+        return false;
+    }
+    PrfRing* ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring_fd, 0);
+    if(ring == MAP_FAILED) {
+        close(ring_fd);
+        return false;
+    }
+    prfRingInit(ring, AGENT_RING_CAPACITY);
+
+    // The agent gets the names of the functions we trace (in our order, so func_id = index) - and the ones we don't
+    // as empty names, to keep the ids lined up
+    unsigned long names_len = 1;
+    for(int f = 0; f < func_num; f++) {
+        names_len += strlen(funcs[f].name) + 1;
+    }
+    char* names = calloc(names_len, 1);
+    for(int f = 0; f < func_num; f++)
+    {
+        if(f > 0) {
+            strcat(names, ",");
+        }
+        if(funcs[f].status == SUCCESS) {
+            strcat(names, funcs[f].name);
+        }
+    }
+    const char* old_preload = getenv("LD_PRELOAD");
+    char* preload = malloc(strlen(agent) + (old_preload ? strlen(old_preload) : 0) + 2);
+    sprintf(preload, "%s%s%s", agent, old_preload ? ":" : "", old_preload ? old_preload : "");
+    sprintf(fd_str, "%d", ring_fd);
+
+    pid_t pid = fork();
+    if(pid < 0) {
+        exit(1);
+    }
+    if(pid == 0)
+    {
+        setenv("LD_PRELOAD", preload, 1);
+        setenv("PRF_AGENT_FD", fd_str, 1);
+        setenv("PRF_AGENT_FUNCS", names, 1);
+        execv(name, argv);
+        exit(1);
+    }
+    close(ring_fd);
+    free(names);
+    free(preload);
+
+    PreloadState state = { ring, funcs, func_num };
+    drainUntilExit(pid, drainRing, NULL, &state);
+    if(ring->dropped > 0) {
+        fprintf(stderr, "PRF:: %lu returns dropped (ring full)\n", (unsigned long)ring->dropped);
+    }
+    munmap(ring, ring_size);
+    return true;
+}
+
+// ======================================================================================================================================
+// ---------------------------------------------------- Trampoline Backend --------------------------------------------------------------
+// ======================================================================================================================================
+//
+// --backend=trampoline: ptrace only at startup. At the exec stop we make the child mmap our shared data (memfd) and
+// a code page close to its text, write a trampoline per function there, and overwrite the function's first
+// instructions with a jmp to it. Then we detach and only read the shared data.
+//
+//   entry stub (per function):  count the call, push (return address, call index, func id) on a shadow stack in the
+//                               shared data, swap the return address for the return stub, run the prologue
+//                               instructions we moved out, jmp back into the function
+//   return stub (shared):       pop the shadow stack, write (func id, call index, rax, rdtsc) into the shared ring,
+//                               jmp to the real return address
+//
+// Like the int3 backend only the outermost call of a function is reported. Single threaded targets only (one
+// shadow stack): we stay attached for clone events alone, and at the first one put the prologues back before the
+// new thread runs - calls from then on aren't traced, and prf says so and exits 1. A longjmp out of a traced
+// function confuses it. A call that finds the shadow stack full
+// (TRAMP_STACK_DEPTH frames) runs untraced and is counted in the shared data, reported as dropped at the end.
+// There is no clock_gettime in a stub, so returns are stamped with the TSC and drainTrampoline maps that to
+// CLOCK_MONOTONIC ns against two points it takes itself (the start, and now).
+
+// Name: emit*
+// Tiny machine code writer
+static void emitBytes(CodeBuf* code, const void* bytes, int len)
+{
+    if(code->buf != NULL && code->len + len <= code->capacity) {
+        memcpy(code->buf + code->len, bytes, len);
+    }
+    code->len += len;
+}
+
+static void emit32(CodeBuf* code, unsigned int value)
+{
+    emitBytes(code, &value, 4);
+}
+
+static void emit64(CodeBuf* code, unsigned long value)
+{
+    emitBytes(code, &value, 8);
+}
+
+// Name: emitReturnStub
+// rax / rdx hold the return value - only caller saved scratch registers (rcx, rsi, r8-r11) and flags are touched
+void emitReturnStub(CodeBuf* code, unsigned long data)
+{
+    emitBytes(code, "\x49\xBB", 2); emit64(code, data);                                     // movabs r11, data
+    emitBytes(code, "\x49\xFF\x8B", 3); emit32(code, TRAMP_OFF_SP);                         // dec qword [r11 + SP]
+    emitBytes(code, "\x4D\x8B\x93", 3); emit32(code, TRAMP_OFF_SP);                         // mov r10, [r11 + SP]
+    emitBytes(code, "\x49\xC1\xE2\x05", 4);                                                 // shl r10, 5            (32 byte frames)
+    emitBytes(code, "\x4D\x01\xDA", 3);                                                     // add r10, r11          (r10 = frame - STACK)
+    emitBytes(code, "\x49\x8B\x8A", 3); emit32(code, TRAMP_OFF_STACK + 16);                 // mov rcx, [r10 + STACK + 16]       func id
+    emitBytes(code, "\x49\xFF\x8C\xCB", 4); emit32(code, TRAMP_OFF_DEPTH);                  // dec qword [r11 + rcx*8 + DEPTH]
+    emitBytes(code, "\x4D\x8B\x82", 3); emit32(code, TRAMP_OFF_STACK + 8);                  // mov r8, [r10 + STACK + 8]         call index
+    emitBytes(code, "\x4D\x85\xC0", 3);                                                     // test r8, r8           (0 = nested call)
+    emitBytes(code, "\x74\x4B", 2);                                                         // jz done
+    emitBytes(code, "\x4D\x8B\x8B", 3); emit32(code, TRAMP_OFF_HEAD);                       // mov r9, [r11 + HEAD]
+    emitBytes(code, "\x4C\x89\xCE", 3);                                                     // mov rsi, r9
+    emitBytes(code, "\x49\x81\xE1", 3); emit32(code, TRAMP_RING_CAPACITY - 1);              // and r9, CAPACITY - 1
+    emitBytes(code, "\x49\xC1\xE1\x05", 4);                                                 // shl r9, 5             (32 byte records)
+    emitBytes(code, "\x4D\x01\xD9", 3);                                                     // add r9, r11
+    emitBytes(code, "\x49\x89\x89", 3); emit32(code, TRAMP_OFF_RING);                       // mov [r9 + RING], rcx              func_id (+ reserved = 0)
+    emitBytes(code, "\x4D\x89\x81", 3); emit32(code, TRAMP_OFF_RING + 8);                   // mov [r9 + RING + 8], r8           call_index
+    emitBytes(code, "\x49\x89\x81", 3); emit32(code, TRAMP_OFF_RING + 16);                  // mov [r9 + RING + 16], rax         ret
+    emitBytes(code, "\x50\x52", 2);                                                         // push rax; push rdx    (the return value)
+    emitBytes(code, "\x0F\x31", 2);                                                         // rdtsc
+    emitBytes(code, "\x48\xC1\xE2\x20", 4);                                                 // shl rdx, 32
+    emitBytes(code, "\x48\x09\xD0", 3);                                                     // or rax, rdx
+    emitBytes(code, "\x49\x89\x81", 3); emit32(code, TRAMP_OFF_RING + 24);                  // mov [r9 + RING + 24], rax         timestamp (TSC)
+    emitBytes(code, "\x5A\x58", 2);                                                         // pop rdx; pop rax
+    emitBytes(code, "\x48\xFF\xC6", 3);                                                     // inc rsi
+    emitBytes(code, "\x49\x89\xB3", 3); emit32(code, TRAMP_OFF_HEAD);                       // mov [r11 + HEAD], rsi   (x86 keeps the record stores before it)
+    emitBytes(code, "\x41\xFF\xA2", 3); emit32(code, TRAMP_OFF_STACK);                      // done: jmp [r10 + STACK]
+}
+
+// Name: emitEntryStub
+// Recieves the remote address the stub will live at (code->remote + code->len), the function and the prologue
+// instructions we moved out of it (moved_len bytes)
+void emitEntryStub(CodeBuf* code, unsigned long data, unsigned long ret_stub, int func_id,
+                   unsigned long func_addr, const unsigned char* moved, int moved_len)
+{
+    unsigned int calls = TRAMP_OFF_CALLS + 8 * func_id, depth = TRAMP_OFF_DEPTH + 8 * func_id;
+    emitBytes(code, "\x50", 1);                                                             // push rax              (al = vector args of a varargs call)
+    emitBytes(code, "\x49\xBB", 2); emit64(code, data);                                     // movabs r11, data
+    emitBytes(code, "\x49\x81\xBB", 3); emit32(code, TRAMP_OFF_SP); emit32(code, TRAMP_STACK_DEPTH); // cmp qword [r11 + SP], DEPTH
+    emitBytes(code, "\x72\x0C", 2);                                                         // jb room
+    emitBytes(code, "\x49\xFF\x83", 3); emit32(code, TRAMP_OFF_OVERFLOW);                   // inc qword [r11 + OVERFLOW]
+    emitBytes(code, "\xE9", 1);                                                             // jmp full
+    int full_jmp = code->len;
+    emit32(code, 0);
+    emitBytes(code, "\x31\xC0", 2);                                                         // xor eax, eax          (call index 0 = nested)
+    emitBytes(code, "\x49\x83\xBB", 3); emit32(code, depth); emitBytes(code, "\x00", 1);     // cmp qword [r11 + DEPTH + 8i], 0
+    emitBytes(code, "\x75\x0E", 2);                                                         // jne nested
+    emitBytes(code, "\x49\xFF\x83", 3); emit32(code, calls);                                // inc qword [r11 + CALLS + 8i]
+    emitBytes(code, "\x49\x8B\x83", 3); emit32(code, calls);                                // mov rax, [r11 + CALLS + 8i]
+    emitBytes(code, "\x49\xFF\x83", 3); emit32(code, depth);                                // nested: inc qword [r11 + DEPTH + 8i]
+    emitBytes(code, "\x4D\x8B\x93", 3); emit32(code, TRAMP_OFF_SP);                         // mov r10, [r11 + SP]
+    emitBytes(code, "\x49\xC1\xE2\x05", 4);                                                 // shl r10, 5
+    emitBytes(code, "\x4D\x01\xDA", 3);                                                     // add r10, r11
+    emitBytes(code, "\x49\x89\x82", 3); emit32(code, TRAMP_OFF_STACK + 8);                  // mov [r10 + STACK + 8], rax
+    emitBytes(code, "\x49\xC7\x82", 3); emit32(code, TRAMP_OFF_STACK + 16); emit32(code, func_id); // mov qword [r10 + STACK + 16], i
+    emitBytes(code, "\x48\x8B\x44\x24\x08", 5);                                             // mov rax, [rsp + 8]    (return address)
+    emitBytes(code, "\x49\x89\x82", 3); emit32(code, TRAMP_OFF_STACK);                      // mov [r10 + STACK], rax
+    emitBytes(code, "\x49\xFF\x83", 3); emit32(code, TRAMP_OFF_SP);                         // inc qword [r11 + SP]
+    emitBytes(code, "\x4C\x8D\x15", 3);                                                     // lea r10, [rip + ret_stub]
+    emit32(code, (unsigned int)(ret_stub - (code->remote + code->len + 4)));
+    emitBytes(code, "\x4C\x89\x54\x24\x08", 5);                                             // mov [rsp + 8], r10
+    int full = code->len;
+    if(code->buf != NULL && full_jmp + 4 <= code->capacity)                                 // full: untraced from here
+    {
+        unsigned int rel = full - (full_jmp + 4);
+        memcpy(code->buf + full_jmp, &rel, 4);
+    }
+    emitBytes(code, "\x58", 1);                                                             // pop rax
+    for(int at = 0; at < moved_len;)                                                        // the prologue we overwrote
+    {
+        InsnInfo info;
+        int insn_len = decodeInsn(moved + at, moved_len - at, &info);
+        int start = code->len;
+        emitBytes(code, moved + at, insn_len);
+        if(info.rip_relative)                                                               // same target from the new place
+        {
+            int disp;
+            memcpy(&disp, moved + at + info.disp_offset, 4);
+            disp += (int)((func_addr + at) - (code->remote + start));
+            if(code->buf != NULL && code->len <= code->capacity) {
+                memcpy(code->buf + start + info.disp_offset, &disp, 4);
+            }
+        }
+        at += insn_len;
+    }
+    emitBytes(code, "\xE9", 1);                                                             // jmp func + moved_len
+    emit32(code, (unsigned int)(func_addr + moved_len - (code->remote + code->len + 4)));
+}
+
+// Name: prologueLength
+// How many bytes of whole instructions from the start of the function we have to move out to fit a jmp rel32
+// Returns -1 if one of them can't run from somewhere else (relative branch / ends the function). RIP-relative
+// operands are fine - emitEntryStub fixes their disp32 (the stub is within rel32 reach of the function).
+int prologueLength(const unsigned char* code, int code_len)
+{
+    int len = 0;
+    while(len < JMP_REL32_SIZE)
+    {
+        InsnInfo info;
+        int insn_len = decodeInsn(code + len, code_len - len, &info);
+        if(insn_len < 0 || info.relative_branch || info.stops_flow) {
+            return -1;
+        }
+        len += insn_len;
+    }
+    return len;
+}
+
+// Name: remoteNearMmap
+// mmap in the child, somewhere a rel32 jmp from near reaches (both ways)
+// Returns the remote address, 0 on failure.
+unsigned long remoteNearMmap(RemoteMem* mem, unsigned long near, unsigned long size, long prot, long flags, long fd)
+{
+    for(unsigned long step = 1; step <= 8; step++)
+    {
+        unsigned long hint = (near & ~(REMOTE_PAGE_SIZE - 1)) + step * TRAMP_HINT_STEP;
+        long addr = remoteSyscall(mem, SYS_mmap, hint, size, prot, flags, fd, 0);
+        if(addr < 0 && addr > -4096) {
+            return 0;
+        }
+        long distance = addr - (long)near;
+        if(distance < 0) {
+            distance = -distance;
+        }
+        if(distance + (long)size < JMP_REL32_REACH) {
+            return addr;
+        }
+        remoteSyscall(mem, SYS_munmap, addr, size, 0, 0, 0, 0);                             // the kernel put it somewhere else - try the next hint
+    }
+    return 0;
+}
+
+// Name: injectTrampolines
+// Everything that needs the child stopped: shared data + code page, stubs, patched prologues
+// Keeps the bytes the jmps go over in state (see removeTrampolines).
+// Returns false (child untouched except for maybe an extra mapping) if some function can't be patched.
+bool injectTrampolines(RemoteMem* mem, TracedFunc* funcs, int func_num, int data_fd, TrampolineState* state)
+{
+    unsigned char (*prologues)[MAX_INSN_LEN * 2] = state->prologues;
+    int* moved_lens = state->moved_lens;
+    unsigned long lowest = 0;
+    for(int f = 0; f < func_num; f++)
+    {
+        if(funcs[f].status != SUCCESS) {
+            continue;
+        }
+        RemoteIov read = { funcs[f].address, prologues[f], sizeof(prologues[f]) };
+        moved_lens[f] = remoteRead(mem, &read, 1, true) ? prologueLength(prologues[f], sizeof(prologues[f])) : -1;
+        if(moved_lens[f] < 0)
+        {
+            printf("PRF:: can't move the first instructions of %s - use the ptrace backend! :(\n", funcs[f].name);
+            return false;
+        }
+        if(lowest == 0 || funcs[f].address < lowest) {
+            lowest = funcs[f].address;
+        }
+    }
+
+    long data = remoteSyscall(mem, SYS_mmap, 0, TRAMP_DATA_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, data_fd, 0);
+    remoteSyscall(mem, SYS_close, data_fd, 0, 0, 0, 0, 0);                                   // the child doesn't need the fd itself
+    CodeBuf code = { NULL, 0, 0, 0 };                                                       // first a dry run: how big the stubs are
+    unsigned long entries[TRAMP_MAX_FUNCS];
+    for(int pass = 0; pass < 2; pass++)
+    {
+        emitReturnStub(&code, data);
+        for(int f = 0; f < func_num; f++)
+        {
+            if(funcs[f].status != SUCCESS) {
+                continue;
+            }
+            entries[f] = code.remote + code.len;
+            emitEntryStub(&code, data, code.remote, f, funcs[f].address, prologues[f], moved_lens[f]);
+        }
+        if(pass == 1) {
+            break;
+        }
+        unsigned long code_size = (code.len + REMOTE_PAGE_SIZE - 1) & ~(REMOTE_PAGE_SIZE - 1);
+        unsigned long code_remote = remoteNearMmap(mem, lowest, code_size, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1);
+        if((data < 0 && data > -4096) || code_remote == 0) {
+            return false;
+        }
+        code = (CodeBuf){ calloc(code_size, 1), 0, code_size, code_remote };
+        if(code.buf == NULL) {
+            return false;
+        }
+    }
+    bool ok = code.len <= code.capacity && remoteWrite(mem, code.remote, code.buf, code.len);   // the mem file writes through PROT_EXEC
+    free(code.buf);
+
+    for(int f = 0; f < func_num && ok; f++)                                                 // and now the point of no return
+    {
+        if(funcs[f].status != SUCCESS) {
+            continue;
+        }
+        unsigned char jmp[MAX_INSN_LEN * 2];
+        memset(jmp, 0xCC, moved_lens[f]);                                                   // leftovers of the moved instructions are never run
+        jmp[0] = 0xE9;
+        unsigned int rel = (unsigned int)(entries[f] - (funcs[f].address + JMP_REL32_SIZE));
+        memcpy(jmp + 1, &rel, 4);
+        ok = remoteWrite(mem, funcs[f].address, jmp, moved_lens[f]);
+    }
+    return ok;
+}
+
+// Name: tscClock
+// The TSC and CLOCK_MONOTONIC at the same moment: the TSC in the middle of a nowNs (after a warm up call)
+static void tscClock(unsigned long* tsc, unsigned long* ns)
+{
+    nowNs();
+    unsigned long before = __builtin_ia32_rdtsc();
+    *ns = nowNs();
+    *tsc = before + (__builtin_ia32_rdtsc() - before) / 2;
+}
+
+// Name: trampolineNs
+// A TSC stamp of the return stub in CLOCK_MONOTONIC ns: back from now, at the rate since (tsc_start, ns_start).
+// The records are fresh, so an error in the rate barely moves them. They are in return order, so never go back.
+static unsigned long trampolineNs(TrampolineState* state, unsigned long tsc)
+{
+    unsigned long tsc_now, ns_now;
+    tscClock(&tsc_now, &ns_now);
+    unsigned long ns = ns_now;
+    if(tsc_now > state->tsc_start && tsc < tsc_now) {
+        ns -= (unsigned long)((long double)(tsc_now - tsc) * (ns_now - state->ns_start) / (tsc_now - state->tsc_start));
+    }
+    ns = ns > state->last_ns ? ns : state->last_ns;
+    state->last_ns = ns;
+    return ns;
+}
+
+// Name: drainTrampoline
+// Prints the records the return stub wrote since last time. The stub never waits for us - if we fall a whole ring
+// behind, the oldest records are gone and counted as dropped.
+int drainTrampoline(void* ctx)
+{
+    TrampolineState* state = ctx;
+    unsigned char* data = state->data;
+    unsigned long head = __atomic_load_n((unsigned long*)(data + TRAMP_OFF_HEAD), __ATOMIC_ACQUIRE);
+    int drained = 0;
+    for(; state->tail < head; state->tail++)
+    {
+        if(head - state->tail > TRAMP_RING_CAPACITY) {
+            state->dropped += head - state->tail - TRAMP_RING_CAPACITY;
+            state->tail = head - TRAMP_RING_CAPACITY;
+        }
+        PrfRecord rec;
+        memcpy(&rec, data + TRAMP_OFF_RING + (state->tail & (TRAMP_RING_CAPACITY - 1)) * sizeof(PrfRecord), sizeof(rec));
+        unsigned long now = __atomic_load_n((unsigned long*)(data + TRAMP_OFF_HEAD), __ATOMIC_ACQUIRE);
+        if(now - state->tail > TRAMP_RING_CAPACITY) {                                       // overwritten while we copied it
+            state->dropped++;
+            continue;
+        }
+        if(rec.func_id < (uint32_t)state->func_num) {
+            unsigned long ns = trampolineNs(state, rec.timestamp);
+            PrfTraceRecord trace_rec = { .func_id = rec.func_id, .call_index = rec.call_index, .entry_ns = ns,
+                                         .exit_ns = ns, .ret = rec.ret };                   // only the return is timed
+            reportReturn(state->funcs, state->func_num, &trace_rec);
+        }
+        drained++;
+    }
+    return drained;
+}
+
+// Name: trampolineStopped
+// A stop of the child while the trampolines are in: a signal goes on to it. Its first clone event puts the prologues
+// back (the child is stopped in clone, so nothing runs them meanwhile) and lets go of it and the new thread, which is
+// held at its first stop until then - it may show up before the event does.
+void trampolineStopped(void* ctx, pid_t tid, int wait_status)
+{
+    TrampolineState* state = ctx;
+    pid_t pid = state->pid;
+    if(tid != pid)
+    {
+        if(state->untraced) {
+            tracePtrace(PTRACE_DETACH, tid, NULL, NULL);
+        }
+        else {
+            state->new_thread = tid;
+        }
+        return;
+    }
+    if(wait_status >> 8 != (SIGTRAP | (PTRACE_EVENT_CLONE << 8)))
+    {
+        tracePtrace(PTRACE_CONT, pid, NULL, (void*)(long)(WSTOPSIG(wait_status) == SIGTRAP ? 0 : WSTOPSIG(wait_status)));
+        return;
+    }
+    RemoteMem mem;
+    remoteInit(&mem, pid);
+    for(int f = 0; f < state->func_num; f++)
+    {
+        if(state->funcs[f].status == SUCCESS) {
+            remoteWrite(&mem, state->funcs[f].address, state->prologues[f], state->moved_lens[f]);
+        }
+    }
+    remoteClose(&mem);
+    state->untraced = true;
+    tracePtrace(PTRACE_DETACH, pid, NULL, NULL);
+    if(state->new_thread != 0) {
+        tracePtrace(PTRACE_DETACH, state->new_thread, NULL, NULL);
+    }
+}
+
+// Name: runTrampoline
+// The whole trampoline backend
+// Returns false if it couldn't set up (the child is killed then) or stopped tracing at a second thread.
+bool runTrampoline(const char* name, char** argv, TracedFunc* funcs, int func_num)
+{
+    int data_fd = memfd_create("prf-trampoline", 0);
+    if(data_fd == -1 || ftruncate(data_fd, TRAMP_DATA_SIZE) != 0) {
+        return false;
+    }
+    TrampolineState state = { .data = mmap(NULL, TRAMP_DATA_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, data_fd, 0),
+                              .funcs = funcs, .func_num = func_num };
+    tscClock(&state.tsc_start, &state.ns_start);
+    if(state.data == MAP_FAILED) {
+        close(data_fd);
+        return false;
+    }
+
+    int wait_status;
+    RemoteMem mem;
+    pid_t pid = runTarget(name, argv);                                                      // inherits data_fd
+    traceWait(pid, &wait_status);
+    remoteInit(&mem, pid);
+    bool ok = injectTrampolines(&mem, funcs, func_num, data_fd, &state);
+    remoteClose(&mem);
+    close(data_fd);
+    if(!ok)
+    {
+        kill(pid, SIGKILL);
+        waitpid(pid, &wait_status, 0);
+        munmap(state.data, TRAMP_DATA_SIZE);
+        return false;
+    }
+    state.pid = pid;
+    tracePtrace(PTRACE_SETOPTIONS, pid, 0, (void*)PTRACE_O_TRACECLONE);                     // from here on it runs on its own - but for
+    tracePtrace(PTRACE_CONT, pid, NULL, NULL);                                              // clones (see trampolineStopped)
+
+    drainUntilExit(pid, drainTrampoline, trampolineStopped, &state);
+    if(state.dropped > 0) {
+        fprintf(stderr, "PRF:: %lu returns dropped (ring overrun)\n", state.dropped);
+    }
+    unsigned long overflow = *(unsigned long*)(state.data + TRAMP_OFF_OVERFLOW);
+    if(overflow > 0) {
+        fprintf(stderr, "PRF:: %lu calls not traced (more than %d in flight)\n", overflow, TRAMP_STACK_DEPTH);
+    }
+    munmap(state.data, TRAMP_DATA_SIZE);
+    if(state.untraced) {
+        printf("PRF:: the target started a thread - calls after that weren't traced (single threaded targets only)! :(\n");
+    }
+    return !state.untraced;
+}
+
+// ======================================================================================================================================
+// ---------------------------------------------------- Displaced Stepping --------------------------------------------------------------
+// ======================================================================================================================================
+//
+// Getting a thread past an int3 without taking the int3 out: the instruction under it gets a copy in a code area in
+// the child (mapped near the text at the first stop), followed by a jmp back to the instruction after it. A hit just
+// points rip at the copy and resumes - no single-step stop, and other threads running past the address meanwhile
+// still hit the int3. RIP-relative operands get their disp32 fixed for the new place (that's why the area is within
+// rel32 reach). A relative jmp / jcc / call isn't copied but rebuilt with absolute addresses (displacedBranch) - a
+// call pushes the real return address, never one in the area. What's left (loop / jrcxz, call r/m, an operand out
+// of reach, a full area) is stepped over in place as before, which takes the int3 out for one step: a thread
+// running past it then goes unseen. The area is never unmapped - after a --pid detach a thread may still be on its
+// way through a copy.
+
+// Name: displacedInit
+// Maps the area (the child must be at a signal stop). Returns false if it couldn't - stepOver does it all then.
+bool displacedInit(RemoteMem* mem, unsigned long near)
+{
+    mem->displaced_area = near != 0 ? remoteNearMmap(mem, near, DISPLACED_AREA_SIZE, PROT_READ | PROT_EXEC,
+                                                     MAP_PRIVATE | MAP_ANONYMOUS, -1) : 0;
+    mem->displaced_used = 0;
+    return mem->displaced_area != 0;
+}
+
+// Name: displacedBranch
+// The relative jmp / jcc / call insn (len bytes, at address), rebuilt to work from anywhere
+// Returns false if it's one we don't rebuild (loop / jrcxz, a 16 bit displacement).
+static bool displacedBranch(CodeBuf* code, const unsigned char* insn, int len, const InsnInfo* info, unsigned long address)
+{
+    if(info->imm_size != 1 && info->imm_size != 4) {
+        return false;
+    }
+    int rel;
+    if(info->imm_size == 1) {
+        rel = (signed char)insn[info->imm_offset];
+    }
+    else {
+        memcpy(&rel, insn + info->imm_offset, 4);
+    }
+    unsigned long next = address + len, target = next + (long)rel;
+    unsigned char op = insn[info->imm_offset - 1];
+    bool two_byte = info->imm_offset >= 2 && insn[info->imm_offset - 2] == 0x0F;
+    if(op == 0xE8)                                                                          // call: push the real return address, then jmp
+    {
+        emitBytes(code, "\x50\x48\xB8", 3); emit64(code, next);                             // push rax; movabs rax, next
+        emitBytes(code, "\x48\x87\x04\x24", 4);                                             // xchg [rsp], rax
+    }
+    else if((op & 0xF0) == 0x70 || (two_byte && (op & 0xF0) == 0x80))
+    {
+        unsigned char skip[2] = { 0x70 | (op & 0x0F), 14 };                                 // jcc over the jmp back
+        emitBytes(code, skip, 2);
+        emitBytes(code, "\xFF\x25\x00\x00\x00\x00", 6); emit64(code, next);
+    }
+    else if(op != 0xE9 && op != 0xEB) {
+        return false;
+    }
+    emitBytes(code, "\xFF\x25\x00\x00\x00\x00", 6);                                         // jmp [rip + 0]
+    emit64(code, target);
+    return true;
+}
+
+// Name: displacedCopy
+// The copy of the instruction under bp (an inserted int3), made on its first hit
+// Returns its remote address, 0 if bp has to be stepped over in place.
+unsigned long displacedCopy(RemoteMem* mem, Breakpoint* bp)
+{
+    if(bp->displaced != 0) {
+        return bp->displaced == DISPLACED_NONE ? 0 : bp->displaced;
+    }
+    bp->displaced = DISPLACED_NONE;
+    if(mem->displaced_area == 0 || (unsigned long)(mem->displaced_used + 1) * DISPLACED_SLOT_SIZE > DISPLACED_AREA_SIZE) {
+        return 0;
+    }
+    unsigned char insn[MAX_INSN_LEN];
+    RemoteIov read = { bp->address, insn, sizeof(insn) };
+    if(!remoteRead(mem, &read, 1, true)) {
+        return 0;
+    }
+    insn[0] = bp->orig_byte;                                                                // our int3 is in the text
+    InsnInfo info;
+    int len = decodeInsn(insn, sizeof(insn), &info);
+    if(len < 0 || insn[0] == 0xCC) {
+        return 0;
+    }
+    if(info.modrm_offset > 0 && insn[info.modrm_offset - 1] == 0xFF &&
+       (((insn[info.modrm_offset] >> 3) & 7) == 2 || ((insn[info.modrm_offset] >> 3) & 7) == 3)) {
+        return 0;                                                                           // call r/m
+    }
+
+    unsigned char buf[DISPLACED_SLOT_SIZE];
+    CodeBuf code = { buf, 0, sizeof(buf), mem->displaced_area + mem->displaced_used * DISPLACED_SLOT_SIZE };
+    if(info.relative_branch)
+    {
+        if(!displacedBranch(&code, insn, len, &info, bp->address) || code.len > code.capacity) {
+            return 0;
+        }
+    }
+    else
+    {
+        emitBytes(&code, insn, len);
+        if(info.rip_relative)                                                               // same target from the new place
+        {
+            int disp;
+            memcpy(&disp, insn + info.disp_offset, 4);
+            long moved = (long)disp + (long)(bp->address - code.remote);
+            if(moved != (int)moved) {
+                return 0;
+            }
+            disp = (int)moved;
+            memcpy(buf + info.disp_offset, &disp, 4);
+        }
+        emitBytes(&code, "\xFF\x25\x00\x00\x00\x00", 6);                                    // jmp [rip + 0]
+        emit64(&code, bp->address + len);                                                   // (works from anywhere)
+    }
+    if(!remoteWrite(mem, code.remote, buf, code.len)) {
+        return 0;
+    }
+    mem->displaced_used++;
+    bp->displaced = code.remote;
+    return code.remote;
+}
+
+// Name: openTrace
+// --trace: creates the file, its header lists funcs in command line order (func_id = index) with their link time
+// addresses
+// Returns false if the file can't be made.
+bool openTrace(const char* exe, TracedFunc* funcs, int func_num)
+{
+    char** names = malloc(func_num * sizeof(char*));
+    uint64_t* addresses = malloc(func_num * sizeof(uint64_t));
+    bool* is_dyn = malloc(func_num * sizeof(bool));
+    bool ok = names != NULL && addresses != NULL && is_dyn != NULL;
+    for(int f = 0; ok && f < func_num; f++)
+    {
+        names[f] = funcs[f].name;
+        addresses[f] = funcs[f].address;
+        is_dyn[f] = funcs[f].is_dyn;
+    }
+    ok = ok && prfTraceOpen(&trace, options.trace_path, exe, func_num, names, addresses, is_dyn, 0);
+    free(names);
+    free(addresses);
+    free(is_dyn);
+    return ok;
+}
 
+// Name: finishReport
+// After the target exited: the summary / latency report (if asked for), the end of the trace, and cleanup
+void finishReport(TracedFunc* funcs, int func_num)
+{
+    if(options.trace_path != NULL &&
+       (!prfTraceSetOverhead(&trace, stats.stop_overhead) || !prfTraceClose(&trace)) && !trace_failed) {   // the last block
+        printf("PRF:: can't write the trace to %s! :(\n", options.trace_path);
+    }
+    if(options.summary) {
+        printSummary(funcs, func_num);
+    }
+    if(options.latency) {
+        printLatency(funcs, func_num);
+    }
+    for(int f = 0; f < func_num; f++)
+    {
+        free(funcs[f].ret_stats);
+        free(funcs[f].latency);
+    }
+    free(funcs);
+}
+
+// Name: parseOptions
+// Recieves main's args, fills the global options
+// Returns the index of the first non option arg (the function name). Exits on an unknown option.
+int parseOptions(int argc, char* argv[])
+{
+    options.cache_dir = getenv("PRF_CACHE_DIR");
+    int i = 1;
+    for(; i < argc && strncmp(argv[i], "--", 2) == 0; i++)
+    {
+        if(strncmp(argv[i], "--cache-dir=", 12) == 0) {
+            options.cache_dir = argv[i] + 12;
+        }
+        else if(strcmp(argv[i], "--backend=ptrace") == 0) {
+            options.backend = BACKEND_PTRACE;
+        }
+        else if(strcmp(argv[i], "--backend=preload") == 0) {
+            options.backend = BACKEND_PRELOAD;
+        }
+        else if(strcmp(argv[i], "--backend=trampoline") == 0) {
+            options.backend = BACKEND_TRAMPOLINE;
+        }
+        else if(strcmp(argv[i], "--backend=hwbp") == 0) {
+            options.backend = BACKEND_HWBP;
+        }
+        else if(strncmp(argv[i], "--agent=", 8) == 0) {
+            options.agent_path = argv[i] + 8;
+        }
+        else if(strncmp(argv[i], "--index-threads=", 16) == 0) {
+            options.index_threads = atol(argv[i] + 16);
+        }
+        else if(strcmp(argv[i], "--lib-calls") == 0) {
+            options.lib_calls = true;
+        }
+        else if(strcmp(argv[i], "--elf=auto") == 0) {
+            options.elf_mode = ELF_AUTO;
+        }
+        else if(strcmp(argv[i], "--elf=map") == 0) {
+            options.elf_mode = ELF_MAP;
+        }
+        else if(strcmp(argv[i], "--elf=pread") == 0) {
+            options.elf_mode = ELF_PREAD;
+        }
+        else if(strcmp(argv[i], "--peekpoke") == 0) {
+            options.peekpoke = true;
+        }
+        else if(strcmp(argv[i], "--syscall-stats") == 0) {
+            options.syscall_stats = true;
+        }
+        else if(strcmp(argv[i], "--nested") == 0) {
+            options.nested = true;
+        }
+        else if(strncmp(argv[i], "--pid=", 6) == 0)
+        {
+            char* end;
+            errno = 0;
+            long pid = strtol(argv[i] + 6, &end, 10);
+            if(end == argv[i] + 6 || *end != '\0' || errno != 0 || pid <= 0 || pid > INT_MAX) {
+                printf("PRF:: --pid=PID needs a process id, not %s\n", argv[i] + 6);
+                exit(1);
+            }
+            options.attach_pid = pid;
+        }
+        else if(strcmp(argv[i], "--latency") == 0) {
+            options.latency = true;
+        }
+        else if(strncmp(argv[i], "--sample=", 9) == 0) {
+            options.sample_every = atol(argv[i] + 9);
+        }
+        else if(strncmp(argv[i], "--sample-duty=", 14) == 0)
+        {
+            if(sscanf(argv[i] + 14, "%ld/%ld", &options.sample_on_ms, &options.sample_period_ms) != 2 ||
+               options.sample_on_ms <= 0 || options.sample_on_ms >= options.sample_period_ms) {
+                printf("PRF:: --sample-duty=ON/PERIOD needs 0 < ON < PERIOD (ms)\n");
+                exit(1);
+            }
+        }
+        else if(strncmp(argv[i], "--max-overhead=", 15) == 0)
+        {
+            options.max_overhead = atof(argv[i] + 15) / 100;                                // "5%" or "5"
+            if(options.max_overhead <= 0 || options.max_overhead >= 1) {
+                printf("PRF:: --max-overhead=P%% needs 0 < P < 100\n");
+                exit(1);
+            }
+        }
+        else if(strncmp(argv[i], "--trace=", 8) == 0) {
+            options.trace_path = argv[i] + 8;
+        }
+        else if(strncmp(argv[i], "--trace-args=", 13) == 0)
+        {
+            options.trace_args = atoi(argv[i] + 13);
+            if(options.trace_args < 0 || options.trace_args > PRF_TRACE_MAX_ARGS) {
+                printf("PRF:: --trace-args=N needs 0 <= N <= %d\n", PRF_TRACE_MAX_ARGS);
+                exit(1);
+            }
+        }
+        else if(strcmp(argv[i], "--summary") == 0) {
+            options.summary = true;
+        }
+        else if(strncmp(argv[i], "--summary-every=", 16) == 0) {
+            options.summary = true;
+            options.summary_every = atol(argv[i] + 16);
+        }
+        else {
+            printf("PRF:: unknown option %s\n", argv[i]);
+            exit(1);
+        }
+    }
+    if(options.cache_dir != NULL && options.cache_dir[0] == '\0') {
+        options.cache_dir = NULL;
+    }
+    return i;
+}
+
+// This is MAIN
+int main(int argc, char *argv[])
+{
+    int first_arg = parseOptions(argc, argv);                                               // prf [options] func[,func...] prog [args...]
+    if(argc - first_arg < (options.attach_pid != 0 ? 1 : 2)) {                              // prf [options] --pid=PID func[,func...]
+        return 1;
+    }
+    char* file_name = argv[first_arg + 1];                                                  // save name of executable file
+    char exe_path[32];
+    if(options.attach_pid != 0)
+    {
+        sprintf(exe_path, "/proc/%d/exe", options.attach_pid);                              // whatever it's running, even if deleted since
+        file_name = exe_path;
+    }
+    char* func_names = argv[first_arg];                                                     // save name(s) of function(s) to run - "foo" or "foo,bar,baz"
+
+    int func_num = 1;
+    for(char* c = func_names; *c; c++) {
+        func_num += (*c == FUNC_LIST_SEPARATOR);
+    }
+    TracedFunc* funcs = calloc(func_num, sizeof(TracedFunc));
+    if(funcs == NULL) {
+        return 1;
+    }
+    for(int f = 0; f < func_num; f++)                                                       // split the list in place
+    {
+        funcs[f].name = func_names;
+        func_names = strchr(func_names, FUNC_LIST_SEPARATOR);
+        if(func_names != NULL) {
+            *func_names++ = '\0';
+        }
+        if(funcs[f].name[0] == '\0') {                                                      // "foo,,bar" / "foo,"
+            printf("PRF:: empty function name in the list! :(\n");
+            return 1;
+        }
+        for(int g = 0; g < f; g++)
+        {
+            if(strcmp(funcs[g].name, funcs[f].name) == 0) {                                 // two entry breakpoints on one address
+                printf("PRF:: %s is in the list twice! :(\n", funcs[f].name);
+                return 1;
+            }
+        }
+    }
+    
+    ElfImage elf;                                                                           // the one open + mmap of the file, for every ELF pass
+    if (!elfOpen(&elf, file_name) || checkExecutable(&elf) != SUCCESS)                      // part 1 - check if the file is an executable
+    {
+        printf("PRF:: %s not an executable! :(\n",  file_name);  
+        return 1;
+    }                  
+                                                                                      
+    if (checkFunction(&elf, funcs, func_num) == ERROR){
+        return 1;
+    }
+    if(options.syscall_stats)                                                               // what reading the file cost (it's all we did so far)
+    {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        char how[64] = "mapped";
+        if(elf.streamed) {
+            snprintf(how, sizeof(how), "pread %lu KB", elf.bytes_read >> 10);
+        }
+        fprintf(stderr, "PRF:: ELF %s (%lu MB): %s, peak RSS %ld KB, %ld minor / %ld major page faults\n",
+                file_name, elf.size >> 20, how, usage.ru_maxrss, usage.ru_minflt, usage.ru_majflt);
+    }
+
+    int traced_num = 0;
+    for(int f = 0; f < func_num; f++)
+    {
+        if (funcs[f].status == ERROR){
+            return 1;
+        }
+        if (funcs[f].status == SYM_NOT_FOUND){                                              // part 2 - check if func exists
+            printf("PRF:: %s not found!\n", funcs[f].name);
+        }
+        if (funcs[f].status == SYM_NOT_GLOBAL){                                             // part 3 - check if func is global
+            printf("PRF:: %s is not a global symbol! :(\n", funcs[f].name);
+        }
+        traced_num += (funcs[f].status == SUCCESS);
+    }
+    if (traced_num == 0){                                                                   // nothing left to trace
+        return 1;
+    }
+
+    if(options.latency && (options.backend == BACKEND_PRELOAD || options.backend == BACKEND_TRAMPOLINE)) {
+        printf("PRF:: --latency works with the ptrace and hwbp backends only! :(\n");
+        return 1;
+    }
+    if((options.sample_every > 1 || options.sample_period_ms > 0 || options.max_overhead > 0) &&
+       (options.backend == BACKEND_PRELOAD || options.backend == BACKEND_TRAMPOLINE)) {
+        printf("PRF:: --sample / --max-overhead work with the ptrace and hwbp backends only! :(\n");
+        return 1;
+    }
+    if((options.sample_period_ms > 0 || options.max_overhead > 0) && options.peekpoke) {   // POKETEXT needs a stopped thread
+        printf("PRF:: --sample-duty / --max-overhead need the mem file - no --peekpoke! :(\n");
+        return 1;
+    }
+
+    if(options.trace_args > 0 && (options.trace_path == NULL || options.backend == BACKEND_PRELOAD ||
+                                  options.backend == BACKEND_TRAMPOLINE)) {
+        printf("PRF:: --trace-args needs --trace and the ptrace or hwbp backend! :(\n");
+        return 1;
+    }
+    if(options.trace_path != NULL && !openTrace(file_name, funcs, func_num)) {           // before --pid moves the addresses
+        printf("PRF:: can't create the trace %s! :(\n", options.trace_path);
+        return 1;
+    }
+
+    unsigned long debug_slot = debugSlot(&elf), exe_start, exe_end;
+    loadRange(&elf, &exe_start, &exe_end);
+    for(int f = 0; f < func_num; f++)
+    {
+        if(funcs[f].is_dyn && !options.lib_calls)
+        {
+            funcs[f].caller_start = exe_start;
+            funcs[f].caller_end = exe_end;
+        }
+    }
+    if(options.attach_pid != 0)
+    {
+        unsigned long bias;
+        if(options.backend == BACKEND_PRELOAD || options.backend == BACKEND_TRAMPOLINE) {
+            printf("PRF:: --pid works with the ptrace and hwbp backends only! :(\n");
+            return 1;
+        }
+        bool mapped = loadBias(options.attach_pid, &elf, &bias);
+        elfClose(&elf);
+        if(!mapped) {
+            printf("PRF:: can't find %s in the memory of %d! :(\n", file_name, options.attach_pid);
+            return 1;
+        }
+        for(int f = 0; f < func_num; f++)
+        {
+            funcs[f].address += bias;
+            if(funcs[f].got_offset != 0) {
+                funcs[f].got_offset += bias;
+            }
+        }
+        for(int f = 0; f < func_num; f++)
+        {
+            if(funcs[f].caller_end != 0)
+            {
+                funcs[f].caller_start += bias;
+                funcs[f].caller_end += bias;
+            }
+        }
+        debug_slot += (debug_slot != 0) ? bias : 0;
+        loopSignalAdd(SIGINT);                                                              // they wake up the event loop (see loopWait)
+        loopSignalAdd(SIGTERM);
+        Debug(options.attach_pid, funcs, func_num, debug_slot);
+        finishReport(funcs, func_num);
+        return 0;
+    }
+
+    elfClose(&elf);                                                                         // everything it had is in funcs now
 
+    if(options.backend == BACKEND_PRELOAD)
+    {
+        for(int f = 0; f < func_num; f++)
+        {
+            if(funcs[f].status == SUCCESS && !funcs[f].is_dyn) {                            // the agent can only hook imports
+                printf("PRF:: %s is not a dynamic symbol - the preload backend can't trace it! :(\n", funcs[f].name);
+                return 1;
+            }
+        }
+        if(func_num > AGENT_MAX_FUNCS) {
+            printf("PRF:: the preload backend traces at most %d functions! :(\n", AGENT_MAX_FUNCS);
+            return 1;
+        }
+        bool ran = runPreload(file_name, argv + first_arg + 1, funcs, func_num);
+        finishReport(funcs, func_num);
+        return ran ? 0 : 1;
+    }
+
+    if(options.backend == BACKEND_TRAMPOLINE)
+    {
+        for(int f = 0; f < func_num; f++)
+        {
+            if(funcs[f].status == SUCCESS && funcs[f].is_dyn) {                             // not loaded yet at the exec stop
+                printf("PRF:: %s is a dynamic symbol - use the preload backend! :(\n", funcs[f].name);
+                return 1;
+            }
+        }
+        if(func_num > TRAMP_MAX_FUNCS) {
+            printf("PRF:: the trampoline backend traces at most %d functions! :(\n", TRAMP_MAX_FUNCS);
+            return 1;
+        }
+        bool ran = runTrampoline(file_name, argv + first_arg + 1, funcs, func_num);
+        finishReport(funcs, func_num);
+        return ran ? 0 : 1;
+    }
+
+    pid_t child_pid = runTarget(file_name, argv + first_arg + 1);
+    Debug(child_pid, funcs, func_num, debug_slot);
+    finishReport(funcs, func_num);
+    return 0;
+}
@@ -0,0 +1,213 @@
+// =====================================================================================================================================
+// prf preload agent - the in-process backend of prf (prf --backend=preload func prog ...)
+//
+// Build:   gcc -std=c99 -O2 -shared -fPIC prf_agent.c -o libprfagent.so -ldl
+//
+// prf starts the target with LD_PRELOAD=libprfagent.so and tells us (env) which functions to trace and which fd is
+// the shared ring (prf_ring.h). Our constructor points every GOT slot that imports one of those functions (PLT
+// calls and function pointers, in the executable AND in every loaded library) at a hook, and the hook calls the real
+// function and pushes (call index, return value, timestamp) into the ring. No ptrace, no stops.
+//
+// Limits: only integer / pointer arguments in registers are passed on (up to 6) - the same functions prf can
+// print a return value for. Calls that don't go through a GOT slot (inside the defining library with
+// -fno-semantic-interposition / protected symbols) are not seen. A patched slot under full RELRO is made read only
+// again right after the write, but its page is writable for that moment (another thread could write it too).
+// =====================================================================================================================================
+#define _GNU_SOURCE
+#include "prf_ring.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <sys/mman.h>
+#include <stdbool.h>
+
+#define PRF_AGENT_MAX_FUNCS 8
+#define R_X86_64_GLOB_DAT 6
+#define R_X86_64_JUMP_SLOT 7
+
+typedef long (*RealFunc)(long, long, long, long, long, long);
+
+typedef struct {
+    const char* name;
+    RealFunc real;
+    uint64_t calls;
+} AgentFunc;
+
+static PrfRing* ring;
+static AgentFunc funcs[PRF_AGENT_MAX_FUNCS];
+static int func_num;
+static __thread int depth[PRF_AGENT_MAX_FUNCS];                                             // like prf's int3 backend: a call inside a call isn't reported
+
+static inline uint64_t nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);                                                    // vDSO - no syscall
+    return (uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// Name: hookCall
+// The body of every hook: call the real thing, report the outermost call
+static inline long hookCall(int id, long a, long b, long c, long d, long e, long f)
+{
+    AgentFunc* func = &funcs[id];
+    if(depth[id] > 0) {
+        return func->real(a, b, c, d, e, f);
+    }
+
+    uint64_t index = __atomic_add_fetch(&func->calls, 1, __ATOMIC_RELAXED);
+    depth[id]++;
+    long ret = func->real(a, b, c, d, e, f);
+    depth[id]--;
+
+    PrfRecord rec = { (uint32_t)id, 0, index, ret, nowNs() };
+    prfRingPush(ring, &rec, PRF_RING_SPINS);
+    return ret;
+}
+
+// One hook per traced function - the hook has to know which real function it stands for
+#define DEFINE_HOOK(id) \
+    static long hook##id(long a, long b, long c, long d, long e, long f) { return hookCall(id, a, b, c, d, e, f); }
+DEFINE_HOOK(0) DEFINE_HOOK(1) DEFINE_HOOK(2) DEFINE_HOOK(3)
+DEFINE_HOOK(4) DEFINE_HOOK(5) DEFINE_HOOK(6) DEFINE_HOOK(7)
+static RealFunc hooks[PRF_AGENT_MAX_FUNCS] = { hook0, hook1, hook2, hook3, hook4, hook5, hook6, hook7 };
+
+// Name: dynPtr
+// d_ptr values in a loaded object's dynamic section are usually relocated by ld.so already, but not always (vdso)
+static inline unsigned long dynPtr(struct dl_phdr_info* info, unsigned long ptr)
+{
+    return ptr < info->dlpi_addr ? ptr + info->dlpi_addr : ptr;
+}
+
+// Name: patchSlot
+// Points one GOT slot at a hook. Slots in [relro_start, relro_end) are read only by now (ld.so protected the
+// object's PT_GNU_RELRO pages) - open the page up for the write and close it again after.
+static void patchSlot(unsigned long* slot, RealFunc hook, unsigned long relro_start, unsigned long relro_end)
+{
+    long page_size = sysconf(_SC_PAGESIZE);
+    void* page = (void*)((unsigned long)slot & ~(page_size - 1));
+    if(*slot == (unsigned long)hook) {
+        return;
+    }
+    if(mprotect(page, page_size, PROT_READ | PROT_WRITE) != 0) {
+        return;
+    }
+    *slot = (unsigned long)hook;
+    if((unsigned long)slot >= relro_start && (unsigned long)slot < relro_end) {
+        mprotect(page, page_size, PROT_READ);                                               // keep full RELRO
+    }
+}
+
+// Name: patchRelocs
+// Goes over one relocation table of an object and patches the slots that import a traced function
+static void patchRelocs(struct dl_phdr_info* info, Elf64_Rela* relocs, unsigned long size, Elf64_Sym* symtab, const char* strtab,
+                        unsigned long relro_start, unsigned long relro_end)
+{
+    for(unsigned long i = 0; i < size / sizeof(Elf64_Rela); i++)
+    {
+        unsigned long type = ELF64_R_TYPE(relocs[i].r_info);
+        if(type != R_X86_64_JUMP_SLOT && type != R_X86_64_GLOB_DAT) {
+            continue;
+        }
+        const char* name = strtab + symtab[ELF64_R_SYM(relocs[i].r_info)].st_name;
+        for(int f = 0; f < func_num; f++)
+        {
+            if(funcs[f].real != NULL && strcmp(name, funcs[f].name) == 0) {
+                patchSlot((unsigned long*)(info->dlpi_addr + relocs[i].r_offset), hooks[f], relro_start, relro_end);
+            }
+        }
+    }
+}
+
+// Name: patchObject
+// dl_iterate_phdr callback - every loaded object but ourselves
+static int patchObject(struct dl_phdr_info* info, size_t size, void* self)
+{
+    (void)size;
+    Dl_info self_info;
+    if(dladdr(self, &self_info) && self_info.dli_fbase == (void*)info->dlpi_addr) {
+        return 0;
+    }
+
+    unsigned long page_mask = ~(sysconf(_SC_PAGESIZE) - 1), relro_start = 0, relro_end = 0;
+    for(int p = 0; p < info->dlpi_phnum; p++)
+    {
+        if(info->dlpi_phdr[p].p_type == PT_GNU_RELRO)                                       // the whole pages in it, as ld.so protects them
+        {
+            relro_start = (info->dlpi_addr + info->dlpi_phdr[p].p_vaddr) & page_mask;
+            relro_end = (info->dlpi_addr + info->dlpi_phdr[p].p_vaddr + info->dlpi_phdr[p].p_memsz) & page_mask;
+        }
+    }
+    for(int p = 0; p < info->dlpi_phnum; p++)
+    {
+        if(info->dlpi_phdr[p].p_type != PT_DYNAMIC) {
+            continue;
+        }
+        Elf64_Dyn* dyn = (Elf64_Dyn*)(info->dlpi_addr + info->dlpi_phdr[p].p_vaddr);
+        Elf64_Sym* symtab = NULL;
+        const char* strtab = NULL;
+        Elf64_Rela *jmprel = NULL, *rela = NULL;
+        unsigned long jmprel_size = 0, rela_size = 0;
+        for(; dyn->d_tag != DT_NULL; dyn++)
+        {
+            switch(dyn->d_tag)
+            {
+                case DT_SYMTAB:   symtab = (Elf64_Sym*)dynPtr(info, dyn->d_un.d_ptr); break;
+                case DT_STRTAB:   strtab = (const char*)dynPtr(info, dyn->d_un.d_ptr); break;
+                case DT_JMPREL:   jmprel = (Elf64_Rela*)dynPtr(info, dyn->d_un.d_ptr); break;
+                case DT_PLTRELSZ: jmprel_size = dyn->d_un.d_val; break;
+                case DT_RELA:     rela = (Elf64_Rela*)dynPtr(info, dyn->d_un.d_ptr); break;
+                case DT_RELASZ:   rela_size = dyn->d_un.d_val; break;
+            }
+        }
+        if(symtab == NULL || strtab == NULL) {
+            continue;
+        }
+        if(jmprel != NULL) {
+            patchRelocs(info, jmprel, jmprel_size, symtab, strtab, relro_start, relro_end);  // PLT calls
+        }
+        if(rela != NULL) {
+            patchRelocs(info, rela, rela_size, symtab, strtab, relro_start, relro_end);     // function pointers through the GOT
+        }
+    }
+    return 0;
+}
+
+// Name: agentInit
+// Runs before the target's main. PRF_AGENT_FD = ring fd, PRF_AGENT_FUNCS = "foo,bar" (same order as prf's list).
+__attribute__((constructor))
+static void agentInit(void)
+{
+    const char* fd_env = getenv("PRF_AGENT_FD");
+    const char* funcs_env = getenv("PRF_AGENT_FUNCS");
+    if(fd_env == NULL || funcs_env == NULL) {
+        return;
+    }
+    int fd = atoi(fd_env);
+
+    PrfRing header;
+    if(pread(fd, &header, sizeof(header), 0) != sizeof(header) || !prfRingValid(&header)) {
+        return;
+    }
+    void* shared = mmap(NULL, prfRingBytes(header.capacity), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);                                                                              // the target shouldn't see our fd
+    if(shared == MAP_FAILED) {
+        return;
+    }
+    ring = shared;
+
+    char* names = strdup(funcs_env);
+    for(char* rest = names; rest != NULL && func_num < PRF_AGENT_MAX_FUNCS; func_num++)     // strsep: an empty name (prf's placeholder) keeps its place
+    {
+        char* name = strsep(&rest, ",");
+        funcs[func_num].name = name;
+        funcs[func_num].real = name[0] != '\0' ? (RealFunc)dlsym(RTLD_NEXT, name) : NULL;   // the definition after us in lookup order
+    }
+    unsetenv("PRF_AGENT_FD");                                                               // don't follow the target into its own children
+    unsetenv("PRF_AGENT_FUNCS");
+
+    dl_iterate_phdr(patchObject, (void*)agentInit);
+}
@@ -0,0 +1,213 @@
+// =====================================================================================================================================
+// prf-report - offline report of a binary trace (prf --trace=FILE func prog ..)
+//
+// Build:   gcc -std=c99 -O2 -pthread prf_report.c -o prf-report
+// Usage:   prf-report [--threads=N] FILE
+//
+// Per traced function: call count, return values (min / max / mean, quantiles, most returned - like prf --summary)
+// and call latency (like prf --latency, with the trace's own stop overhead taken off each call). Function names are
+// the ones prf resolved in checkFunction, from the trace header.
+//
+// The trace is mmap'd and cut into chunks of whole blocks (prfTraceSplit), a few per thread, which the threads take
+// one at a time. Every thread aggregates into its own FuncReport per function - prf's own ReturnStats and
+// LatencyStats (prf_stats.h), all of it fixed size, so a trace of any size takes the same memory - and the main
+// thread merges them at the end.
+// =====================================================================================================================================
+#define _GNU_SOURCE
+#include "prf_trace.h"
+#include "prf_stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#define CHUNKS_PER_THREAD 4                                                                 // so a thread with a slow chunk doesn't hold up the rest
+#define MAX_THREADS 256
+
+// Everything about one function, from one thread's chunks (or, merged, from all of them)
+typedef struct {
+    ReturnStats returns;
+    LatencyStats latency;                                                                   // calls with an entry time (ptrace / hwbp backends)
+} FuncReport;
+
+typedef struct {
+    const PrfTraceReader* reader;
+    const uint64_t* bounds;
+    int chunk_num;
+    int* next_chunk;                                                                        // shared, taken with a fetch-add
+    FuncReport* reports;                                                                    // this thread's, one per function
+    unsigned long records;
+    unsigned long unknown;                                                                  // records of a func_id the header doesn't have
+} Worker;
+
+// Name: reportAdd
+// One record of the function
+static void reportAdd(FuncReport* report, const PrfTraceRecord* rec, uint64_t stop_overhead)
+{
+    summaryAdd(&report->returns, rec->ret);                                                 // what prf prints
+    if(rec->exit_ns > rec->entry_ns && rec->entry_ns != 0)                                  // the preload / trampoline backends don't time calls
+    {
+        unsigned long elapsed = rec->exit_ns - rec->entry_ns;
+        latencyAdd(&report->latency, elapsed > stop_overhead ? elapsed - stop_overhead : 0);
+    }
+}
+
+// Name: reportMerge
+// Adds from into into
+static void reportMerge(FuncReport* into, const FuncReport* from)
+{
+    summaryMerge(&into->returns, &from->returns);
+    latencyMerge(&into->latency, &from->latency);
+}
+
+// Name: workerRun
+// Thread body: takes chunks until there are none left
+static void* workerRun(void* arg)
+{
+    Worker* worker = arg;
+    uint32_t func_num = worker->reader->header->func_num;
+    uint64_t stop_overhead = worker->reader->header->stop_overhead;
+    int chunk;
+    while((chunk = __atomic_fetch_add(worker->next_chunk, 1, __ATOMIC_RELAXED)) < worker->chunk_num)
+    {
+        PrfTraceReader reader = *worker->reader;                                            // a cursor of our own over the shared map
+        prfTraceRange(&reader, worker->bounds[chunk], worker->bounds[chunk + 1]);
+        PrfTraceRecord rec;
+        while(prfTraceNext(&reader, &rec))
+        {
+            worker->records++;
+            if(rec.func_id >= func_num) {
+                worker->unknown++;
+                continue;
+            }
+            reportAdd(&worker->reports[rec.func_id], &rec, stop_overhead);
+        }
+    }
+    return NULL;
+}
+
+// Name: printReport
+// Same lines as prf --summary / --latency
+static void printReport(const char* name, const FuncReport* report, uint64_t stop_overhead)
+{
+    const ReturnStats* returns = &report->returns;
+    if(returns->count == 0) {
+        return;
+    }
+    printf("PRF:: %s: %lu runs, min %d, max %d, mean %.2f\n", name, returns->count,
+           returns->min, returns->max, (double)returns->sum / returns->count);
+    printf("PRF:: %s: p50 %ld, p90 %ld, p99 %ld, p99.9 %ld\n", name, summaryQuantile(returns, 0.5),
+           summaryQuantile(returns, 0.9), summaryQuantile(returns, 0.99), summaryQuantile(returns, 0.999));
+
+    TopKCounter top[SUMMARY_TOPK_SLOTS];
+    memcpy(top, returns->top, returns->top_num * sizeof(TopKCounter));
+    qsort(top, returns->top_num, sizeof(TopKCounter), topKCompare);
+    printf("PRF:: %s: most returned:", name);
+    for(int i = 0; i < returns->top_num && i < SUMMARY_TOPK_PRINT; i++)
+    {
+        if(top[i].error == 0) {
+            printf(" %d x%lu", top[i].value, top[i].count);
+        }
+        else {
+            printf(" %d x%lu..%lu", top[i].value, top[i].count - top[i].error, top[i].count);
+        }
+    }
+    printf("\n");
+
+    const LatencyStats* latency = &report->latency;
+    if(latency->hist.count == 0) {
+        return;
+    }
+    printf("PRF:: %s: latency ns: min %lu, mean %.0f, max %lu (%lu ns stop overhead taken off each)\n", name,
+           latency->min, (double)latency->sum / latency->hist.count, latency->max, (unsigned long)stop_overhead);
+    printf("PRF:: %s: latency ns: p50 %lu, p90 %lu, p99 %lu, p99.9 %lu\n", name, latencyQuantile(latency, 0.5),
+           latencyQuantile(latency, 0.9), latencyQuantile(latency, 0.99), latencyQuantile(latency, 0.999));
+}
+
+// This is MAIN
+int main(int argc, char* argv[])
+{
+    long thread_num = sysconf(_SC_NPROCESSORS_ONLN);
+    int i = 1;
+    for(; i < argc && strncmp(argv[i], "--", 2) == 0; i++)
+    {
+        if(strncmp(argv[i], "--threads=", 10) == 0) {
+            thread_num = atol(argv[i] + 10);
+        }
+        else {
+            printf("PRF:: unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if(argc - i != 1) {
+        printf("usage: prf-report [--threads=N] FILE\n");
+        return 1;
+    }
+    if(thread_num < 1) {
+        thread_num = 1;
+    }
+    if(thread_num > MAX_THREADS) {
+        thread_num = MAX_THREADS;
+    }
+
+    PrfTraceReader reader;
+    if(!prfTraceMap(&reader, argv[i])) {
+        printf("PRF:: %s is not a prf trace! :(\n", argv[i]);
+        return 1;
+    }
+    uint32_t func_num = reader.header->func_num;
+    int chunk_num = thread_num * CHUNKS_PER_THREAD;
+    uint64_t* bounds = malloc((chunk_num + 1) * sizeof(uint64_t));
+    Worker* workers = calloc(thread_num, sizeof(Worker));
+    pthread_t* tids = malloc(thread_num * sizeof(pthread_t));
+    if(bounds == NULL || workers == NULL || tids == NULL) {
+        return 1;
+    }
+    prfTraceSplit(&reader, chunk_num, bounds);
+
+    int next_chunk = 0;
+    for(long t = 0; t < thread_num; t++)
+    {
+        workers[t] = (Worker){ &reader, bounds, chunk_num, &next_chunk, calloc(func_num, sizeof(FuncReport)), 0, 0 };
+        if(workers[t].reports == NULL) {
+            return 1;
+        }
+    }
+    long started = 1;                                                                       // worker 0 is us
+    for(; started < thread_num; started++)
+    {
+        if(pthread_create(&tids[started], NULL, workerRun, &workers[started]) != 0) {
+            break;                                                                          // the ones we have take all the chunks
+        }
+    }
+    workerRun(&workers[0]);
+    unsigned long records = workers[0].records, unknown = workers[0].unknown;
+    for(long t = 1; t < started; t++)
+    {
+        pthread_join(tids[t], NULL);
+        records += workers[t].records;
+        unknown += workers[t].unknown;
+        for(uint32_t f = 0; f < func_num; f++) {
+            reportMerge(&workers[0].reports[f], &workers[t].reports[f]);
+        }
+    }
+
+    printf("PRF:: %s: %lu calls of %s, %ld threads\n", argv[i], records, reader.names + reader.header->exe_offset, started);
+    if(unknown > 0) {
+        printf("PRF:: %lu records of unknown functions skipped\n", unknown);
+    }
+    for(uint32_t f = 0; f < func_num; f++) {
+        printReport(prfTraceFuncName(&reader, f), &workers[0].reports[f], reader.header->stop_overhead);
+    }
+
+    for(long t = 0; t < thread_num; t++) {
+        free(workers[t].reports);
+    }
+    free(workers);
+    free(tids);
+    free(bounds);
+    prfTraceUnmap(&reader);
+    return 0;
+}
@@ -0,0 +1,122 @@
+#ifndef _PRF_RING_H_
+#define _PRF_RING_H_ 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sched.h>
+
+// =====================================================================================================================================
+// Shared memory ring between prf and code that runs inside the traced process (the preload agent, prf_agent.c).
+// prf makes it on a memfd before the fork and the child inherits the fd.
+//
+// A bounded ring with a sequence number per slot: the slot of position pos is free when seq == pos, and holds the
+// record of pos when seq == pos + 1. One consumer (prf). A producer takes its position with one compare and swap,
+// so the threads of a multi-threaded target can share one ring - with a single thread it's a plain SPSC ring that
+// costs one uncontended atomic per record.
+// =====================================================================================================================================
+
+#define PRF_RING_MAGIC 0x31474e4952465250UL                                                 // "PRFRING1"
+#define PRF_RING_CACHELINE 64
+#define PRF_RING_SPINS 100000                                                               // yields a producer waits on a full ring before it drops
+
+typedef struct {
+    uint32_t func_id;                                                                       // index of the function in prf's list
+    uint32_t reserved;
+    uint64_t call_index;                                                                    // 1 based, per function
+    int64_t ret;                                                                            // rax on return
+    uint64_t timestamp;                                                                     // CLOCK_MONOTONIC ns at return
+} PrfRecord;
+
+typedef struct {
+    uint64_t seq;
+    PrfRecord rec;
+} PrfSlot;
+
+typedef struct {
+    uint64_t magic;
+    uint32_t capacity;                                                                      // power of 2
+    uint32_t record_size;                                                                   // sizeof(PrfRecord) - a cheap version check
+    uint64_t dropped;                                                                       // records producers gave up on (ring stayed full)
+    char pad0[PRF_RING_CACHELINE - 24];
+    uint64_t head;                                                                          // next position to produce
+    char pad1[PRF_RING_CACHELINE - 8];
+    uint64_t tail;                                                                          // next position to consume (only the consumer writes it)
+    char pad2[PRF_RING_CACHELINE - 8];
+    PrfSlot slots[];
+} PrfRing;
+
+static inline uint64_t prfRingBytes(uint32_t capacity)
+{
+    return sizeof(PrfRing) + (uint64_t)capacity * sizeof(PrfSlot);
+}
+
+// Name: prfRingInit
+// Consumer side, before anybody produces
+static inline void prfRingInit(PrfRing* ring, uint32_t capacity)
+{
+    ring->magic = PRF_RING_MAGIC;
+    ring->capacity = capacity;
+    ring->record_size = sizeof(PrfRecord);
+    ring->dropped = 0;
+    ring->head = 0;
+    ring->tail = 0;
+    for(uint32_t i = 0; i < capacity; i++) {
+        ring->slots[i].seq = i;
+    }
+}
+
+static inline bool prfRingValid(const PrfRing* ring)
+{
+    return ring->magic == PRF_RING_MAGIC && ring->record_size == sizeof(PrfRecord) &&
+           ring->capacity != 0 && (ring->capacity & (ring->capacity - 1)) == 0;
+}
+
+// Name: prfRingPush
+// Producer side. While the ring is full we yield (we'd rather slow the target down than lose records), but only
+// max_spins times - if the consumer is gone the target must not hang. A position is only taken (compare and swap)
+// while there is room for it, so its slot is always free by then: no producer waits on a slot, and giving up never
+// leaves a hole the consumer would wait on.
+// Returns false if the record was dropped.
+static inline bool prfRingPush(PrfRing* ring, const PrfRecord* rec, unsigned long max_spins)
+{
+    uint64_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    for(unsigned long spins = 0; ; )
+    {
+        if(pos - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) < ring->capacity)
+        {
+            if(__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+            continue;                                                                       // another producer took it - pos is the new head
+        }
+        if(spins++ == max_spins) {
+            __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+        sched_yield();
+        pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    }
+
+    PrfSlot* slot = &ring->slots[pos & (ring->capacity - 1)];                              // seq == pos: the tail we saw is past its last lap
+    slot->rec = *rec;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Name: prfRingPop
+// Consumer side
+// Returns false if the next record isn't there (yet).
+static inline bool prfRingPop(PrfRing* ring, PrfRecord* rec)
+{
+    uint64_t pos = ring->tail;
+    PrfSlot* slot = &ring->slots[pos & (ring->capacity - 1)];
+    if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1) {
+        return false;
+    }
+    *rec = slot->rec;
+    __atomic_store_n(&slot->seq, pos + ring->capacity, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->tail, pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+#endif /* !_PRF_RING_H_ */
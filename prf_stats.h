@@ -0,0 +1,286 @@
+#ifndef _PRF_STATS_H_
+#define _PRF_STATS_H_ 1
+
+#include <stdlib.h>
+#include <string.h>
+
+// =====================================================================================================================================
+// Fixed memory statistics of return values and call times - prf (--summary / --latency) and prf-report keep the
+// same ones, so they print the same numbers.
+//
+//   count / min / max / mean                  exact
+//   quantiles                                 log-linear histogram, within 1/HIST_SUB_BUCKETS of the real value
+//   most frequent return values               Space-Saving over SUMMARY_TOPK_SLOTS counters - exact as long as there
+//                                             were no more distinct values than counters, else count - error <= real <= count
+//
+// Two of them merge (prf-report: one per thread): histograms just add up, the Space-Saving counters merge the way
+// mergeable summaries do (a value one side doesn't have gets that side's smallest count as count and error).
+// =====================================================================================================================================
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)                                               // per power of 2 - quantiles are off by < 1/16
+#define HIST_BUCKETS (HIST_SUB_BUCKETS + (64 - HIST_SUB_BITS) * HIST_SUB_BUCKETS)           // covers all of 64 bits
+#define SUMMARY_TOPK_SLOTS 32
+#define SUMMARY_TOPK_PRINT 8
+
+// Log-linear histogram of unsigned values (see histBucket)
+typedef struct {
+    unsigned long count;
+    unsigned long buckets[HIST_BUCKETS];
+} LogHistogram;
+
+// One Space-Saving counter - the real count of value is in [count - error, count]
+typedef struct {
+    int value;
+    unsigned long count;
+    unsigned long error;
+} TopKCounter;
+
+// --summary state of one function
+typedef struct {
+    unsigned long count;
+    int min;
+    int max;
+    long sum;
+    LogHistogram negative;                                                                  // by magnitude
+    LogHistogram positive;                                                                  // and zero
+    int top_num;
+    TopKCounter top[SUMMARY_TOPK_SLOTS];
+} ReturnStats;
+
+// --latency state of one function, in ns
+typedef struct {
+    unsigned long min;
+    unsigned long max;
+    unsigned long sum;
+    LogHistogram hist;
+} LatencyStats;
+
+// Name: histBucket
+// Values below HIST_SUB_BUCKETS get a bucket each, after that every power of 2 is split in HIST_SUB_BUCKETS
+static inline int histBucket(unsigned long value)
+{
+    if(value < HIST_SUB_BUCKETS) {
+        return value;
+    }
+    int exponent = 63 - __builtin_clzl(value);                                              // >= HIST_SUB_BITS
+    int sub = (value >> (exponent - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1);
+    return HIST_SUB_BUCKETS + (exponent - HIST_SUB_BITS) * HIST_SUB_BUCKETS + sub;
+}
+
+// Name: histBucketValue
+// The smallest value that lands in bucket
+static inline unsigned long histBucketValue(int bucket)
+{
+    if(bucket < HIST_SUB_BUCKETS) {
+        return bucket;
+    }
+    int exponent = (bucket - HIST_SUB_BUCKETS) / HIST_SUB_BUCKETS + HIST_SUB_BITS;
+    unsigned long sub = (bucket - HIST_SUB_BUCKETS) % HIST_SUB_BUCKETS;
+    return (HIST_SUB_BUCKETS + sub) << (exponent - HIST_SUB_BITS);
+}
+
+static inline void histAdd(LogHistogram* hist, unsigned long value)
+{
+    hist->buckets[histBucket(value)]++;
+    hist->count++;
+}
+
+static inline void histMerge(LogHistogram* into, const LogHistogram* from)
+{
+    for(int b = 0; b < HIST_BUCKETS; b++) {
+        into->buckets[b] += from->buckets[b];
+    }
+    into->count += from->count;
+}
+
+// Name: histQuantile
+// Recieves a quantile 0..1
+// Returns the lower end of the bucket it falls in (0 on an empty histogram)
+static inline unsigned long histQuantile(const LogHistogram* hist, double quantile)
+{
+    unsigned long rank = (unsigned long)(quantile * (hist->count - 1)), seen = 0;
+    for(int b = 0; b < HIST_BUCKETS && hist->count > 0; b++)
+    {
+        seen += hist->buckets[b];
+        if(seen > rank) {
+            return histBucketValue(b);
+        }
+    }
+    return 0;
+}
+
+// Name: summaryAdd
+// One return of func
+static inline void summaryAdd(ReturnStats* ret_stats, int value)
+{
+    if(ret_stats->count == 0 || value < ret_stats->min) {
+        ret_stats->min = value;
+    }
+    if(ret_stats->count == 0 || value > ret_stats->max) {
+        ret_stats->max = value;
+    }
+    ret_stats->count++;
+    ret_stats->sum += value;
+    if(value < 0) {
+        histAdd(&ret_stats->negative, -(long)value);
+    }
+    else {
+        histAdd(&ret_stats->positive, value);
+    }
+
+    // Space-Saving: count it if it's there, take a free counter, or else evict the smallest and inherit its count
+    TopKCounter* smallest = &ret_stats->top[0];
+    for(int i = 0; i < ret_stats->top_num; i++)
+    {
+        if(ret_stats->top[i].value == value) {
+            ret_stats->top[i].count++;
+            return;
+        }
+        if(ret_stats->top[i].count < smallest->count) {
+            smallest = &ret_stats->top[i];
+        }
+    }
+    if(ret_stats->top_num < SUMMARY_TOPK_SLOTS) {
+        ret_stats->top[ret_stats->top_num++] = (TopKCounter){ value, 1, 0 };
+        return;
+    }
+    *smallest = (TopKCounter){ value, smallest->count + 1, smallest->count };
+}
+
+// Name: summaryQuantile
+// Quantile over both halves: the negative histogram (by magnitude, so walked backwards) then the positive one
+static inline long summaryQuantile(const ReturnStats* ret_stats, double quantile)
+{
+    unsigned long rank = (unsigned long)(quantile * (ret_stats->count - 1));
+    long value;
+    if(rank < ret_stats->negative.count) {
+        value = -(long)histQuantile(&ret_stats->negative, 1.0 - (double)rank / (ret_stats->negative.count - (ret_stats->negative.count > 1)));
+    }
+    else {
+        unsigned long positive_rank = rank - ret_stats->negative.count;
+        value = histQuantile(&ret_stats->positive, ret_stats->positive.count > 1 ? (double)positive_rank / (ret_stats->positive.count - 1) : 0);
+    }
+    if(value < ret_stats->min) {                                                            // bucket ends can be past the real extremes
+        value = ret_stats->min;
+    }
+    return value > ret_stats->max ? ret_stats->max : value;
+}
+
+static inline int topKCompare(const void* a, const void* b)
+{
+    const TopKCounter *x = a, *y = b;
+    return (x->count < y->count) - (x->count > y->count);
+}
+
+// Name: topKFloor
+// The most a value that isn't among the counters can have been seen: the smallest count once they're all taken
+static inline unsigned long topKFloor(const ReturnStats* ret_stats)
+{
+    unsigned long floor = 0;
+    for(int i = 0; ret_stats->top_num == SUMMARY_TOPK_SLOTS && i < ret_stats->top_num; i++)
+    {
+        if(i == 0 || ret_stats->top[i].count < floor) {
+            floor = ret_stats->top[i].count;
+        }
+    }
+    return floor;
+}
+
+// Name: summaryMerge
+// Adds from into into
+static inline void summaryMerge(ReturnStats* into, const ReturnStats* from)
+{
+    if(from->count == 0) {
+        return;
+    }
+    if(into->count == 0 || from->min < into->min) {
+        into->min = from->min;
+    }
+    if(into->count == 0 || from->max > into->max) {
+        into->max = from->max;
+    }
+    into->count += from->count;
+    into->sum += from->sum;
+    histMerge(&into->negative, &from->negative);
+    histMerge(&into->positive, &from->positive);
+
+    // Both sides' counters, a value missing on one side counted as that side's floor, then the SUMMARY_TOPK_SLOTS biggest
+    TopKCounter all[2 * SUMMARY_TOPK_SLOTS];
+    int all_num = 0;
+    unsigned long into_floor = topKFloor(into), from_floor = topKFloor(from);
+    for(int i = 0; i < into->top_num; i++)
+    {
+        all[all_num] = into->top[i];
+        int j = 0;
+        while(j < from->top_num && from->top[j].value != into->top[i].value) {
+            j++;
+        }
+        if(j < from->top_num) {
+            all[all_num].count += from->top[j].count;
+            all[all_num].error += from->top[j].error;
+        }
+        else {
+            all[all_num].count += from_floor;
+            all[all_num].error += from_floor;
+        }
+        all_num++;
+    }
+    for(int j = 0; j < from->top_num; j++)
+    {
+        int i = 0;
+        while(i < into->top_num && into->top[i].value != from->top[j].value) {
+            i++;
+        }
+        if(i == into->top_num) {
+            all[all_num++] = (TopKCounter){ from->top[j].value, from->top[j].count + into_floor, from->top[j].error + into_floor };
+        }
+    }
+    qsort(all, all_num, sizeof(TopKCounter), topKCompare);
+    into->top_num = all_num < SUMMARY_TOPK_SLOTS ? all_num : SUMMARY_TOPK_SLOTS;
+    memcpy(into->top, all, into->top_num * sizeof(TopKCounter));
+}
+
+// Name: latencyAdd
+// One timed call of func
+static inline void latencyAdd(LatencyStats* latency, unsigned long ns)
+{
+    if(latency->hist.count == 0 || ns < latency->min) {
+        latency->min = ns;
+    }
+    if(ns > latency->max) {
+        latency->max = ns;
+    }
+    latency->sum += ns;
+    histAdd(&latency->hist, ns);
+}
+
+// Name: latencyMerge
+// Adds from into into
+static inline void latencyMerge(LatencyStats* into, const LatencyStats* from)
+{
+    if(from->hist.count == 0) {
+        return;
+    }
+    if(into->hist.count == 0 || from->min < into->min) {
+        into->min = from->min;
+    }
+    if(from->max > into->max) {
+        into->max = from->max;
+    }
+    into->sum += from->sum;
+    histMerge(&into->hist, &from->hist);
+}
+
+// Name: latencyQuantile
+// histQuantile, kept inside the real extremes
+static inline unsigned long latencyQuantile(const LatencyStats* latency, double quantile)
+{
+    unsigned long value = histQuantile(&latency->hist, quantile);
+    if(value < latency->min) {
+        value = latency->min;
+    }
+    return value > latency->max ? latency->max : value;
+}
+
+#endif /* !_PRF_STATS_H_ */
@@ -0,0 +1,420 @@
+#ifndef _PRF_TRACE_H_
+#define _PRF_TRACE_H_ 1
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// =====================================================================================================================================
+// Binary trace files (prf --trace=FILE) - writer and streaming reader.
+//
+// One call is one PrfTraceRecord (fixed size). On disk:
+//
+//   PrfTraceHeader | func_num x PrfTraceFunc | names (exe path + function names, '\0' ended) | blocks...
+//   block = PrfTraceBlock | payload_size bytes of records | padding to 8
+//
+// Every header is 8 byte aligned and little-endian (x86-64 only, so it's just the struct). Inside a block records
+// are varints (LEB128), signed ones zigzag'd, and the call index / entry time are deltas from the record before -
+// the first record of a block is relative to 0, so every block decodes on its own and a file can be split at any
+// block (prf-report does, one chunk per core). A block is written with one write(); a reader mmaps the file and
+// decodes record by record, so it needs no memory of its own however big the file.
+// =====================================================================================================================================
+
+#define PRF_TRACE_MAGIC "PRFTRC01"
+#define PRF_TRACE_BLOCK_MAGIC 0x42465250U                                                   // "PRFB"
+#define PRF_TRACE_VERSION 1
+#define PRF_TRACE_MAX_ARGS 6                                                                // the integer argument registers
+#define PRF_TRACE_BLOCK_RECORDS 4096
+#define PRF_TRACE_MAX_ENCODED (10 * (6 + PRF_TRACE_MAX_ARGS))                               // varints of one record, worst case
+
+typedef struct {
+    uint32_t func_id;                                                                       // index of the function in the header
+    uint32_t tid;                                                                           // 0 = unknown
+    uint64_t call_index;                                                                    // run #
+    uint64_t entry_ns;                                                                      // CLOCK_MONOTONIC, 0 = unknown
+    uint64_t exit_ns;
+    int64_t ret;                                                                            // rax
+    uint32_t arg_num;
+    uint32_t reserved;
+    uint64_t args[PRF_TRACE_MAX_ARGS];                                                      // rdi, rsi, rdx, rcx, r8, r9
+} PrfTraceRecord;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t func_num;
+    uint32_t names_size;                                                                    // bytes of names, padded to 8
+    uint32_t exe_offset;                                                                    // path of the traced executable in names
+    uint64_t stop_overhead;                                                                 // ns each entry -> exit includes for the tracer's stops
+} PrfTraceHeader;
+
+typedef struct {
+    uint64_t address;                                                                       // link time address (its GOT slot for a dynamic one)
+    uint32_t name_offset;                                                                   // in names
+    uint32_t is_dyn;
+} PrfTraceFunc;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t record_num;
+    uint32_t payload_size;
+    uint32_t reserved;
+} PrfTraceBlock;
+
+// Writer state. The block is encoded into buf and written out when full.
+typedef struct {
+    int fd;
+    unsigned char* buf;                                                                     // PrfTraceBlock + payload
+    uint32_t record_num;
+    uint32_t payload_size;
+    uint64_t last_index;
+    uint64_t last_entry;
+    uint64_t written;                                                                       // records in finished blocks
+} PrfTraceWriter;
+
+// Reader state: a cursor over the mmap'd file
+typedef struct {
+    const unsigned char* map;
+    uint64_t size;
+    const PrfTraceHeader* header;
+    const PrfTraceFunc* funcs;
+    const char* names;
+    uint64_t first_block;                                                                   // file offset of the first block
+    uint64_t block;                                                                         // offset of the current block
+    uint64_t end;                                                                           // stop at the block that starts here (prfTraceRange)
+    uint64_t at;                                                                            // next record in it
+    uint32_t left;                                                                          // records left in it
+    uint64_t last_index;
+    uint64_t last_entry;
+} PrfTraceReader;
+
+static inline uint64_t prfTraceBlockBytes(void)
+{
+    return sizeof(PrfTraceBlock) + (uint64_t)PRF_TRACE_BLOCK_RECORDS * PRF_TRACE_MAX_ENCODED + 8;
+}
+
+static inline uint64_t prfTraceAlign8(uint64_t value)
+{
+    return (value + 7) & ~7UL;
+}
+
+// Name: prfTracePut / prfTraceGet
+// One unsigned LEB128 varint. Get returns false at the end of the data.
+static inline unsigned char* prfTracePut(unsigned char* out, uint64_t value)
+{
+    while(value >= 0x80)
+    {
+        *out++ = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (unsigned char)value;
+    return out;
+}
+
+static inline bool prfTraceGet(const unsigned char** in, const unsigned char* end, uint64_t* value)
+{
+    uint64_t result = 0;
+    for(int shift = 0; *in < end && shift < 64; shift += 7)
+    {
+        unsigned char b = *(*in)++;
+        result |= (uint64_t)(b & 0x7F) << shift;
+        if(!(b & 0x80)) {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+static inline uint64_t prfTraceZigzag(int64_t value)
+{
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static inline int64_t prfTraceUnzigzag(uint64_t value)
+{
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+// Name: prfTraceOpen
+// Creates path and writes the header. names[i] / addresses[i] / is_dyn[i] describe function i.
+// Returns false (and nothing open) on failure.
+static inline bool prfTraceOpen(PrfTraceWriter* writer, const char* path, const char* exe, int func_num,
+                                char* const* names, const uint64_t* addresses, const bool* is_dyn, uint64_t stop_overhead)
+{
+    memset(writer, 0, sizeof(PrfTraceWriter));
+    uint64_t names_size = strlen(exe) + 1;
+    for(int f = 0; f < func_num; f++) {
+        names_size += strlen(names[f]) + 1;
+    }
+    uint64_t head_size = sizeof(PrfTraceHeader) + func_num * sizeof(PrfTraceFunc) + prfTraceAlign8(names_size);
+    unsigned char* head = calloc(1, head_size);
+    writer->buf = malloc(prfTraceBlockBytes());
+    writer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(head == NULL || writer->buf == NULL || writer->fd == -1)
+    {
+        free(head);
+        free(writer->buf);
+        if(writer->fd != -1) {
+            close(writer->fd);
+        }
+        return false;
+    }
+
+    PrfTraceHeader* header = (PrfTraceHeader*)head;
+    memcpy(header->magic, PRF_TRACE_MAGIC, 8);
+    header->version = PRF_TRACE_VERSION;
+    header->func_num = func_num;
+    header->names_size = prfTraceAlign8(names_size);
+    header->exe_offset = 0;
+    header->stop_overhead = stop_overhead;
+    PrfTraceFunc* funcs = (PrfTraceFunc*)(header + 1);
+    char* blob = (char*)(funcs + func_num);
+    uint32_t offset = strlen(exe) + 1;
+    memcpy(blob, exe, offset);
+    for(int f = 0; f < func_num; f++)
+    {
+        funcs[f].address = addresses[f];
+        funcs[f].is_dyn = is_dyn[f];
+        funcs[f].name_offset = offset;
+        memcpy(blob + offset, names[f], strlen(names[f]) + 1);
+        offset += strlen(names[f]) + 1;
+    }
+    bool ok = write(writer->fd, head, head_size) == (ssize_t)head_size;
+    free(head);
+    return ok;
+}
+
+// Name: prfTraceFlush
+// Writes the block being built (if it has anything)
+static inline bool prfTraceFlush(PrfTraceWriter* writer)
+{
+    if(writer->record_num == 0) {
+        return true;
+    }
+    PrfTraceBlock* block = (PrfTraceBlock*)writer->buf;
+    block->magic = PRF_TRACE_BLOCK_MAGIC;
+    block->record_num = writer->record_num;
+    block->payload_size = writer->payload_size;
+    block->reserved = 0;
+    uint64_t size = prfTraceAlign8(sizeof(PrfTraceBlock) + writer->payload_size);
+    memset(writer->buf + sizeof(PrfTraceBlock) + writer->payload_size, 0, size - sizeof(PrfTraceBlock) - writer->payload_size);
+    bool ok = write(writer->fd, writer->buf, size) == (ssize_t)size;
+    writer->written += writer->record_num;
+    writer->record_num = 0;
+    writer->payload_size = 0;
+    writer->last_index = 0;
+    writer->last_entry = 0;
+    return ok;
+}
+
+// Name: prfTraceAppend
+// Encodes one record into the block, writes the block out when it's full
+static inline bool prfTraceAppend(PrfTraceWriter* writer, const PrfTraceRecord* rec)
+{
+    unsigned char* start = writer->buf + sizeof(PrfTraceBlock) + writer->payload_size;
+    unsigned char* out = start;
+    uint32_t arg_num = rec->arg_num < PRF_TRACE_MAX_ARGS ? rec->arg_num : PRF_TRACE_MAX_ARGS;
+    out = prfTracePut(out, rec->func_id);
+    out = prfTracePut(out, rec->tid);
+    out = prfTracePut(out, prfTraceZigzag((int64_t)(rec->call_index - writer->last_index)));   // per function, but close together
+    out = prfTracePut(out, prfTraceZigzag((int64_t)(rec->entry_ns - writer->last_entry)));
+    out = prfTracePut(out, rec->exit_ns - rec->entry_ns);                                  // the duration
+    out = prfTracePut(out, prfTraceZigzag(rec->ret));
+    out = prfTracePut(out, arg_num);
+    for(uint32_t a = 0; a < arg_num; a++) {
+        out = prfTracePut(out, prfTraceZigzag((int64_t)rec->args[a]));
+    }
+    writer->last_index = rec->call_index;
+    writer->last_entry = rec->entry_ns;
+    writer->payload_size += out - start;
+    if(++writer->record_num == PRF_TRACE_BLOCK_RECORDS) {
+        return prfTraceFlush(writer);
+    }
+    return true;
+}
+
+// Name: prfTraceSetOverhead
+// The header's stop_overhead, when it's only known after prfTraceOpen
+static inline bool prfTraceSetOverhead(PrfTraceWriter* writer, uint64_t stop_overhead)
+{
+    return pwrite(writer->fd, &stop_overhead, sizeof(stop_overhead), offsetof(PrfTraceHeader, stop_overhead)) == sizeof(stop_overhead);
+}
+
+static inline bool prfTraceClose(PrfTraceWriter* writer)
+{
+    bool ok = prfTraceFlush(writer);
+    ok = close(writer->fd) == 0 && ok;
+    free(writer->buf);
+    writer->buf = NULL;
+    return ok;
+}
+
+// Name: prfTraceNameValid
+// Returns true if offset is inside names and a NUL ends the string there before names does
+static inline bool prfTraceNameValid(const PrfTraceReader* reader, uint32_t offset)
+{
+    uint32_t names_size = reader->header->names_size;
+    return offset < names_size && memchr(reader->names + offset, '\0', names_size - offset) != NULL;
+}
+
+// Name: prfTraceMap
+// Opens a trace for reading (the whole file mmap'd, positioned at the first record)
+// Returns false if it isn't a trace we know.
+static inline bool prfTraceMap(PrfTraceReader* reader, const char* path)
+{
+    memset(reader, 0, sizeof(PrfTraceReader));
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if(fd == -1 || fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(PrfTraceHeader))
+    {
+        if(fd != -1) {
+            close(fd);
+        }
+        return false;
+    }
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) {
+        return false;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);                                              // read once, front to back
+    reader->map = map;
+    reader->size = st.st_size;
+    reader->header = map;
+    if(memcmp(reader->header->magic, PRF_TRACE_MAGIC, 8) != 0 || reader->header->version != PRF_TRACE_VERSION ||
+       sizeof(PrfTraceHeader) + (uint64_t)reader->header->func_num * sizeof(PrfTraceFunc) + reader->header->names_size > reader->size)
+    {
+        munmap(map, st.st_size);
+        return false;
+    }
+    reader->funcs = (const PrfTraceFunc*)(reader->header + 1);
+    reader->names = (const char*)(reader->funcs + reader->header->func_num);
+    bool names_ok = prfTraceNameValid(reader, reader->header->exe_offset);
+    for(uint32_t f = 0; f < reader->header->func_num && names_ok; f++) {
+        names_ok = prfTraceNameValid(reader, reader->funcs[f].name_offset);
+    }
+    if(!names_ok)                                                                           // so names + offset is always a string
+    {
+        munmap(map, st.st_size);
+        return false;
+    }
+    reader->first_block = (const unsigned char*)reader->names + reader->header->names_size - reader->map;
+    reader->block = reader->first_block;
+    reader->end = reader->size;
+    return true;
+}
+
+static inline void prfTraceUnmap(PrfTraceReader* reader)
+{
+    munmap((void*)reader->map, reader->size);
+    reader->map = NULL;
+}
+
+static inline const char* prfTraceFuncName(const PrfTraceReader* reader, uint32_t func_id)
+{
+    return func_id < reader->header->func_num ? reader->names + reader->funcs[func_id].name_offset : "?";
+}
+
+// Name: prfTraceSplit
+// Cuts the file into chunk_num runs of blocks of about the same size, with one walk over the block headers (the
+// records aren't touched): chunk c is the blocks from bounds[c] up to bounds[c + 1], file offsets. A damaged block
+// ends the last chunk.
+static inline void prfTraceSplit(const PrfTraceReader* reader, int chunk_num, uint64_t* bounds)
+{
+    uint64_t block = reader->first_block;
+    uint64_t span = reader->size - reader->first_block;
+    bounds[0] = block;
+    for(int c = 1; c <= chunk_num; c++)
+    {
+        uint64_t offset = c == chunk_num ? reader->size : reader->first_block + span * c / chunk_num;
+        while(block < offset && block + sizeof(PrfTraceBlock) <= reader->size)
+        {
+            const PrfTraceBlock* header = (const PrfTraceBlock*)(reader->map + block);
+            if(header->magic != PRF_TRACE_BLOCK_MAGIC) {
+                block = reader->size;
+                break;
+            }
+            block += prfTraceAlign8(sizeof(PrfTraceBlock) + header->payload_size);
+        }
+        if(block > reader->size || c == chunk_num) {
+            block = reader->size;
+        }
+        bounds[c] = block;
+    }
+}
+
+// Name: prfTraceRange
+// Limits the reader to the blocks from offset from up to offset to (one chunk of prfTraceSplit)
+static inline void prfTraceRange(PrfTraceReader* reader, uint64_t from, uint64_t to)
+{
+    reader->block = from;
+    reader->end = to;
+    reader->at = 0;
+    reader->left = 0;
+}
+
+// Name: prfTraceNext
+// The next record. Returns false at the end (or at a damaged block - everything before it was read).
+static inline bool prfTraceNext(PrfTraceReader* reader, PrfTraceRecord* rec)
+{
+    while(reader->left == 0)                                                                // on to the next block with records
+    {
+        if(reader->at != 0) {                                                               // past the one we were in
+            const PrfTraceBlock* done = (const PrfTraceBlock*)(reader->map + reader->block);
+            reader->block += prfTraceAlign8(sizeof(PrfTraceBlock) + done->payload_size);
+        }
+        if(reader->block >= reader->end || reader->block + sizeof(PrfTraceBlock) > reader->size) {
+            return false;
+        }
+        const PrfTraceBlock* block = (const PrfTraceBlock*)(reader->map + reader->block);
+        if(block->magic != PRF_TRACE_BLOCK_MAGIC || reader->block + sizeof(PrfTraceBlock) + block->payload_size > reader->size) {
+            return false;
+        }
+        reader->at = reader->block + sizeof(PrfTraceBlock);
+        reader->left = block->record_num;
+        reader->last_index = 0;
+        reader->last_entry = 0;
+    }
+
+    const PrfTraceBlock* block = (const PrfTraceBlock*)(reader->map + reader->block);
+    const unsigned char* in = reader->map + reader->at;
+    const unsigned char* end = reader->map + reader->block + sizeof(PrfTraceBlock) + block->payload_size;
+    uint64_t func_id, tid, index, entry, duration, ret, arg_num;
+    if(!prfTraceGet(&in, end, &func_id) || !prfTraceGet(&in, end, &tid) || !prfTraceGet(&in, end, &index) ||
+       !prfTraceGet(&in, end, &entry) || !prfTraceGet(&in, end, &duration) || !prfTraceGet(&in, end, &ret) ||
+       !prfTraceGet(&in, end, &arg_num) || arg_num > PRF_TRACE_MAX_ARGS) {
+        return false;
+    }
+    memset(rec, 0, sizeof(PrfTraceRecord));
+    rec->func_id = func_id;
+    rec->tid = tid;
+    rec->call_index = reader->last_index + prfTraceUnzigzag(index);
+    rec->entry_ns = reader->last_entry + prfTraceUnzigzag(entry);
+    rec->exit_ns = rec->entry_ns + duration;
+    rec->ret = prfTraceUnzigzag(ret);
+    rec->arg_num = arg_num;
+    for(uint64_t a = 0; a < arg_num; a++)
+    {
+        uint64_t arg;
+        if(!prfTraceGet(&in, end, &arg)) {
+            return false;
+        }
+        rec->args[a] = prfTraceUnzigzag(arg);
+    }
+    reader->last_index = rec->call_index;
+    reader->last_entry = rec->entry_ns;
+    reader->at = in - reader->map;
+    if(--reader->left == 0) {                                                               // keep at != 0: the block is done
+        reader->at = reader->block + 1;
+    }
+    return true;
+}
+
+#endif /* !_PRF_TRACE_H_ */
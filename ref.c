@@ -5,13 +5,107 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/user.h>
+#include <signal.h>
+#include <stddef.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <linux/audit.h>
 #include "elf64.h"
 
-#define SYSCALL_OPCODE 0X050F
 #define BREAKPOINT_OPCODE 0xCC
 #define BREAKPOINT_MASKING 0xFFFFFFFFFFFFFF00
-#define TWO_LEAST_SEGNIFICANT_BYTES 0x000000000000FFFF
+#define SYSCALL_SIZE 2
+#define ERESTARTSYS_FIRST 512                                                                // kernel internal errnos of an interrupted syscall
+#define ERESTARTSYS_LAST 516
+#define MAX_FILTERED_SYSCALLS 64
+
+// --syscalls=read,write,...: only these stop the child (seccomp filter + PTRACE_O_TRACESECCOMP), the rest run at full speed
+int filtered_syscalls[MAX_FILTERED_SYSCALLS];
+int filtered_num = 0;
+
+typedef struct {
+    const char *name;
+    int nr;
+} SyscallName;
+
+SyscallName syscall_names[] = {
+    {"read", SYS_read}, {"write", SYS_write}, {"open", SYS_open}, {"openat", SYS_openat}, {"close", SYS_close},
+    {"stat", SYS_stat}, {"fstat", SYS_fstat}, {"lstat", SYS_lstat}, {"lseek", SYS_lseek}, {"mmap", SYS_mmap},
+    {"mprotect", SYS_mprotect}, {"munmap", SYS_munmap}, {"brk", SYS_brk}, {"ioctl", SYS_ioctl},
+    {"pread64", SYS_pread64}, {"pwrite64", SYS_pwrite64}, {"readv", SYS_readv}, {"writev", SYS_writev},
+    {"access", SYS_access}, {"pipe", SYS_pipe}, {"poll", SYS_poll}, {"select", SYS_select}, {"dup", SYS_dup},
+    {"dup2", SYS_dup2}, {"nanosleep", SYS_nanosleep}, {"socket", SYS_socket}, {"connect", SYS_connect},
+    {"accept", SYS_accept}, {"accept4", SYS_accept4}, {"sendto", SYS_sendto}, {"recvfrom", SYS_recvfrom},
+    {"sendmsg", SYS_sendmsg}, {"recvmsg", SYS_recvmsg}, {"bind", SYS_bind}, {"listen", SYS_listen},
+    {"clone", SYS_clone}, {"fork", SYS_fork}, {"execve", SYS_execve}, {"wait4", SYS_wait4}, {"kill", SYS_kill},
+    {"fcntl", SYS_fcntl}, {"fsync", SYS_fsync}, {"getdents64", SYS_getdents64}, {"unlink", SYS_unlink},
+    {"unlinkat", SYS_unlinkat}, {"mkdir", SYS_mkdir}, {"rename", SYS_rename}, {"futex", SYS_futex},
+    {"epoll_wait", SYS_epoll_wait}, {"epoll_ctl", SYS_epoll_ctl}, {"clock_nanosleep", SYS_clock_nanosleep},
+    {"getpid", SYS_getpid}, {NULL, 0}
+};
+
+void fatalError(char *str) {
+    perror(str);
+    exit(1);
+}
+
+// Parses "read,write,openat" (names or numbers) into filtered_syscalls
+void parseSyscalls(char *list) {
+    for (char *name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+        int nr = -1;
+        if (name[0] >= '0' && name[0] <= '9') {
+            nr = atoi(name);
+        }
+        for (int i = 0; nr == -1 && syscall_names[i].name != NULL; i++) {
+            if (strcmp(syscall_names[i].name, name) == 0) {
+                nr = syscall_names[i].nr;
+            }
+        }
+        if (nr == -1) {
+            printf("PRF:: unknown syscall %s\n", name);
+            exit(1);
+        }
+        if (nr == SYS_execve || nr == SYS_execveat) {                                       // the filter is in before our own execv
+            printf("PRF:: --syscalls can't filter %s\n", name);
+            exit(1);
+        }
+        if (filtered_num == MAX_FILTERED_SYSCALLS) {
+            printf("PRF:: --syscalls takes at most %d syscalls\n", MAX_FILTERED_SYSCALLS);
+            exit(1);
+        }
+        filtered_syscalls[filtered_num++] = nr;
+    }
+}
+
+// In the child, before execv: a seccomp filter that returns SECCOMP_RET_TRACE for the chosen syscalls (the tracer
+// gets a PTRACE_EVENT_SECCOMP stop at their entry) and SECCOMP_RET_ALLOW for everything else. The filter is inherited
+// across execv.
+void installSyscallFilter() {
+    struct sock_filter filter[4 + MAX_FILTERED_SYSCALLS + 2];
+    int len = 0;
+    filter[len++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, arch));
+    filter[len++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, AUDIT_ARCH_X86_64, 1, 0);
+    filter[len++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW);     // other ABIs: not ours
+    filter[len++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr));
+    for (int i = 0; i < filtered_num; i++) {
+        // match: jump over the remaining compares and the ALLOW to the TRACE
+        filter[len++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, filtered_syscalls[i], filtered_num - i, 0);
+    }
+    filter[len++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW);
+    filter[len++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_TRACE);
+    struct sock_fprog prog = {len, filter};
+
+    if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) < 0) {                                    // lets an unprivileged process install it
+        fatalError("prctl");
+    }
+    if (prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog) < 0) {
+        fatalError("seccomp");
+    }
+}
 
 pid_t runTarget(int argc, char **argv) {
     pid_t pid;
@@ -23,6 +117,9 @@ pid_t runTarget(int argc, char **argv) {
             perror("ptrace");
             exit(1);
         }
+        if (filtered_num > 0) {
+            installSyscallFilter();
+        }
         if(execv(argv[2], &argv[2]) < 0) {
             perror("execv");
             exit(1);
@@ -35,17 +132,35 @@ pid_t runTarget(int argc, char **argv) {
     return pid;
 }
 
-void fatalError(char *str) {
-    perror(str);
-    exit(1);
-}
-
 void try_ptraced(enum __ptrace_request request, pid_t child_pid, void *addr, void *data) {
     if (ptrace(request, child_pid, addr, data) == -1) {
         fatalError("ptrace");
     }
 }
 
+uint64_t insertBreakpoint(pid_t child_pid, size_t addr) {
+    errno = 0;                                                                              // -1 is also a word the text can hold
+    uint64_t poked_8_bytes = ptrace(PTRACE_PEEKTEXT, child_pid, addr, NULL);
+    if (errno != 0) {
+        fatalError("ptrace");
+    }
+    uint64_t new_8_bytes = (poked_8_bytes & BREAKPOINT_MASKING) | BREAKPOINT_OPCODE;
+    try_ptraced(PTRACE_POKETEXT, child_pid, (void *) addr, (void *) new_8_bytes);
+    return poked_8_bytes;
+}
+
+// Rewinds rip onto the breakpoint at addr and puts the original bytes back
+void removeBreakpoint(pid_t child_pid, size_t addr, uint64_t poked_8_bytes, struct user_regs_struct *regs) {
+    try_ptraced(PTRACE_POKETEXT, child_pid, (void *) addr, (void *) poked_8_bytes);
+    regs->rip -= 1;
+    try_ptraced(PTRACE_SETREGS, child_pid, 0, regs);
+}
+
+// While the function is on the stack the child runs with PTRACE_SYSCALL: it only stops on syscall entry / exit
+// (and on the breakpoint at the return address), instead of after every instruction. At a syscall-exit stop rip is
+// right after the 2 byte syscall instruction and rax holds the result.
+// With --syscalls the child runs with PTRACE_CONT instead: only the filtered syscalls stop it (PTRACE_EVENT_SECCOMP,
+// at the entry), and a PTRACE_SYSCALL from there gets us their syscall-exit stop.
 void runDebug(void *func, pid_t child_pid) {
     int status;
     struct user_regs_struct regs;
@@ -54,58 +169,91 @@ void runDebug(void *func, pid_t child_pid) {
     if (wait(&status) < 0) {
         fatalError("wait");
     }
+    long trace_options = PTRACE_O_TRACESYSGOOD;                                             // syscall stops come as SIGTRAP | 0x80
+    if (filtered_num > 0) {
+        trace_options |= PTRACE_O_TRACESECCOMP;                                             // else SECCOMP_RET_TRACE fails the syscall
+    }
+    try_ptraced(PTRACE_SETOPTIONS, child_pid, 0, (void *) trace_options);
 
     while (!WIFEXITED(status)) {
 
         // putting the breakpoint
-        uint64_t poked_8_bytes = ptrace(PTRACE_PEEKTEXT, child_pid, func, NULL);
-        uint64_t new_8_bytes = (poked_8_bytes & BREAKPOINT_MASKING) | BREAKPOINT_OPCODE;
-        if (poked_8_bytes == -1) {
-            fatalError("ptrace");
-        }
-        try_ptraced(PTRACE_POKETEXT, child_pid, func, (void *) new_8_bytes);
+        uint64_t poked_8_bytes = insertBreakpoint(child_pid, (size_t) func);
 
-        try_ptraced(PTRACE_CONT, child_pid, 0, 0);
-        if (wait(&status) < 0) {
-            fatalError("wait");
-        }
+        do {                                                                                // filtered syscalls outside the function: just go on
+            try_ptraced(PTRACE_CONT, child_pid, 0, 0);
+            if (wait(&status) < 0) {
+                fatalError("wait");
+            }
+        } while (status >> 8 == (SIGTRAP | (PTRACE_EVENT_SECCOMP << 8)));
 
         if (WIFEXITED(status)) {
             break;
         }
 
         try_ptraced(PTRACE_GETREGS, child_pid, 0, &regs);
-        try_ptraced(PTRACE_POKETEXT, child_pid, func, (void *) poked_8_bytes);
-        regs.rip -= 1;
-        try_ptraced(PTRACE_SETREGS, child_pid, 0, &regs);
-        try_ptraced(PTRACE_GETREGS, child_pid, NULL, &regs);
+        removeBreakpoint(child_pid, (size_t) func, poked_8_bytes, &regs);
         rsp = regs.rsp;
 
-        // Done hitting the breakpoint and calculating the rsp of the function
-
+        // Done hitting the breakpoint and calculating the rsp of the function - now one on the return address
+        size_t ret_addr = ptrace(PTRACE_PEEKDATA, child_pid, rsp, NULL);
+        uint64_t ret_8_bytes = insertBreakpoint(child_pid, ret_addr);
+        int in_syscall = 0;
+        enum __ptrace_request run = filtered_num > 0 ? PTRACE_CONT : PTRACE_SYSCALL;
+        enum __ptrace_request resume = run;
 
-        while (WIFSTOPPED(status)) {
-            try_ptraced(PTRACE_GETREGS, child_pid, NULL, &regs);
-            size_t syscall_addr = regs.rip;
-            uint64_t isntruction = ptrace(PTRACE_PEEKTEXT, child_pid, regs.rip, NULL);
-            uint16_t ls_two_bytes = isntruction & TWO_LEAST_SEGNIFICANT_BYTES;
-            if (regs.rsp == rsp + 8) {
+        while (1) {
+            try_ptraced(resume, child_pid, NULL, NULL);
+            if (wait(&status) < 0) {
+                fatalError("wait");
+            }
+            if (!WIFSTOPPED(status)) {
                 break;
             }
-            try_ptraced(PTRACE_SINGLESTEP, child_pid, NULL, NULL);
-            wait(&status);
+            resume = run;
 
-            if (ls_two_bytes == SYSCALL_OPCODE) {
+            if (status >> 8 == (SIGTRAP | (PTRACE_EVENT_SECCOMP << 8))) {                  // entry of a filtered syscall
+                in_syscall = 1;
+                resume = PTRACE_SYSCALL;                                                    // to its syscall-exit stop
+                continue;
+            }
+            if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+                in_syscall = !in_syscall;
+                if (in_syscall) {
+                    continue;
+                }
                 try_ptraced(PTRACE_GETREGS, child_pid, NULL, &regs);
-                if ((long int) regs.rax < 0) {
-                    printf("PRF:: syscall in %x returned with %ld\n", (unsigned int) syscall_addr, (long int) regs.rax);
+                long int ret = (long int) regs.rax;
+                if (ret < 0 && !(ret <= -ERESTARTSYS_FIRST && ret >= -ERESTARTSYS_LAST)) {  // the kernel restarts those itself
+                    printf("PRF:: syscall in %x returned with %ld\n", (unsigned int) (regs.rip - SYSCALL_SIZE), ret);
                 }
+                continue;
+            }
+
+            try_ptraced(PTRACE_GETREGS, child_pid, NULL, &regs);
+            if (WSTOPSIG(status) != SIGTRAP || regs.rip - 1 != ret_addr) {
+                continue;
+            }
+            removeBreakpoint(child_pid, ret_addr, ret_8_bytes, &regs);
+            if (regs.rsp == rsp + 8) {                                                      // the function returned
+                break;
             }
+            try_ptraced(PTRACE_SINGLESTEP, child_pid, NULL, NULL);                           // same address, deeper call - not ours yet
+            wait(&status);
+            if (!WIFSTOPPED(status)) {
+                break;
+            }
+            insertBreakpoint(child_pid, ret_addr);
         }
     }
 }
 
 int main(int argc, char *argv[]) {
+    if (argc > 1 && strncmp(argv[1], "--syscalls=", 11) == 0) {                             // ref [--syscalls=a,b,..] func prog [args]
+        parseSyscalls(argv[1] + 11);
+        argv++;
+        argc--;
+    }
     FILE *file = fopen(argv[2], "r");
     Elf64_Ehdr header;
     fread(&header, 1, sizeof(Elf64_Ehdr), file);